@@ -0,0 +1,613 @@
+/* bench.c - Benchmark driver of the ExFS2 File System
+ *
+ * Runs add, lookup, read, list and remove over a matrix of file-size classes,
+ * directory fan-outs and fill levels through the library API, and prints one
+ * JSON object per line: a header describing the build and the layout, then
+ * one record per operation of each case with its throughput, latency
+ * percentiles, the syscall and I/O counts of /proc/self/io and the library's
+ * own counters (stats.c) that changed.
+ *
+ * A case stores 'files' files of one size spread round-robin over 'fanout'
+ * directories, reads them back, lists the directories and removes them. A
+ * fill level stores that many bytes first and leaves them in place for the
+ * cases that follow, with a free hole after every stored filler file.
+ */
+#include "exfs2.h"
+#include <dirent.h>
+#include <sys/resource.h>
+
+#define BENCH_MAX_LIST 32              /* entries of a --sizes, --fanouts or --fills list */
+#define BENCH_MEMORY_MAX (256LL << 20) /* bigger files are streamed from a local file with exfs2_add */
+#define BENCH_READ_CHUNK (4 << 20)     /* bytes per exfs2_read call */
+#define BENCH_FILL_FILE (256 << 10)    /* size of the filler files of a fill level */
+#define BENCH_SOURCE_FILE "bench_source"
+#define BENCH_SHIFTS 2048              /* distinct contents of case files, and again of filler files */
+
+enum { DATA_RANDOM, DATA_TEXT, DATA_ZERO };
+
+typedef struct {
+    long long sizes[BENCH_MAX_LIST];
+    int num_sizes;
+    long long fanouts[BENCH_MAX_LIST];
+    int num_fanouts;
+    long long fills[BENCH_MAX_LIST];
+    int num_fills;
+    long long max_files;        /* files per case at most */
+    long long budget;           /* bytes per case, which sets the file count of big classes */
+    int data;
+    int sync_each;              /* commit after every add and remove, as each CLI command does */
+    int reopen;                 /* reopen before every operation but add: cold caches */
+    int keep;
+    const char* directory;
+} bench_options_t;
+
+typedef struct {
+    uint64_t rchar, wchar, syscr, syscw, read_bytes, write_bytes;
+    long minflt, majflt, nvcsw, nivcsw;
+} bench_usage_t;
+
+// Latencies and counters of one operation over one case
+typedef struct {
+    const char* op;
+    double* latencies;
+    long long count;
+    long long capacity;
+    long long bytes;
+    long long errors;
+    double start;
+    bench_usage_t usage;
+    uint64_t counters[STAT_COUNTERS];
+} bench_phase_t;
+
+typedef struct {
+    long long fill;
+    long long size;
+    long long files;
+    long long fanout;
+} bench_case_t;
+
+static bench_options_t options;
+static exfs2_fs_t* fs;
+static FILE* out;               /* the JSON records; the library's own messages go to /dev/null */
+static char* data_buffer;       /* file contents, one byte further in per file so blocks differ */
+static size_t data_length;
+static long long filled_bytes;
+static long long filler_files;
+static bench_usage_t probe_cost;   /* what reading the counters adds to them */
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parse a size in bytes with an optional K, M or G suffix; returns -1 if 'text' is not one
+static long long parse_size(const char* text) {
+    char* end;
+    errno = 0;
+    long long value = strtoll(text, &end, 10);
+    if (errno != 0 || end == text || value < 0) return -1;
+    if (*end == 'K' || *end == 'k') {
+        value <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        value <<= 20;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        value <<= 30;
+        end++;
+    }
+    return *end == '\0' ? value : -1;
+}
+
+// Parse a comma-separated list of sizes; returns the number of entries, -1 if one is bad
+static int parse_list(const char* text, long long* values) {
+    char copy[512];
+    snprintf(copy, sizeof(copy), "%s", text);
+    int count = 0;
+    char* save;
+    for (char* item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        if (count == BENCH_MAX_LIST || (values[count] = parse_size(item)) < 0) return -1;
+        count++;
+    }
+    return count;
+}
+
+static void read_usage(bench_usage_t* usage) {
+    memset(usage, 0, sizeof(*usage));
+    FILE* fp = fopen("/proc/self/io", "r");
+    if (fp) {
+        char name[32];
+        unsigned long long value;
+        while (fscanf(fp, "%31[^:]: %llu\n", name, &value) == 2) {
+            if (strcmp(name, "rchar") == 0) usage->rchar = value;
+            else if (strcmp(name, "wchar") == 0) usage->wchar = value;
+            else if (strcmp(name, "syscr") == 0) usage->syscr = value;
+            else if (strcmp(name, "syscw") == 0) usage->syscw = value;
+            else if (strcmp(name, "read_bytes") == 0) usage->read_bytes = value;
+            else if (strcmp(name, "write_bytes") == 0) usage->write_bytes = value;
+        }
+        fclose(fp);
+    }
+
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        usage->minflt = ru.ru_minflt;
+        usage->majflt = ru.ru_majflt;
+        usage->nvcsw = ru.ru_nvcsw;
+        usage->nivcsw = ru.ru_nivcsw;
+    }
+}
+
+// Fill 'length' bytes with the contents --data asks for
+static void generate_data(char* buffer, size_t length, uint64_t seed) {
+    if (options.data == DATA_ZERO) {
+        memset(buffer, 0, length);
+    } else if (options.data == DATA_TEXT) {
+        // Log lines: compress several times over, but every line differs
+        size_t done = 0;
+        unsigned long line = seed;
+        while (done < length) {
+            char text[128];
+            int n = snprintf(text, sizeof(text), "2026-10-14T12:%02lu:%02lu.%06lu INFO worker=%lu request=%lu status=%s\n",
+                             line / 60 % 60, line % 60, line * 7919 % 1000000, line % 16, line,
+                             line % 97 ? "ok" : "retry");
+            size_t chunk = (size_t)n < length - done ? (size_t)n : length - done;
+            memcpy(buffer + done, text, chunk);
+            done += chunk;
+            line++;
+        }
+    } else {
+        uint64_t state = seed * 0x9E3779B97F4A7C15ULL + 1;
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            uint64_t word = state * 0x2545F4914F6CDD1DULL;
+            memcpy(buffer + i, &word, sizeof(word));
+        }
+        memset(buffer + i, 0x5a, length - i);
+    }
+}
+
+// Contents of file 'index' of a case, or of the filler
+static const char* file_data(long long index, int filler) {
+    return data_buffer + index % BENCH_SHIFTS + (filler ? BENCH_SHIFTS : 0);
+}
+
+// Close and reopen the file system, dropping every cache but the kernel's
+static int reopen_fs(void) {
+    exfs2_close(fs);
+    fs = exfs2_open(options.directory);
+    return fs ? 0 : -1;
+}
+
+static void phase_begin(bench_phase_t* phase, const char* op, long long capacity) {
+    memset(phase, 0, sizeof(*phase));
+    phase->op = op;
+    phase->capacity = capacity > 0 ? capacity : 1;
+    phase->latencies = malloc(phase->capacity * sizeof(double));
+    read_usage(&phase->usage);
+    stats_read_counters(phase->counters);
+    phase->start = now_seconds();
+}
+
+// Record one operation that started at 'started'
+static void phase_record(bench_phase_t* phase, double started, long long bytes, int ok) {
+    double elapsed = now_seconds() - started;
+    if (phase->latencies && phase->count < phase->capacity) phase->latencies[phase->count] = elapsed;
+    phase->count++;
+    if (ok) {
+        phase->bytes += bytes;
+    } else {
+        phase->errors++;
+    }
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of the sorted latencies, in microseconds
+static double percentile(const bench_phase_t* phase, double p) {
+    long long n = phase->count < phase->capacity ? phase->count : phase->capacity;
+    if (n == 0 || !phase->latencies) return 0;
+    long long rank = (long long)(p / 100 * n + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > n) rank = n;
+    return phase->latencies[rank - 1] * 1e6;
+}
+
+static void phase_end(bench_phase_t* phase, const bench_case_t* c) {
+    double seconds = now_seconds() - phase->start;
+    bench_usage_t usage;
+    read_usage(&usage);
+    uint64_t counters[STAT_COUNTERS];
+    stats_read_counters(counters);
+    usage.syscr -= probe_cost.syscr;
+    usage.rchar -= probe_cost.rchar;
+
+    long long n = phase->count < phase->capacity ? phase->count : phase->capacity;
+    if (phase->latencies) qsort(phase->latencies, n, sizeof(double), compare_doubles);
+    double sum = 0;
+    for (long long i = 0; phase->latencies && i < n; i++) sum += phase->latencies[i];
+
+    fprintf(out, "{\"op\":\"%s\",\"fill\":%lld,\"size\":%lld,\"files\":%lld,\"fanout\":%lld,"
+                 "\"count\":%lld,\"errors\":%lld,\"bytes\":%lld,\"seconds\":%.6f,"
+                 "\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+                 "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},"
+                 "\"syscalls\":{\"read\":%" PRIu64 ",\"write\":%" PRIu64 "},"
+                 "\"io\":{\"rchar\":%" PRIu64 ",\"wchar\":%" PRIu64 ",\"read_bytes\":%" PRIu64 ",\"write_bytes\":%" PRIu64 "},"
+                 "\"faults\":{\"minor\":%ld,\"major\":%ld},\"switches\":{\"voluntary\":%ld,\"involuntary\":%ld},"
+                 "\"counters\":{",
+            phase->op, c->fill, c->size, c->files, c->fanout,
+            phase->count, phase->errors, phase->bytes, seconds,
+            seconds > 0 ? phase->count / seconds : 0, seconds > 0 ? phase->bytes / seconds / (1 << 20) : 0,
+            n ? sum / n * 1e6 : 0, percentile(phase, 50), percentile(phase, 90), percentile(phase, 99),
+            percentile(phase, 100),
+            usage.syscr - phase->usage.syscr, usage.syscw - phase->usage.syscw,
+            usage.rchar - phase->usage.rchar, usage.wchar - phase->usage.wchar,
+            usage.read_bytes - phase->usage.read_bytes, usage.write_bytes - phase->usage.write_bytes,
+            usage.minflt - phase->usage.minflt, usage.majflt - phase->usage.majflt,
+            usage.nvcsw - phase->usage.nvcsw, usage.nivcsw - phase->usage.nivcsw);
+    const char* separator = "";
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+        if (counters[i] == phase->counters[i]) continue;
+        fprintf(out, "%s\"%s\":%" PRIu64, separator, stats_counter_name(i), counters[i] - phase->counters[i]);
+        separator = ",";
+    }
+    fprintf(out, "}}\n");
+    fflush(out);
+    free(phase->latencies);
+}
+
+// With --reopen, start an operation on cold caches
+static void cold_start(void) {
+    if (options.reopen && reopen_fs() != 0) fprintf(stderr, "Failed to reopen the file system\n");
+}
+
+// Commit as its own operation, so add and remove are timed without it
+static void timed_sync(const bench_case_t* c) {
+    bench_phase_t phase;
+    phase_begin(&phase, "sync", 1);
+    double started = now_seconds();
+    phase_record(&phase, started, 0, exfs2_sync(fs) == 0);
+    phase_end(&phase, c);
+}
+
+// Write the local file big classes are streamed from, once for the largest of them
+static int make_source_file(long long size) {
+    struct stat st;
+    if (stat(BENCH_SOURCE_FILE, &st) == 0 && st.st_size >= size) return 0;
+
+    FILE* fp = fopen(BENCH_SOURCE_FILE, "wb");
+    if (!fp) return -1;
+    char* chunk = malloc(BENCH_READ_CHUNK);
+    int result = chunk ? 0 : -1;
+    for (long long done = 0; result == 0 && done < size; done += BENCH_READ_CHUNK) {
+        size_t length = size - done < BENCH_READ_CHUNK ? size - done : BENCH_READ_CHUNK;
+        generate_data(chunk, length, done / BENCH_READ_CHUNK + 1);
+        if (fwrite(chunk, 1, length, fp) != length) result = -1;
+    }
+    free(chunk);
+    if (fclose(fp) != 0) result = -1;
+    return result;
+}
+
+// Store one file; classes too big for memory go through exfs2_add like -a
+static int add_one(const char* path, long long index, long long size) {
+    if (size > BENCH_MEMORY_MAX) {
+        exfs2_add(path, BENCH_SOURCE_FILE);
+        exfs2_stat_t st;
+        return exfs2_lookup(fs, path, &st) == 0 && (long long)st.size == size ? 0 : -1;
+    }
+    return exfs2_write(fs, path, file_data(index, 0), size);
+}
+
+// Read a whole file back in BENCH_READ_CHUNK pieces
+static int read_one(const char* path, long long size, char* buffer) {
+    for (long long done = 0; done < size; ) {
+        size_t want = size - done < BENCH_READ_CHUNK ? size - done : BENCH_READ_CHUNK;
+        ssize_t got = exfs2_read(fs, path, buffer, want, done);
+        if (got != (ssize_t)want) return -1;
+        done += got;
+    }
+    return 0;
+}
+
+static int count_entry(const char* name, int inode_num, int type, void* ctx) {
+    (void)name;
+    (void)inode_num;
+    (void)type;
+    (*(long long*)ctx)++;
+    return 0;
+}
+
+static void case_path(char* path, size_t length, const bench_case_t* c, long long index) {
+    snprintf(path, length, "/bench/d%04lld/f%07lld", index % c->fanout, index);
+}
+
+static void run_case(const bench_case_t* c, char* read_buffer) {
+    char path[MAX_PATH];
+    bench_phase_t phase;
+
+    phase_begin(&phase, "add", c->files);
+    for (long long i = 0; i < c->files; i++) {
+        case_path(path, sizeof(path), c, i);
+        double started = now_seconds();
+        int ok = add_one(path, i, c->size) == 0;
+        if (ok && options.sync_each) ok = exfs2_sync(fs) == 0;
+        phase_record(&phase, started, c->size, ok);
+    }
+    phase_end(&phase, c);
+    if (!options.sync_each) timed_sync(c);
+
+    cold_start();
+    phase_begin(&phase, "lookup", c->files);
+    for (long long i = 0; i < c->files; i++) {
+        case_path(path, sizeof(path), c, i);
+        exfs2_stat_t st;
+        double started = now_seconds();
+        int ok = exfs2_lookup(fs, path, &st) == 0 && (long long)st.size == c->size;
+        phase_record(&phase, started, 0, ok);
+    }
+    phase_end(&phase, c);
+
+    cold_start();
+    phase_begin(&phase, "read", c->files);
+    for (long long i = 0; i < c->files; i++) {
+        case_path(path, sizeof(path), c, i);
+        double started = now_seconds();
+        int ok = read_one(path, c->size, read_buffer) == 0;
+        phase_record(&phase, started, c->size, ok);
+    }
+    phase_end(&phase, c);
+
+    // One listing per directory
+    long long num_dirs = c->fanout < c->files ? c->fanout : c->files;
+    cold_start();
+    phase_begin(&phase, "list", num_dirs);
+    for (long long d = 0; d < num_dirs; d++) {
+        snprintf(path, sizeof(path), "/bench/d%04lld", d);
+        long long entries = 0;
+        double started = now_seconds();
+        int ok = exfs2_readdir(fs, path, count_entry, &entries) == 0 &&
+                 entries == (c->files - d + c->fanout - 1) / c->fanout;
+        phase_record(&phase, started, 0, ok);
+    }
+    phase_end(&phase, c);
+
+    cold_start();
+    phase_begin(&phase, "remove", c->files);
+    for (long long i = 0; i < c->files; i++) {
+        case_path(path, sizeof(path), c, i);
+        double started = now_seconds();
+        int ok = exfs2_unlink(fs, path) == 0;
+        if (ok && options.sync_each) ok = exfs2_sync(fs) == 0;
+        phase_record(&phase, started, 0, ok);
+    }
+    phase_end(&phase, c);
+
+    // The emptied directories are not part of the next case
+    exfs2_unlink(fs, "/bench");
+    if (!options.sync_each) timed_sync(c);
+}
+
+// Grow the stored filler to 'level' bytes: twice as many files are added and
+// every other one removed, so the allocator has holes to work around
+static void fill_to(long long level) {
+    bench_case_t c = { level, BENCH_FILL_FILE, 0, 64 };
+    long long target = (level + BENCH_FILL_FILE - 1) / BENCH_FILL_FILE * 2;
+    if (target <= filler_files) return;
+    c.files = target - filler_files;
+
+    char path[MAX_PATH];
+    bench_phase_t phase;
+    phase_begin(&phase, "fill", c.files);
+    for (long long i = filler_files; i < target; i++) {
+        snprintf(path, sizeof(path), "/fill/d%02lld/f%07lld", i % c.fanout, i);
+        double started = now_seconds();
+        phase_record(&phase, started, BENCH_FILL_FILE, exfs2_write(fs, path, file_data(i, 1), BENCH_FILL_FILE) == 0);
+    }
+    for (long long i = filler_files + 1; i < target; i += 2) {
+        snprintf(path, sizeof(path), "/fill/d%02lld/f%07lld", i % c.fanout, i);
+        exfs2_unlink(fs, path);
+    }
+    phase_end(&phase, &c);
+    timed_sync(&c);
+
+    filler_files = target;
+    filled_bytes = target / 2 * BENCH_FILL_FILE;
+}
+
+// Remove the segment files of a file system this run created, and its directory
+static void remove_directory(const char* directory) {
+    DIR* dir = opendir(directory);
+    if (!dir) return;
+    struct dirent* entry;
+    char path[MAX_PATH * 2];
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+    rmdir(directory);
+}
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "  --dir <path>        Directory of the file system (default: a new one, removed afterwards)\n");
+    fprintf(stderr, "  --sizes <list>      File sizes, with K/M/G suffixes (default 32,4K,64K,1M,16M,64M)\n");
+    fprintf(stderr, "  --fanouts <list>    Directories the files of a case are spread over (default 1,64)\n");
+    fprintf(stderr, "  --fills <list>      Bytes stored before the cases, in increasing order (default 0,64M)\n");
+    fprintf(stderr, "  --files <n>         Files per case at most (default 512)\n");
+    fprintf(stderr, "  --budget <n>        Bytes per case, fewer files for big sizes (default 64M)\n");
+    fprintf(stderr, "  --data <kind>       random, text or zero (default random)\n");
+    fprintf(stderr, "  --sync-each         Commit after every add and remove\n");
+    fprintf(stderr, "  --reopen            Reopen the file system before each operation but add\n");
+    fprintf(stderr, "  --keep              Keep the file system of the run\n");
+    fprintf(stderr, "  --mmap, --pread, --uring, --sync-io, --compress, --dedup, --segment-size <n>\n");
+    fprintf(stderr, "                      As for exfs2\n");
+}
+
+int main(int argc, char* argv[]) {
+    const char* sizes = "32,4K,64K,1M,16M,64M";
+    const char* fanouts = "1,64";
+    const char* fills = "0,64M";
+    options.max_files = 512;
+    options.budget = 64LL << 20;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        int takes_value = 1;
+        if (strcmp(arg, "--dir") == 0 && value) {
+            options.directory = value;
+        } else if (strcmp(arg, "--sizes") == 0 && value) {
+            sizes = value;
+        } else if (strcmp(arg, "--fanouts") == 0 && value) {
+            fanouts = value;
+        } else if (strcmp(arg, "--fills") == 0 && value) {
+            fills = value;
+        } else if (strcmp(arg, "--files") == 0 && value) {
+            if ((options.max_files = parse_size(value)) <= 0) {
+                fprintf(stderr, "Invalid file count: %s\n", value);
+                return 1;
+            }
+        } else if (strcmp(arg, "--budget") == 0 && value) {
+            if ((options.budget = parse_size(value)) <= 0) {
+                fprintf(stderr, "Invalid byte count: %s\n", value);
+                return 1;
+            }
+        } else if (strcmp(arg, "--data") == 0 && value) {
+            if (strcmp(value, "random") == 0) options.data = DATA_RANDOM;
+            else if (strcmp(value, "text") == 0) options.data = DATA_TEXT;
+            else if (strcmp(value, "zero") == 0) options.data = DATA_ZERO;
+            else {
+                fprintf(stderr, "Unknown data kind: %s\n", value);
+                return 1;
+            }
+        } else if (strcmp(arg, "--segment-size") == 0 && value) {
+            new_segment_size = parse_size(value);
+            if (new_segment_size <= 0) {
+                fprintf(stderr, "Invalid segment size: %s\n", value);
+                return 1;
+            }
+        } else {
+            takes_value = 0;
+            if (strcmp(arg, "--sync-each") == 0) options.sync_each = 1;
+            else if (strcmp(arg, "--reopen") == 0) options.reopen = 1;
+            else if (strcmp(arg, "--keep") == 0) options.keep = 1;
+            else if (strcmp(arg, "--mmap") == 0) segment_io_mode = SEGMENT_IO_MMAP;
+            else if (strcmp(arg, "--pread") == 0) segment_io_mode = SEGMENT_IO_PREAD;
+            else if (strcmp(arg, "--uring") == 0) io_engine_mode = IO_ENGINE_URING;
+            else if (strcmp(arg, "--sync-io") == 0) io_engine_mode = IO_ENGINE_SYNC;
+            else if (strcmp(arg, "--compress") == 0) compress_files = 1;
+            else if (strcmp(arg, "--dedup") == 0) dedup_files = 1;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        i += takes_value;
+    }
+
+    options.num_sizes = parse_list(sizes, options.sizes);
+    options.num_fanouts = parse_list(fanouts, options.fanouts);
+    options.num_fills = parse_list(fills, options.fills);
+    if (options.num_sizes <= 0 || options.num_fanouts <= 0 || options.num_fills <= 0) {
+        fprintf(stderr, "Invalid --sizes, --fanouts or --fills list\n");
+        return 1;
+    }
+    for (int i = 0; i < options.num_fanouts; i++) {
+        if (options.fanouts[i] == 0) options.fanouts[i] = 1;
+    }
+
+    // One buffer holds the contents of every in-memory file and of the filler
+    long long largest = BENCH_FILL_FILE, streamed = 0;
+    for (int i = 0; i < options.num_sizes; i++) {
+        if (options.sizes[i] > BENCH_MEMORY_MAX) {
+            if (options.sizes[i] > streamed) streamed = options.sizes[i];
+        } else if (options.sizes[i] > largest) {
+            largest = options.sizes[i];
+        }
+    }
+    data_length = largest + 2 * BENCH_SHIFTS;
+    data_buffer = malloc(data_length);
+    char* read_buffer = malloc(BENCH_READ_CHUNK);
+    if (!data_buffer || !read_buffer) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    generate_data(data_buffer, data_length, 1);
+    if (streamed && make_source_file(streamed) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", BENCH_SOURCE_FILE, strerror(errno));
+        return 1;
+    }
+
+    char temp_directory[] = "bench_fs.XXXXXX";
+    int created = 0;
+    if (!options.directory) {
+        if (!mkdtemp(temp_directory)) {
+            fprintf(stderr, "Failed to create a directory: %s\n", strerror(errno));
+            return 1;
+        }
+        options.directory = temp_directory;
+        created = 1;
+    }
+
+    // The library reports what it does on stdout; keep that out of the records
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (!out || !freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "Failed to redirect stdout\n");
+        return 1;
+    }
+
+    bench_usage_t before;
+    read_usage(&before);
+    read_usage(&probe_cost);
+    probe_cost.syscr -= before.syscr;
+    probe_cost.rchar -= before.rchar;
+
+    fs = exfs2_open(options.directory);
+    if (!fs) {
+        fprintf(stderr, "Failed to open the file system in %s\n", options.directory);
+        return 1;
+    }
+
+    fprintf(out, "{\"bench\":\"exfs2\",\"revision\":\"0x%08x\",\"block_size\":%d,\"segment_size\":%lld,"
+                 "\"io\":\"%s\",\"engine\":\"%s\",\"compress\":%d,\"dedup\":%d,\"data\":\"%s\","
+                 "\"sync_each\":%d,\"reopen\":%d,\"threads\":%d}\n",
+            EXFS2_FORMAT_REVISION, BLOCK_SIZE, (long long)segment_size,
+            segment_io_mode == SEGMENT_IO_MMAP ? "mmap" : "pread",
+            io_engine_mode == IO_ENGINE_URING ? "uring" : "sync", compress_files, dedup_files,
+            options.data == DATA_TEXT ? "text" : options.data == DATA_ZERO ? "zero" : "random",
+            options.sync_each, options.reopen, extract_threads);
+    fflush(out);
+
+    for (int f = 0; f < options.num_fills; f++) {
+        fill_to(options.fills[f]);
+        for (int s = 0; s < options.num_sizes; s++) {
+            long long files = options.budget / (options.sizes[s] ? options.sizes[s] : 1);
+            if (files > options.max_files) files = options.max_files;
+            if (files < 1) files = 1;
+            for (int n = 0; n < options.num_fanouts; n++) {
+                // More directories than files would only repeat the case before
+                if (n > 0 && options.fanouts[n - 1] >= files) break;
+                bench_case_t c = { filled_bytes, options.sizes[s], files, options.fanouts[n] };
+                run_case(&c, read_buffer);
+            }
+        }
+    }
+
+    exfs2_close(fs);
+    if (created && !options.keep) remove_directory(options.directory);
+    if (streamed) unlink(BENCH_SOURCE_FILE);
+    free(data_buffer);
+    free(read_buffer);
+    fclose(out);
+    return 0;
+}
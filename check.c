@@ -0,0 +1,569 @@
+/* check.c - Consistency checker of the ExFS2 File System
+ *
+ * Worker threads take the inode segments one at a time and read each in a few
+ * large sequential chunks, skipping chunks whose bitmap bits are all clear.
+ * The blocks of every inode in use are gathered with collect_owned_blocks()
+ * and marked in a reference bitmap spanning all data segments; a block marked
+ * again goes on the worker's list of repeats. Directory entries mark the
+ * inodes they name the same way. Then every data segment's bitmap block, with
+ * its shared block table, is read once and compared with the references.
+ *
+ * A repair brings the allocator in line with the inodes: leaked blocks and
+ * inodes are freed, held blocks marked used, reference counts rewritten and
+ * inodes no directory names removed. All of it goes out in one journal commit.
+ */
+#include "exfs2.h"
+#include <limits.h>
+#include <time.h>
+
+#define CHECK_SCAN_INODES 256       /* inodes read per sequential chunk (1 MB) */
+#define CHECK_REPORT_LIMIT 32       /* problems listed one by one */
+
+enum {
+    PROBLEM_LEAKED_BLOCK,       /* allocated, but no inode holds it */
+    PROBLEM_FREE_BLOCK,         /* held by an inode, but marked free */
+    PROBLEM_CROSS_LINKED,       /* held more than once with no shared block entry */
+    PROBLEM_REFERENCE_COUNT,    /* shared block entry disagrees with the holders */
+    PROBLEM_BAD_POINTER,        /* pointer outside the data segments */
+    PROBLEM_UNREADABLE,         /* block tree could not be read */
+    PROBLEM_LEAKED_INODE,       /* allocated, but holds no inode */
+    PROBLEM_ORPHAN,             /* in use, but no directory entry names it */
+    PROBLEM_DANGLING_ENTRY,     /* an entry names an inode that is not there */
+    PROBLEM_EXTRA_LINK,         /* named by more than one entry */
+    PROBLEMS
+};
+
+static const char* problem_names[] = {
+    "leaked blocks", "held blocks marked free", "cross-linked blocks", "wrong reference counts",
+    "block pointers out of range", "unreadable inodes", "leaked inodes", "orphaned inodes",
+    "entries naming no inode", "inodes named twice",
+};
+
+_Static_assert(sizeof(problem_names) / sizeof(problem_names[0]) == PROBLEMS, "a problem has no name");
+
+typedef enum { FIX_FREE_INODE, FIX_BLOCK_REFS, FIX_MARK_BLOCK, FIX_FREE_BLOCK, FIX_REMOVE_INODE } fix_kind_t;
+
+typedef struct {
+    fix_kind_t kind;
+    int64_t unit;               /* block id or inode number */
+    int extra;                  /* FIX_BLOCK_REFS: references beyond the first */
+} check_fix_t;
+
+typedef struct check check_t;
+
+typedef struct {
+    check_t* check;
+    block_id_t* repeats;        /* blocks met again after their first holder */
+    int num_repeats;
+    int repeats_capacity;
+    check_fix_t* fixes;
+    int num_fixes;
+    int fixes_capacity;
+    int64_t files, inline_files, compressed_files, file_bytes, dirs;
+    int64_t data_blocks, pointer_blocks, dir_blocks;
+    int64_t blocks_used, shared_blocks, extra_refs;
+    int64_t problems[PROBLEMS];
+    int failed;                 /* a segment could not be read, or no memory */
+} check_worker_t;
+
+struct check {
+    int inode_segments;
+    int data_segments;
+    int inodes_per_segment;
+    int64_t total_inodes;
+    int64_t total_blocks;
+    uint64_t* inodes_valid;     /* allocated inodes holding an inode */
+    uint64_t* inodes_named;     /* inodes a directory entry names */
+    uint64_t* blocks_held;      /* blocks some inode holds */
+    uint64_t* blocks_in_dirs;   /* blocks a directory holds */
+    block_id_t* repeats;        /* every worker's repeats, sorted */
+    int num_repeats;
+    int phase;                  /* 0: inode segments, 1: data segments */
+    int next_segment;
+    check_worker_t* workers;
+    int num_workers;
+    pthread_mutex_t report_lock;
+    int reported;
+};
+
+typedef struct {
+    check_worker_t* worker;
+    int dir_inode_num;
+} entry_check_t;
+
+// Set bit n of a word array shared by the workers; returns its old value
+static int mark(uint64_t* bits, int64_t n) {
+    uint64_t mask = 1ULL << (n % 64);
+    return (__atomic_fetch_or(&bits[n / 64], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+static int marked(const uint64_t* bits, int64_t n) {
+    return (bits[n / 64] >> (n % 64)) & 1;
+}
+
+// Count a problem, and print it while fewer than CHECK_REPORT_LIMIT have been
+static void report(check_worker_t* worker, int problem, const char* format, ...) {
+    check_t* check = worker->check;
+    worker->problems[problem]++;
+
+    pthread_mutex_lock(&check->report_lock);
+    if (check->reported++ < CHECK_REPORT_LIMIT) {
+        va_list args;
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+        putchar('\n');
+    }
+    pthread_mutex_unlock(&check->report_lock);
+}
+
+static void add_fix(check_worker_t* worker, fix_kind_t kind, int64_t unit, int extra) {
+    if (worker->num_fixes == worker->fixes_capacity) {
+        int new_capacity = worker->fixes_capacity ? worker->fixes_capacity * 2 : 64;
+        check_fix_t* grown = realloc(worker->fixes, new_capacity * sizeof(check_fix_t));
+        if (!grown) {
+            worker->failed = 1;
+            return;
+        }
+        worker->fixes = grown;
+        worker->fixes_capacity = new_capacity;
+    }
+    worker->fixes[worker->num_fixes++] = (check_fix_t){ kind, unit, extra };
+}
+
+// Note that an inode holds block_id, counting it under 'tally' on first sight
+static void hold_block(check_worker_t* worker, int inode_num, block_id_t block_id, int64_t* tally, int in_dir) {
+    check_t* check = worker->check;
+    if (block_id < 0 || block_id >= check->total_blocks) {
+        report(worker, PROBLEM_BAD_POINTER, "inode %d points to block %lld outside the data segments",
+               inode_num, (long long)block_id);
+        return;
+    }
+    if (in_dir) mark(check->blocks_in_dirs, block_id);
+    if (!mark(check->blocks_held, block_id)) {
+        (*tally)++;
+        return;
+    }
+
+    if (worker->num_repeats == worker->repeats_capacity) {
+        int new_capacity = worker->repeats_capacity ? worker->repeats_capacity * 2 : 1024;
+        block_id_t* grown = realloc(worker->repeats, new_capacity * sizeof(block_id_t));
+        if (!grown) {
+            worker->failed = 1;
+            return;
+        }
+        worker->repeats = grown;
+        worker->repeats_capacity = new_capacity;
+    }
+    worker->repeats[worker->num_repeats++] = block_id;
+}
+
+static int check_entry(const char* name, int inode_num, int type, void* ctx) {
+    (void)type;
+    entry_check_t* entry = ctx;
+    check_t* check = entry->worker->check;
+    if (inode_num < 0 || inode_num >= check->total_inodes) {
+        report(entry->worker, PROBLEM_DANGLING_ENTRY, "entry '%s' of directory %d names inode %d, past the inode segments",
+               name, entry->dir_inode_num, inode_num);
+    } else if (mark(check->inodes_named, inode_num)) {
+        report(entry->worker, PROBLEM_EXTRA_LINK, "inode %d is named again by '%s' in directory %d",
+               inode_num, name, entry->dir_inode_num);
+    }
+    return 0;
+}
+
+static int is_inode_record(const inode_t* inode) {
+    return (inode->type == INODE_FILE || inode->type == INODE_DIR) &&
+           inode->revision >= EXFS2_OLDEST_REVISION && inode->revision <= EXFS2_FORMAT_REVISION &&
+           inode->num_direct >= 0 && inode->num_direct <= MAX_DIRECT_BLOCKS;
+}
+
+// Mark everything one allocated inode holds
+static void check_inode(check_worker_t* worker, int inode_num, inode_t* inode) {
+    check_t* check = worker->check;
+    if (!is_inode_record(inode)) {
+        report(worker, PROBLEM_LEAKED_INODE, "inode %d is allocated but holds no inode", inode_num);
+        add_fix(worker, FIX_FREE_INODE, inode_num, 0);
+        return;
+    }
+    mark(check->inodes_valid, inode_num);
+
+    int is_dir = inode->type == INODE_DIR;
+    if (is_dir) {
+        worker->dirs++;
+    } else {
+        worker->files++;
+        worker->file_bytes += inode->size;
+        if (inode->flags & INODE_FLAG_INLINE) {
+            worker->inline_files++;
+            return;
+        }
+        if (inode->flags & INODE_FLAG_COMPRESSED) worker->compressed_files++;
+    }
+
+    block_map_t data, nodes;
+    if (collect_owned_blocks(inode, &data, &nodes) != 0) {
+        report(worker, PROBLEM_UNREADABLE, "inode %d: its block tree could not be read", inode_num);
+        return;
+    }
+    for (int i = 0; i < data.count; i++) {
+        hold_block(worker, inode_num, data.blocks[i], is_dir ? &worker->dir_blocks : &worker->data_blocks, is_dir);
+    }
+    for (int i = 0; i < nodes.count; i++) {
+        hold_block(worker, inode_num, nodes.blocks[i], &worker->pointer_blocks, is_dir);
+    }
+    free_block_map(&data);
+    free_block_map(&nodes);
+
+    if (is_dir) {
+        entry_check_t entry = { worker, inode_num };
+        iterate_dir(inode, check_entry, &entry);
+    }
+}
+
+static void check_inode_segment(check_worker_t* worker, int segment_number, inode_t* chunk) {
+    check_t* check = worker->check;
+    int units = check->inodes_per_segment;
+    int bitmap_bytes = (units + 7) / 8;
+    uint8_t bitmap[BLOCK_SIZE];
+    if (read_bitmap(segment_number, INODE_SEGMENT, bitmap, bitmap_bytes) != bitmap_bytes) {
+        fprintf(stderr, "Failed to read the bitmap of inode segment %d\n", segment_number);
+        worker->failed = 1;
+        return;
+    }
+
+    for (int first = 0; first < units; first += CHECK_SCAN_INODES) {
+        int count = units - first < CHECK_SCAN_INODES ? units - first : CHECK_SCAN_INODES;
+        int in_use = 0;
+        for (int i = first; i < first + count && !in_use; i++) in_use = (bitmap[i / 8] >> (i % 8)) & 1;
+        if (!in_use) continue;
+
+        if (segment_read(segment_number, INODE_SEGMENT, chunk, count * sizeof(inode_t),
+                         BLOCK_SIZE + (off_t)first * sizeof(inode_t)) != 0) {
+            fprintf(stderr, "Failed to read inode segment %d\n", segment_number);
+            worker->failed = 1;
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            int bit = first + i;
+            if ((bitmap[bit / 8] >> (bit % 8)) & 1) {
+                check_inode(worker, segment_number * units + bit, &chunk[i]);
+            }
+        }
+    }
+}
+
+// Compare one data segment's bitmap and shared block table with the references
+static void check_data_segment(check_worker_t* worker, int segment_number, uint8_t* bitmap_block) {
+    check_t* check = worker->check;
+    int units = blocks_per_segment;
+    block_id_t base = (block_id_t)segment_number * units;
+    if (segment_read(segment_number, DATA_SEGMENT, bitmap_block, BLOCK_SIZE, 0) != 0) {
+        fprintf(stderr, "Failed to read the bitmap of data segment %d\n", segment_number);
+        worker->failed = 1;
+        return;
+    }
+    stats_count(STAT_BITMAP_READS, 1);
+
+    for (int i = 0; i < units; i++) {
+        int used = (bitmap_block[i / 8] >> (i % 8)) & 1;
+        int held = marked(check->blocks_held, base + i);
+        worker->blocks_used += used;
+        if (used && !held && base + i != RESERVED_DATA_BLOCK) {
+            report(worker, PROBLEM_LEAKED_BLOCK, "block %lld is allocated but no inode holds it", (long long)(base + i));
+            add_fix(worker, FIX_FREE_BLOCK, base + i, 0);
+        } else if (!used && held) {
+            report(worker, PROBLEM_FREE_BLOCK, "block %lld is held by an inode but marked free", (long long)(base + i));
+            add_fix(worker, FIX_MARK_BLOCK, base + i, 0);
+        }
+    }
+
+    block_refs_t* refs = (block_refs_t*)(bitmap_block + BLOCK_REFS_OFFSET);
+    int num_refs = refs->count;
+    if (num_refs > (int)MAX_BLOCK_REFS) {
+        report(worker, PROBLEM_REFERENCE_COUNT, "data segment %d has a corrupt shared block table", segment_number);
+        num_refs = 0;
+    }
+
+    // Walk the table (sorted by index) and this segment's repeats side by side
+    int low = 0, high = check->num_repeats;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (check->repeats[middle] < base) low = middle + 1;
+        else high = middle;
+    }
+    int next_ref = 0, next_repeat = low;
+    for (;;) {
+        block_id_t from_table = next_ref < num_refs ? base + refs->refs[next_ref].index : LLONG_MAX;
+        block_id_t repeated = next_repeat < check->num_repeats && check->repeats[next_repeat] < base + units
+                              ? check->repeats[next_repeat] : LLONG_MAX;
+        block_id_t block_id = from_table < repeated ? from_table : repeated;
+        if (block_id == LLONG_MAX) break;
+
+        int recorded = 0, found = 0;
+        if (block_id == from_table) recorded = refs->refs[next_ref++].extra;
+        while (next_repeat < check->num_repeats && check->repeats[next_repeat] == block_id) {
+            found++;
+            next_repeat++;
+        }
+        if (block_id >= base + units) {
+            report(worker, PROBLEM_REFERENCE_COUNT, "data segment %d lists block index %d, past its blocks",
+                   segment_number, (int)(block_id - base));
+            continue;
+        }
+
+        int index = block_id - base;
+        int held = marked(check->blocks_held, block_id);
+        if (found > 0) {
+            worker->shared_blocks++;
+            worker->extra_refs += found;
+        }
+        // A held block's table entry counts its holders past the first; a
+        // leaked block's entry goes when the block is freed
+        if (found == recorded || (!held && ((bitmap_block[index / 8] >> (index % 8)) & 1))) continue;
+
+        // Directories are changed in place, so no other inode can take their blocks
+        int fixable = found == 0 || !marked(check->blocks_in_dirs, block_id);
+        if (recorded == 0) {
+            report(worker, PROBLEM_CROSS_LINKED, "block %lld is held %d times%s", (long long)block_id, found + 1,
+                   fixable ? "" : ", by a directory");
+        } else {
+            report(worker, PROBLEM_REFERENCE_COUNT, "block %lld is held %d times, its shared block entry says %d",
+                   (long long)block_id, held ? found + 1 : 0, recorded + 1);
+        }
+        if (fixable) add_fix(worker, FIX_BLOCK_REFS, block_id, found);
+    }
+}
+
+static void* check_worker_main(void* arg) {
+    check_worker_t* worker = arg;
+    check_t* check = worker->check;
+    int limit = check->phase == 0 ? check->inode_segments : check->data_segments;
+    void* buffer = malloc(CHECK_SCAN_INODES * sizeof(inode_t));
+    if (!buffer) {
+        worker->failed = 1;
+        return NULL;
+    }
+
+    int segment_number;
+    while ((segment_number = __atomic_fetch_add(&check->next_segment, 1, __ATOMIC_RELAXED)) < limit) {
+        if (check->phase == 0) {
+            check_inode_segment(worker, segment_number, buffer);
+        } else {
+            check_data_segment(worker, segment_number, buffer);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Run one phase over every segment of its type on all workers
+static void run_phase(check_t* check, int phase) {
+    check->phase = phase;
+    check->next_segment = 0;
+
+    pthread_t threads[check->num_workers];
+    int started = 0;
+    for (; started < check->num_workers - 1; started++) {
+        if (pthread_create(&threads[started], NULL, check_worker_main, &check->workers[started + 1]) != 0) break;
+    }
+    check_worker_main(&check->workers[0]);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+}
+
+static int compare_blocks(const void* a, const void* b) {
+    block_id_t x = *(const block_id_t*)a;
+    block_id_t y = *(const block_id_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Gather and sort the repeats of all workers for the data segment phase
+static int merge_repeats(check_t* check) {
+    int total = 0;
+    for (int i = 0; i < check->num_workers; i++) total += check->workers[i].num_repeats;
+    check->repeats = malloc((total ? total : 1) * sizeof(block_id_t));
+    if (!check->repeats) return -1;
+
+    for (int i = 0; i < check->num_workers; i++) {
+        check_worker_t* worker = &check->workers[i];
+        memcpy(check->repeats + check->num_repeats, worker->repeats, worker->num_repeats * sizeof(block_id_t));
+        check->num_repeats += worker->num_repeats;
+    }
+    qsort(check->repeats, check->num_repeats, sizeof(block_id_t), compare_blocks);
+    return 0;
+}
+
+static int count_segments(int segment_type) {
+    int count = 0;
+    while (open_segment(count, segment_type) >= 0) count++;
+    return count;
+}
+
+// Apply one fix; leaked blocks and orphans are only freed when every inode
+// could be walked, since an unreadable one may hold them
+static int apply_fix(const check_fix_t* fix, int may_free) {
+    switch (fix->kind) {
+    case FIX_FREE_INODE:
+        return free_inode(fix->unit);
+    case FIX_BLOCK_REFS:
+        return repair_block_refs(fix->unit, fix->extra);
+    case FIX_MARK_BLOCK:
+        return repair_block_bit(fix->unit, 1);
+    case FIX_FREE_BLOCK:
+        return may_free ? repair_block_bit(fix->unit, 0) : -1;
+    case FIX_REMOVE_INODE:
+        return may_free ? exfs2_remove_recursive(fix->unit) : -1;
+    }
+    return -1;
+}
+
+static void free_check(check_t* check) {
+    for (int i = 0; i < check->num_workers; i++) {
+        free(check->workers[i].repeats);
+        free(check->workers[i].fixes);
+    }
+    free(check->workers);
+    free(check->inodes_valid);
+    free(check->inodes_named);
+    free(check->blocks_held);
+    free(check->blocks_in_dirs);
+    free(check->repeats);
+    pthread_mutex_destroy(&check->report_lock);
+}
+
+// Check every inode and data segment, print what the file system holds and
+// what is wrong with it, and with 'repair' set fix what can be fixed. Returns
+// the number of problems left, or -1 if the check could not be completed.
+int exfs2_check(int repair) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    check_t check = {0};
+    pthread_mutex_init(&check.report_lock, NULL);
+    check.inode_segments = count_segments(INODE_SEGMENT);
+    check.data_segments = count_segments(DATA_SEGMENT);
+    check.inodes_per_segment = (segment_size - BLOCK_SIZE) / sizeof(inode_t);
+    check.total_inodes = (int64_t)check.inode_segments * check.inodes_per_segment;
+    check.total_blocks = (int64_t)check.data_segments * blocks_per_segment;
+    check.num_workers = extract_threads > 0 ? extract_threads : 1;
+
+    size_t inode_words = check.total_inodes / 64 + 1;
+    size_t block_words = check.total_blocks / 64 + 1;
+    check.workers = calloc(check.num_workers, sizeof(check_worker_t));
+    check.inodes_valid = calloc(inode_words, sizeof(uint64_t));
+    check.inodes_named = calloc(inode_words, sizeof(uint64_t));
+    check.blocks_held = calloc(block_words, sizeof(uint64_t));
+    check.blocks_in_dirs = calloc(block_words, sizeof(uint64_t));
+    if (!check.workers || !check.inodes_valid || !check.inodes_named || !check.blocks_held || !check.blocks_in_dirs) {
+        fprintf(stderr, "Not enough memory to check the file system\n");
+        free_check(&check);
+        return -1;
+    }
+    for (int i = 0; i < check.num_workers; i++) check.workers[i].check = &check;
+
+    // Phase 1: what the inodes hold
+    run_phase(&check, 0);
+    int failed = merge_repeats(&check) != 0;
+
+    // Inodes in use that nothing names, and entries naming no inode. The root
+    // is the one inode no entry names.
+    check_worker_t* main_worker = &check.workers[0];
+    for (int64_t n = 0; n < check.total_inodes && !failed; n++) {
+        int named = marked(check.inodes_named, n), valid = marked(check.inodes_valid, n);
+        if (named && !valid) {
+            report(main_worker, PROBLEM_DANGLING_ENTRY, "inode %lld is named by a directory entry but holds no inode",
+                   (long long)n);
+        } else if (valid && !named && n != ROOT_DIR_INODE) {
+            report(main_worker, PROBLEM_ORPHAN, "inode %lld is in use but no directory names it", (long long)n);
+            add_fix(main_worker, FIX_REMOVE_INODE, n, 0);
+        }
+    }
+
+    // Phase 2: what the segment bitmaps say
+    if (!failed) run_phase(&check, 1);
+
+    check_worker_t total = {0};
+    for (int i = 0; i < check.num_workers; i++) {
+        check_worker_t* w = &check.workers[i];
+        total.files += w->files;
+        total.inline_files += w->inline_files;
+        total.compressed_files += w->compressed_files;
+        total.file_bytes += w->file_bytes;
+        total.dirs += w->dirs;
+        total.data_blocks += w->data_blocks;
+        total.pointer_blocks += w->pointer_blocks;
+        total.dir_blocks += w->dir_blocks;
+        total.blocks_used += w->blocks_used;
+        total.shared_blocks += w->shared_blocks;
+        total.extra_refs += w->extra_refs;
+        failed |= w->failed;
+        for (int p = 0; p < PROBLEMS; p++) total.problems[p] += w->problems[p];
+    }
+    if (failed) {
+        fprintf(stderr, "Check incomplete: a segment could not be read or memory ran out\n");
+        free_check(&check);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (check.reported > CHECK_REPORT_LIMIT) printf("(%d more not listed)\n", check.reported - CHECK_REPORT_LIMIT);
+    printf("Checked %d inode segments and %d data segments in %.2f s with %d threads\n",
+           check.inode_segments, check.data_segments, seconds, check.num_workers);
+    printf("Inodes: %lld in use of %lld: %lld files (%lld inline, %lld compressed, %lld bytes), %lld directories\n",
+           (long long)(total.files + total.dirs), (long long)check.total_inodes, (long long)total.files,
+           (long long)total.inline_files, (long long)total.compressed_files, (long long)total.file_bytes,
+           (long long)total.dirs);
+    printf("Blocks: %lld in use of %lld: %lld file data, %lld pointer, %lld directory\n",
+           (long long)total.blocks_used, (long long)check.total_blocks, (long long)total.data_blocks,
+           (long long)total.pointer_blocks, (long long)total.dir_blocks);
+    printf("Shared: %lld blocks held %lld extra times\n", (long long)total.shared_blocks, (long long)total.extra_refs);
+
+    int64_t problems = 0;
+    for (int p = 0; p < PROBLEMS; p++) {
+        if (total.problems[p] == 0) continue;
+        printf("  %lld %s\n", (long long)total.problems[p], problem_names[p]);
+        problems += total.problems[p];
+    }
+    if (problems == 0) {
+        printf("No problems found.\n");
+        free_check(&check);
+        return 0;
+    }
+
+    int may_free = total.problems[PROBLEM_UNREADABLE] == 0 && total.problems[PROBLEM_BAD_POINTER] == 0;
+    if (!may_free) printf("Leaked blocks and orphans stay: some inodes could not be walked\n");
+    if (!repair) {
+        int fixable = 0;
+        for (int i = 0; i < check.num_workers; i++) {
+            for (int f = 0; f < check.workers[i].num_fixes; f++) {
+                fix_kind_t kind = check.workers[i].fixes[f].kind;
+                fixable += may_free || (kind != FIX_FREE_BLOCK && kind != FIX_REMOVE_INODE);
+            }
+        }
+        printf("%lld problems found; -F --repair fixes %d of them\n", (long long)problems, fixable);
+        free_check(&check);
+        return problems > INT_MAX ? INT_MAX : (int)problems;
+    }
+
+    // Free inodes first and blocks last, so a freed block has lost its shared
+    // block entry already; removing the orphans then frees what they held
+    int64_t repaired = 0;
+    for (int kind = FIX_FREE_INODE; kind <= FIX_REMOVE_INODE; kind++) {
+        for (int i = 0; i < check.num_workers; i++) {
+            check_worker_t* w = &check.workers[i];
+            for (int f = 0; f < w->num_fixes; f++) {
+                if ((int)w->fixes[f].kind == kind && apply_fix(&w->fixes[f], may_free) == 0) repaired++;
+            }
+        }
+    }
+    if (journal_commit() != 0) {
+        fprintf(stderr, "Failed to commit the repairs\n");
+        free_check(&check);
+        return -1;
+    }
+
+    printf("Repaired %lld of %lld problems\n", (long long)repaired, (long long)problems);
+    free_check(&check);
+    return problems - repaired > INT_MAX ? INT_MAX : (int)(problems - repaired);
+}
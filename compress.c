@@ -0,0 +1,184 @@
+/* compress.c - LZ77 block codec of the ExFS2 File System
+ *
+ * The stream is a series of sequences in the LZ4 block format: a token byte
+ * with the literal count in its high and the match length minus 4 in its low
+ * nibble (15: more length bytes follow, each 255 meaning "add and continue"),
+ * the literals, then a 2-byte little-endian match offset and the extra match
+ * length bytes. The last sequence has literals only.
+ */
+#include "exfs2.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_SKIP_SHIFT 6               /* misses before the scan starts skipping ahead */
+#define LZ_WILD_COPY 16               /* step of the copies that may overrun their end */
+
+static uint32_t lz_read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Bytes from p and ref that are equal, up to 'end'
+static size_t lz_match_length(const uint8_t* p, const uint8_t* ref, const uint8_t* end) {
+    const uint8_t* start = p;
+    while (p + sizeof(uint64_t) <= end) {
+        uint64_t a, b;
+        memcpy(&a, p, sizeof(a));
+        memcpy(&b, ref, sizeof(b));
+        if (a != b) return p - start + __builtin_ctzll(a ^ b) / 8;
+        p += sizeof(uint64_t);
+        ref += sizeof(uint64_t);
+    }
+    while (p < end && *p == *ref) {
+        p++;
+        ref++;
+    }
+    return p - start;
+}
+
+// Append one sequence; match_length 0 ends the stream. Returns NULL when it does not fit.
+static uint8_t* lz_emit(uint8_t* op, const uint8_t* op_end, const uint8_t* literals, size_t num_literals,
+                        size_t offset, size_t match_length) {
+    size_t needed = 1 + num_literals / 255 + 1 + num_literals + 2 + match_length / 255 + 1;
+    if (needed > (size_t)(op_end - op)) return NULL;
+
+    size_t extra = match_length ? match_length - LZ_MIN_MATCH : 0;
+    *op++ = (uint8_t)(((num_literals < 15 ? num_literals : 15) << 4) | (extra < 15 ? extra : 15));
+    if (num_literals >= 15) {
+        size_t rest = num_literals - 15;
+        for (; rest >= 255; rest -= 255) *op++ = 255;
+        *op++ = (uint8_t)rest;
+    }
+    memcpy(op, literals, num_literals);
+    op += num_literals;
+
+    if (match_length) {
+        *op++ = (uint8_t)(offset & 0xff);
+        *op++ = (uint8_t)(offset >> 8);
+        if (extra >= 15) {
+            size_t rest = extra - 15;
+            for (; rest >= 255; rest -= 255) *op++ = 255;
+            *op++ = (uint8_t)rest;
+        }
+    }
+    return op;
+}
+
+// Compress 'length' bytes into dst; returns the compressed size, or 0 if it
+// would not fit in 'capacity' bytes
+size_t lz_compress(const void* src, size_t length, void* dst, size_t capacity) {
+    const uint8_t* base = src;
+    const uint8_t* ip = base;
+    const uint8_t* anchor = base;
+    const uint8_t* end = base + length;
+    uint8_t* op = dst;
+    const uint8_t* op_end = op + capacity;
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    while (ip + LZ_MIN_MATCH <= end) {
+        uint32_t sequence = lz_read32(ip);
+        uint32_t h = lz_hash(sequence);
+        const uint8_t* ref = base + table[h];
+        table[h] = (uint32_t)(ip - base);
+
+        if (ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != sequence) {
+            // Incompressible stretches are crossed in growing steps
+            ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        size_t match_length = LZ_MIN_MATCH + lz_match_length(ip + LZ_MIN_MATCH, ref + LZ_MIN_MATCH, end);
+        op = lz_emit(op, op_end, anchor, ip - anchor, ip - ref, match_length);
+        if (!op) return 0;
+        ip += match_length;
+        anchor = ip;
+        if (ip + LZ_MIN_MATCH <= end) {
+            table[lz_hash(lz_read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+        }
+    }
+
+    op = lz_emit(op, op_end, anchor, end - anchor, 0, 0);
+    return op ? (size_t)(op - (uint8_t*)dst) : 0;
+}
+
+// Copy at least 'length' bytes in LZ_WILD_COPY steps, writing (and reading) up to
+// LZ_WILD_COPY - 1 bytes past the end. dst must not start within a step of src.
+static void lz_wild_copy(uint8_t* dst, const uint8_t* src, size_t length) {
+    uint8_t* end = dst + length;
+    do {
+        memcpy(dst, src, LZ_WILD_COPY);
+        dst += LZ_WILD_COPY;
+        src += LZ_WILD_COPY;
+    } while (dst < end);
+}
+
+// Read the continuation bytes of a length; returns -1 past the end of the input
+static int lz_read_length(const uint8_t** ip, const uint8_t* ip_end, size_t* length) {
+    uint8_t byte;
+    do {
+        if (*ip >= ip_end) return -1;
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+// Decompress 'length' bytes into dst; returns the decompressed size, or -1 if
+// the input is corrupt or would not fit in 'capacity' bytes
+ssize_t lz_decompress(const void* src, size_t length, void* dst, size_t capacity) {
+    const uint8_t* ip = src;
+    const uint8_t* ip_end = ip + length;
+    uint8_t* op = dst;
+    uint8_t* op_end = op + capacity;
+
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+
+        size_t num_literals = token >> 4;
+        if (num_literals == 15 && lz_read_length(&ip, ip_end, &num_literals) != 0) return -1;
+        if (num_literals > (size_t)(ip_end - ip) || num_literals > (size_t)(op_end - op)) return -1;
+        if (num_literals + LZ_WILD_COPY <= (size_t)(ip_end - ip) &&
+            num_literals + LZ_WILD_COPY <= (size_t)(op_end - op)) {
+            lz_wild_copy(op, ip, num_literals);
+        } else {
+            memcpy(op, ip, num_literals);
+        }
+        ip += num_literals;
+        op += num_literals;
+        if (ip == ip_end) break;
+
+        if (ip_end - ip < 2) return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t*)dst)) return -1;
+
+        size_t match_length = token & 15;
+        if (match_length == 15 && lz_read_length(&ip, ip_end, &match_length) != 0) return -1;
+        match_length += LZ_MIN_MATCH;
+        if (match_length > (size_t)(op_end - op)) return -1;
+
+        // An overlapping match repeats the last 'offset' bytes; each copy doubles
+        // the repeated stretch, so no copy overlaps its source
+        const uint8_t* match = op - offset;
+        if (offset >= LZ_WILD_COPY && match_length + LZ_WILD_COPY <= (size_t)(op_end - op)) {
+            lz_wild_copy(op, match, match_length);
+            op += match_length;
+            continue;
+        }
+        while (match_length > 0) {
+            size_t chunk = (size_t)(op - match);
+            if (chunk > match_length) chunk = match_length;
+            memcpy(op, match, chunk);
+            op += chunk;
+            match_length -= chunk;
+        }
+    }
+    return op - (uint8_t*)dst;
+}
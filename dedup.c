@@ -0,0 +1,251 @@
+/* dedup.c - Block fingerprint index of the ExFS2 File System
+ *
+ * Maps the fingerprint of a stored data block to the block, one block per
+ * fingerprint, plus the reverse map so a freed block can be dropped. A match
+ * is only a hint: callers compare the contents before sharing a block. The
+ * index is loaded from DEDUP_INDEX_FILE when the file system is opened and
+ * saved when it is closed.
+ */
+#include "exfs2.h"
+
+#define DEDUP_INDEX_MAGIC 0x49584533u      /* "3EXI" */
+#define DEDUP_EMPTY -1                     /* block of an unused slot */
+
+#define HASH_PRIME1 11400714785074694791ULL
+#define HASH_PRIME2 14029467366897019727ULL
+#define HASH_PRIME3 1609587929392839161ULL
+
+typedef struct {
+    uint64_t fingerprint;
+    int64_t block_id;
+} dedup_entry_t;
+
+// Open addressing with linear probing, keyed by fingerprint or by block
+typedef struct {
+    dedup_entry_t* slots;
+    size_t capacity;            /* a power of two, or 0 */
+    size_t count;
+    int by_block;
+} dedup_table_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t block_size;
+    uint64_t count;
+} dedup_file_header_t;
+
+static dedup_table_t by_fingerprint = { NULL, 0, 0, 0 };
+static dedup_table_t by_block = { NULL, 0, 0, 1 };
+static int index_loaded = 0;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t rotl64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// 64-bit fingerprint of one block: four multiply-rotate lanes (the xxHash64
+// round) over 32 bytes per step, folded together
+uint64_t dedup_fingerprint(const void* block) {
+    const uint8_t* p = block;
+    uint64_t lanes[4] = { HASH_PRIME1 + HASH_PRIME2, HASH_PRIME2, 0, -HASH_PRIME1 };
+
+    for (size_t offset = 0; offset < BLOCK_SIZE; offset += 4 * sizeof(uint64_t)) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t word;
+            memcpy(&word, p + offset + lane * sizeof(uint64_t), sizeof(word));
+            lanes[lane] = rotl64(lanes[lane] + word * HASH_PRIME2, 31) * HASH_PRIME1;
+        }
+    }
+
+    uint64_t hash = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME3;
+    return hash ^ (hash >> 32);
+}
+
+static size_t table_home(const dedup_table_t* table, const dedup_entry_t* entry) {
+    uint64_t key = table->by_block ? (uint64_t)entry->block_id * HASH_PRIME1 : entry->fingerprint;
+    return (key ^ (key >> 29)) & (table->capacity - 1);
+}
+
+// Slot holding the entry with the same key as 'probe', or the empty slot where it would go
+static size_t table_find(const dedup_table_t* table, const dedup_entry_t* probe) {
+    size_t i = table_home(table, probe);
+    while (table->slots[i].block_id != DEDUP_EMPTY) {
+        if (table->by_block ? table->slots[i].block_id == probe->block_id
+                            : table->slots[i].fingerprint == probe->fingerprint) {
+            break;
+        }
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return i;
+}
+
+static int table_grow(dedup_table_t* table) {
+    size_t new_capacity = table->capacity ? table->capacity * 2 : 4096;
+    dedup_entry_t* slots = malloc(new_capacity * sizeof(dedup_entry_t));
+    if (!slots) return -1;
+    for (size_t i = 0; i < new_capacity; i++) slots[i].block_id = DEDUP_EMPTY;
+
+    dedup_table_t grown = { slots, new_capacity, table->count, table->by_block };
+    for (size_t i = 0; i < table->capacity; i++) {
+        if (table->slots[i].block_id != DEDUP_EMPTY) {
+            grown.slots[table_find(&grown, &table->slots[i])] = table->slots[i];
+        }
+    }
+    free(table->slots);
+    *table = grown;
+    return 0;
+}
+
+// Insert or replace the entry with the key of 'entry'; returns the one replaced
+// through 'old' (block DEDUP_EMPTY if there was none)
+static int table_put(dedup_table_t* table, const dedup_entry_t* entry, dedup_entry_t* old) {
+    if ((table->count + 1) * 2 > table->capacity && table_grow(table) != 0) return -1;
+    size_t i = table_find(table, entry);
+    *old = table->slots[i];
+    if (old->block_id == DEDUP_EMPTY) table->count++;
+    table->slots[i] = *entry;
+    return 0;
+}
+
+// Empty slot i, shifting later entries of its probe run back so lookups still find them
+static void table_remove_slot(dedup_table_t* table, size_t i) {
+    size_t mask = table->capacity - 1;
+    for (size_t j = (i + 1) & mask; table->slots[j].block_id != DEDUP_EMPTY; j = (j + 1) & mask) {
+        size_t home = table_home(table, &table->slots[j]);
+        // Move the entry unless its home lies cyclically in (i, j]
+        int stays = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+        if (!stays) {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+    table->slots[i].block_id = DEDUP_EMPTY;
+    table->count--;
+}
+
+static void table_remove(dedup_table_t* table, const dedup_entry_t* probe) {
+    if (table->capacity == 0) return;
+    size_t i = table_find(table, probe);
+    if (table->slots[i].block_id != DEDUP_EMPTY) table_remove_slot(table, i);
+}
+
+static void table_free(dedup_table_t* table) {
+    free(table->slots);
+    table->slots = NULL;
+    table->capacity = 0;
+    table->count = 0;
+}
+
+// Caller holds index_lock
+static void index_put(uint64_t fingerprint, block_id_t block_id) {
+    dedup_entry_t entry = { fingerprint, block_id };
+    dedup_entry_t old;
+    if (table_put(&by_fingerprint, &entry, &old) != 0) return;
+    if (old.block_id != DEDUP_EMPTY && old.block_id != block_id) table_remove(&by_block, &old);
+    if (table_put(&by_block, &entry, &old) != 0) {
+        table_remove(&by_fingerprint, &entry);
+        return;
+    }
+
+    // The block held other contents before: its old fingerprint no longer leads to it
+    if (old.block_id != DEDUP_EMPTY && old.fingerprint != fingerprint) {
+        size_t i = table_find(&by_fingerprint, &old);
+        if (by_fingerprint.slots[i].block_id == block_id) table_remove_slot(&by_fingerprint, i);
+    }
+}
+
+// Load the index saved in 'filename'; a missing file leaves it empty
+int dedup_index_load(const char* filename) {
+    pthread_mutex_lock(&index_lock);
+    index_loaded = 1;
+    FILE* fp = fopen(filename, "rb");
+    int result = 0;
+    if (fp) {
+        dedup_file_header_t header;
+        if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != DEDUP_INDEX_MAGIC ||
+            header.block_size != BLOCK_SIZE) {
+            fprintf(stderr, "Ignoring unreadable fingerprint index %s\n", filename);
+            result = -1;
+        }
+        dedup_entry_t entry;
+        for (uint64_t i = 0; result == 0 && i < header.count; i++) {
+            if (fread(&entry, sizeof(entry), 1, fp) != 1) break;
+            if (entry.block_id >= 0) index_put(entry.fingerprint, entry.block_id);
+        }
+        fclose(fp);
+    }
+    pthread_mutex_unlock(&index_lock);
+    return result;
+}
+
+// Write the index to 'filename' through a temporary file renamed into place
+int dedup_index_save(const char* filename) {
+    char temp[MAX_PATH + 8];
+    snprintf(temp, sizeof(temp), "%s.new", filename);
+
+    pthread_mutex_lock(&index_lock);
+    FILE* fp = fopen(temp, "wb");
+    int result = fp ? 0 : -1;
+    dedup_file_header_t header = { DEDUP_INDEX_MAGIC, BLOCK_SIZE, by_fingerprint.count };
+    if (fp && fwrite(&header, sizeof(header), 1, fp) != 1) result = -1;
+    for (size_t i = 0; result == 0 && i < by_fingerprint.capacity; i++) {
+        if (by_fingerprint.slots[i].block_id == DEDUP_EMPTY) continue;
+        if (fwrite(&by_fingerprint.slots[i], sizeof(dedup_entry_t), 1, fp) != 1) result = -1;
+    }
+    pthread_mutex_unlock(&index_lock);
+
+    if (fp && fclose(fp) != 0) result = -1;
+    if (result == 0 && rename(temp, filename) != 0) result = -1;
+    if (result != 0) unlink(temp);
+    return result;
+}
+
+int dedup_index_loaded(void) {
+    return index_loaded;
+}
+
+// Block last stored with this fingerprint, -1 if none
+block_id_t dedup_index_find(uint64_t fingerprint) {
+    block_id_t block_id = -1;
+    pthread_mutex_lock(&index_lock);
+    if (by_fingerprint.capacity) {
+        dedup_entry_t probe = { fingerprint, 0 };
+        size_t i = table_find(&by_fingerprint, &probe);
+        if (by_fingerprint.slots[i].block_id != DEDUP_EMPTY) block_id = by_fingerprint.slots[i].block_id;
+    }
+    pthread_mutex_unlock(&index_lock);
+    return block_id;
+}
+
+// Record that block_id holds the contents with this fingerprint
+void dedup_index_add(uint64_t fingerprint, block_id_t block_id) {
+    pthread_mutex_lock(&index_lock);
+    index_put(fingerprint, block_id);
+    pthread_mutex_unlock(&index_lock);
+}
+
+// Drop freed blocks from the index
+void dedup_index_forget(const block_id_t* block_ids, int count) {
+    pthread_mutex_lock(&index_lock);
+    for (int i = 0; by_block.count > 0 && i < count; i++) {
+        dedup_entry_t probe = { 0, block_ids[i] };
+        size_t slot = table_find(&by_block, &probe);
+        if (by_block.slots[slot].block_id == DEDUP_EMPTY) continue;
+        dedup_entry_t entry = by_block.slots[slot];
+        table_remove_slot(&by_block, slot);
+        table_remove(&by_fingerprint, &entry);
+    }
+    pthread_mutex_unlock(&index_lock);
+}
+
+void dedup_index_clear(void) {
+    pthread_mutex_lock(&index_lock);
+    table_free(&by_fingerprint);
+    table_free(&by_block);
+    index_loaded = 0;
+    pthread_mutex_unlock(&index_lock);
+}
@@ -1,421 +1,3277 @@
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+// <linux/fs.h>, pulled in by io_uring.h, has a 1 KB BLOCK_SIZE of its own
+#undef BLOCK_SIZE
 #include "exfs2.h"
+#include <limits.h>
 #include <libgen.h>
+#include <dirent.h>
+#include <sys/sendfile.h>
 
-// This function Opens a directory segment or data-segment
-FILE* open_segment(int segment_number, int segment_type, const char* mode) {
-    char filename[64];
-    if (segment_type == INODE_SEGMENT) {
-        snprintf(filename, sizeof(filename), "%s%d", INODE_SEG_PREFIX, segment_number);
-    } else {
-        snprintf(filename, sizeof(filename), "%s%d", DATA_SEG_PREFIX, segment_number);
+// Cache of open segment descriptors, least recently used entry gets evicted.
+// Lookups are serialized by the lock; pinned handles (refs > 0) are never evicted.
+static segment_handle_t segment_cache[SEGMENT_CACHE_SIZE];
+static unsigned long segment_cache_clock = 0;
+static pthread_mutex_t segment_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// How segment contents are accessed: pread/pwrite or memory mappings
+int segment_io_mode = EXFS2_DEFAULT_IO;
+
+// Geometry of the open file system; init_fs() takes it from the superblock
+off_t segment_size = DEFAULT_SEGMENT_SIZE;
+int blocks_per_segment = (DEFAULT_SEGMENT_SIZE - BLOCK_SIZE) / BLOCK_SIZE;
+off_t new_segment_size = 0;
+
+// Superblock of the open file system. A raised revision is logged with the
+// next journal commit, together with the first use of the feature it names.
+static superblock_t fs_superblock;
+static int superblock_dirty = 0;
+static pthread_mutex_t superblock_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Engine that executes io_batch_t submissions
+int io_engine_mode = EXFS2_DEFAULT_ENGINE;
+
+// Read-ahead extraction: worker threads and ranges in flight (0 disables it)
+int extract_threads = DEFAULT_EXTRACT_THREADS;
+int extract_window = DEFAULT_EXTRACT_WINDOW;
+
+// Store the files added from now on in compressed clusters
+int compress_files = 0;
+
+// Share the stored copy of a block added from now on instead of writing another
+int dedup_files = 0;
+
+// Free-space state for inode and data segments, loaded lazily and committed by
+// journal_commit(). Freed data blocks only become free at the commit, so file
+// data written before it can never land on a block the last commit still uses.
+static allocator_t inode_allocator = { INODE_SEGMENT, 0, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, 0, NULL, 0, 0 };
+static allocator_t block_allocator = { DATA_SEGMENT, 0, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, 1, NULL, 0, 0 };
+
+// Inodes and directory lookups seen so far; write_inode() and the directory
+// operations keep them current. One lock covers both caches.
+static cached_inode_t inode_cache[INODE_CACHE_SIZE];
+static dentry_t dentry_cache[DENTRY_CACHE_SIZE];
+static pthread_mutex_t metadata_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Bumped whenever a cached inode changes or goes away. Inode reads drop the
+// lock for their I/O and only cache what they read if it did not move.
+static uint64_t inode_generation = 0;
+
+// Inodes write_inode() took since the last commit, also under metadata_cache_lock
+static pending_inode_t* pending_inodes = NULL;
+static int num_pending_inodes = 0;
+static int pending_inode_capacity = 0;
+static int pending_inode_heads[PENDING_INODE_BUCKETS];
+
+// Write-back cache of data segment blocks behind read_block()/write_block();
+// slots are chained per hash bucket and evicted by the CLOCK hand
+static cached_block_t block_cache[BLOCK_CACHE_SIZE];
+static int block_cache_heads[BLOCK_CACHE_BUCKETS];
+static int block_cache_ready = 0;       /* buckets initialized */
+static int block_cache_slots = 0;       /* slots handed out so far; the rest were never touched */
+static int block_cache_hand = 0;
+static int block_cache_used = 0;
+static int block_cache_dirty = 0;
+static unsigned long block_cache_generation = 0; /* bumped whenever cached copies are dropped or rewritten */
+static pthread_mutex_t block_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Directory holding the segment files, set by exfs2_open()
+static char segment_directory[MAX_PATH] = ".";
+
+// Build the on-disk file name of a segment; fails with ENAMETOOLONG if it does
+// not fit in 'len' bytes
+static int segment_filename(char* filename, size_t len, int segment_number, int segment_type) {
+    const char* prefix = segment_type == INODE_SEGMENT ? INODE_SEG_PREFIX : DATA_SEG_PREFIX;
+    int needed = snprintf(filename, len, "%s/%s%d", segment_directory, prefix, segment_number);
+    if (needed < 0 || (size_t)needed >= len) {
+        errno = ENAMETOOLONG;
+        return -1;
     }
-    return fopen(filename, mode);
+    return 0;
 }
 
-// This function creates a new segment of 1 Mb size on disk
-int create_new_segment(int segment_number, int segment_type) {
-    FILE* fp = open_segment(segment_number, segment_type, "wb");
-    if (!fp) {
-        perror("Failed to create new segment");
-        return -1;
+// Flush a mapped segment's dirty pages, close it and free its cache slot
+static void close_segment_handle(segment_handle_t* handle) {
+    if (handle->map) {
+        if (handle->dirty) msync(handle->map, segment_size, MS_SYNC);
+        munmap(handle->map, segment_size);
+        handle->map = NULL;
     }
+    close(handle->fd);
+    handle->in_use = 0;
+}
 
-    // Initialize segment with zeros
-    char buffer[8192] = {0}; // Write in chunks for efficiency
-    size_t remaining = SEGMENT_SIZE;
-    
-    while (remaining > 0) {
-        size_t to_write = (remaining > sizeof(buffer)) ? sizeof(buffer) : remaining;
-        if (fwrite(buffer, 1, to_write, fp) != to_write) {
-            perror("Failed to initialize segment");
-            fclose(fp);
-            return -1;
+// Find a cached segment; caller holds segment_cache_lock
+static segment_handle_t* find_cached_segment(int segment_number, int segment_type) {
+    for (int i = 0; i < SEGMENT_CACHE_SIZE; i++) {
+        if (segment_cache[i].in_use &&
+            segment_cache[i].segment_number == segment_number &&
+            segment_cache[i].segment_type == segment_type) {
+            return &segment_cache[i];
         }
-        remaining -= to_write;
-    }
-    
-    fflush(fp);
-    fclose(fp);
-    
-    if (segment_type == INODE_SEGMENT && segment_number == 0) {
-        // Initialize root directory in the first inode segment
-        inode_t root_inode;
-        memset(&root_inode, 0, sizeof(root_inode));
-        root_inode.type = INODE_DIR;
-        root_inode.size = 0;
-        root_inode.num_direct = 0;
-        root_inode.indirect_block = -1;
-        root_inode.double_indirect_block = -1;
-        root_inode.triple_indirect_block = -1;
-        
-        // Mark root inode as used in bitmap
-        FILE* fp = open_segment(0, INODE_SEGMENT, "rb+");
-        if (!fp) return -1;
-        
-        uint8_t bitmap[BLOCK_SIZE] = {0};
-        set_bit(bitmap, ROOT_DIR_INODE);
-        write_bitmap(fp, bitmap, BLOCK_SIZE);
-        fclose(fp);
-        
-        // Write root inode
-        write_inode(ROOT_DIR_INODE, &root_inode);
     }
-    
-    return 0;
+    return NULL;
 }
 
-// This function reads the bitmap from a segment
-int read_bitmap(FILE* fp, uint8_t* bitmap, int size) {
-    fseek(fp, 0, SEEK_SET);
-    return fread(bitmap, 1, size, fp);
+// Drop a segment from the cache (used before the segment file is recreated)
+static void forget_segment(int segment_number, int segment_type) {
+    pthread_mutex_lock(&segment_cache_lock);
+    segment_handle_t* handle = find_cached_segment(segment_number, segment_type);
+    if (handle) close_segment_handle(handle);
+    pthread_mutex_unlock(&segment_cache_lock);
 }
 
-//This function writes the bit map back to the segment
-int write_bitmap(FILE* fp, uint8_t* bitmap, int size) {
-    fseek(fp, 0, SEEK_SET);
-    return fwrite(bitmap, 1, size, fp);
+// Remember a freshly opened descriptor, evicting the least recently used unpinned
+// one if full; caller holds segment_cache_lock
+static segment_handle_t* cache_segment(int segment_number, int segment_type, int fd) {
+    segment_handle_t* handle = NULL;
+    for (int i = 0; i < SEGMENT_CACHE_SIZE; i++) {
+        segment_handle_t* candidate = &segment_cache[i];
+        if (!candidate->in_use) {
+            handle = candidate;
+            break;
+        }
+        if (candidate->refs == 0 && (!handle || candidate->last_used < handle->last_used)) {
+            handle = candidate;
+        }
+    }
+
+    if (!handle) {
+        // Every slot is pinned by a reader
+        close(fd);
+        errno = EMFILE;
+        return NULL;
+    }
+    if (handle->in_use) close_segment_handle(handle);
+
+    handle->segment_number = segment_number;
+    handle->segment_type = segment_type;
+    handle->fd = fd;
+    handle->map = NULL;
+    handle->dirty = 0;
+    handle->refs = 0;
+    handle->in_use = 1;
+    handle->last_used = ++segment_cache_clock;
+
+    if (segment_io_mode == SEGMENT_IO_MMAP) {
+        void* map = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        // Fall back to pread/pwrite for this segment if it cannot be mapped
+        if (map != MAP_FAILED) handle->map = map;
+    }
+    return handle;
 }
 
-// Indentify the first inode or data block that is marked free (with bit 0) from the bitmap.
-int find_free_bit(uint8_t* bitmap, int num_bits) {
-    for (int i = 0; i < num_bits; i++) {
-        if ((bitmap[i / 8] & (1 << (i % 8))) == 0) {
-            return i;
-        }
+// Look up a segment, opening it on first use; NULL if it does not exist.
+// Caller holds segment_cache_lock.
+static segment_handle_t* get_segment(int segment_number, int segment_type) {
+    segment_handle_t* handle = find_cached_segment(segment_number, segment_type);
+    if (handle) {
+        handle->last_used = ++segment_cache_clock;
+        stats_count(STAT_SEGMENT_CACHE_HITS, 1);
+        return handle;
     }
-    return -1; // No free bits
+
+    char filename[SEGMENT_NAME_MAX];
+    if (segment_filename(filename, sizeof(filename), segment_number, segment_type) != 0) return NULL;
+    uint64_t started = stats_clock();
+    int fd = open(filename, O_RDWR);
+    stats_time(STAT_TIME_SEGMENT_OPEN, started);
+    if (fd < 0) return NULL;
+    stats_count(STAT_SEGMENT_OPENS, 1);
+
+    return cache_segment(segment_number, segment_type, fd);
 }
 
-//Set the bit value to 1 in the bitmao indicating that particular inode is allocated
-void set_bit(uint8_t* bitmap, int bit) {
-    bitmap[bit / 8] |= (1 << (bit % 8));
+// Pin a segment handle so it stays open while it is used outside the lock
+segment_handle_t* acquire_segment(int segment_number, int segment_type) {
+    pthread_mutex_lock(&segment_cache_lock);
+    segment_handle_t* handle = get_segment(segment_number, segment_type);
+    if (handle) handle->refs++;
+    pthread_mutex_unlock(&segment_cache_lock);
+    return handle;
 }
 
-//sets back the bit value to 0 indicating inode as free in bitmap
-void clear_bit(uint8_t* bitmap, int bit) {
-    bitmap[bit / 8] &= ~(1 << (bit % 8));
+// Unpin a handle returned by acquire_segment()
+void release_segment(segment_handle_t* handle) {
+    pthread_mutex_lock(&segment_cache_lock);
+    handle->refs--;
+    pthread_mutex_unlock(&segment_cache_lock);
 }
 
-//Finds the first free inode and return its number (creating new inode segment if no free inode is found) 
-int allocate_inode() {
-    int segment_number = 0;
-    
-    while (1) {
-        FILE* fp = open_segment(segment_number, INODE_SEGMENT, "rb+");
-        
-        if (!fp) {
-            // No segment found, create one
-            if (create_new_segment(segment_number, INODE_SEGMENT) != 0) {
-                return -1;
-            }
-            fp = open_segment(segment_number, INODE_SEGMENT, "rb+");
-            if (!fp) return -1;
-        }
+// This function returns the descriptor of a directory segment or data-segment,
+// opening it on first use; returns -1 if the segment does not exist
+int open_segment(int segment_number, int segment_type) {
+    pthread_mutex_lock(&segment_cache_lock);
+    segment_handle_t* handle = get_segment(segment_number, segment_type);
+    int fd = handle ? handle->fd : -1;
+    pthread_mutex_unlock(&segment_cache_lock);
+    return fd;
+}
 
-        int num_inodes = (SEGMENT_SIZE - BLOCK_SIZE) / sizeof(inode_t);
-        
-        uint8_t bitmap[BLOCK_SIZE];
-        if (read_bitmap(fp, bitmap, BLOCK_SIZE) != BLOCK_SIZE) {
-            fclose(fp);
-            return -1;
-        }
+// Read 'length' bytes at 'offset' of a segment; returns 0 on success
+int segment_read(int segment_number, int segment_type, void* buffer, size_t length, off_t offset) {
+    if (offset + (off_t)length > segment_size) return -1;
 
-        int free_inode = find_free_bit(bitmap, num_inodes);
-        if (free_inode >= 0) {
-            set_bit(bitmap, free_inode);
-            write_bitmap(fp, bitmap, BLOCK_SIZE);
-            fclose(fp);
+    segment_handle_t* handle = acquire_segment(segment_number, segment_type);
+    if (!handle) return -1;
 
-            return segment_number * num_inodes + free_inode;  // Global inode number
-        }
+    uint64_t started = stats_clock();
+    int result = 0;
+    if (handle->map) {
+        memcpy(buffer, handle->map + offset, length);
+    } else if (pread(handle->fd, buffer, length, offset) != (ssize_t)length) {
+        result = -1;
+    }
+    stats_time(STAT_TIME_SEGMENT_READ, started);
+    stats_count(STAT_SEGMENT_READS, 1);
+    stats_count(STAT_SEGMENT_READ_BYTES, length);
+
+    release_segment(handle);
+    return result;
+}
 
-        fclose(fp);
-        segment_number++;  // ➔ Keep moving to next segment
+// Write 'length' bytes at 'offset' of a segment; returns 0 on success
+int segment_write(int segment_number, int segment_type, const void* buffer, size_t length, off_t offset) {
+    if (offset + (off_t)length > segment_size) return -1;
+
+    segment_handle_t* handle = acquire_segment(segment_number, segment_type);
+    if (!handle) return -1;
+
+    uint64_t started = stats_clock();
+    int result = 0;
+    if (handle->map) {
+        memcpy(handle->map + offset, buffer, length);
+        handle->dirty = 1;
+    } else if (pwrite(handle->fd, buffer, length, offset) != (ssize_t)length) {
+        result = -1;
     }
+    stats_time(STAT_TIME_SEGMENT_WRITE, started);
+    stats_count(STAT_SEGMENT_WRITES, 1);
+    stats_count(STAT_SEGMENT_WRITE_BYTES, length);
 
-    return -1;  // Should never reach
+    release_segment(handle);
+    return result;
 }
 
-//Read the inode meta data and the pointers
-int read_inode(int inode_num, inode_t* out_inode) {
-    int num_inodes_per_segment = (SEGMENT_SIZE - BLOCK_SIZE) / sizeof(inode_t);
-    int segment_number = inode_num / num_inodes_per_segment;
-    int index_in_segment = inode_num % num_inodes_per_segment;
+// Close every cached segment descriptor, called once when the process exits
+void close_all_segments(void) {
+    pthread_mutex_lock(&segment_cache_lock);
+    for (int i = 0; i < SEGMENT_CACHE_SIZE; i++) {
+        if (segment_cache[i].in_use) close_segment_handle(&segment_cache[i]);
+    }
+    pthread_mutex_unlock(&segment_cache_lock);
+}
 
-    FILE* fp = open_segment(segment_number, INODE_SEGMENT, "rb");
-    if (!fp) return -1;
+// Queue a request; an owned buffer is a private copy released with the batch
+static int io_batch_push(io_batch_t* batch, int segment_number, int segment_type,
+                         void* buffer, size_t length, off_t offset, int is_write, int owned) {
+    if (batch->count == batch->capacity) {
+        int new_capacity = batch->capacity ? batch->capacity * 2 : 64;
+        io_request_t* grown = realloc(batch->requests, new_capacity * sizeof(io_request_t));
+        if (!grown) return -1;
+        batch->requests = grown;
+        batch->capacity = new_capacity;
+    }
 
-    // Inodes start after bitmap block
-    fseek(fp, BLOCK_SIZE + index_in_segment * sizeof(inode_t), SEEK_SET);
-    size_t read_count = fread(out_inode, sizeof(inode_t), 1, fp);
-    
-    fclose(fp);
-    
-    return (read_count == 1) ? 0 : -1;
+    io_request_t* request = &batch->requests[batch->count++];
+    request->segment_number = segment_number;
+    request->segment_type = segment_type;
+    request->buffer = buffer;
+    request->length = length;
+    request->offset = offset;
+    request->is_write = is_write;
+    request->owned = owned;
+    request->result = 0;
+    return 0;
 }
 
-//write the metadata to inode 
-int write_inode(int inode_num, inode_t* in_inode) {
-    int num_inodes_per_segment = (SEGMENT_SIZE - BLOCK_SIZE) / sizeof(inode_t);
-    int segment_number = inode_num / num_inodes_per_segment;
-    int index_in_segment = inode_num % num_inodes_per_segment;
+// Queue a read of 'count' consecutive data blocks (one segment) into buffer
+int io_batch_read_blocks(io_batch_t* batch, block_id_t first_block, int count, void* buffer) {
+    int block_index = first_block % blocks_per_segment;
+    if (block_index + count > blocks_per_segment) return -1;
+    stats_count(STAT_BLOCK_READS, count);
+    return io_batch_push(batch, first_block / blocks_per_segment, DATA_SEGMENT, buffer,
+                         (size_t)count * BLOCK_SIZE, BLOCK_SIZE + (off_t)block_index * BLOCK_SIZE, 0, 0);
+}
 
-    FILE* fp = open_segment(segment_number, INODE_SEGMENT, "rb+");
-    if (!fp) return -1;
+// Queue a write of 'count' consecutive data blocks; buffer must live until submit
+int io_batch_write_blocks(io_batch_t* batch, block_id_t first_block, int count, void* buffer) {
+    int block_index = first_block % blocks_per_segment;
+    if (block_index + count > blocks_per_segment) return -1;
+    stats_count(STAT_BLOCK_WRITES, count);
+    return io_batch_push(batch, first_block / blocks_per_segment, DATA_SEGMENT, buffer,
+                         (size_t)count * BLOCK_SIZE, BLOCK_SIZE + (off_t)block_index * BLOCK_SIZE, 1, 0);
+}
 
-    // Inodes start after bitmap block
-    fseek(fp, BLOCK_SIZE + index_in_segment * sizeof(inode_t), SEEK_SET);
-    size_t write_count = fwrite(in_inode, sizeof(inode_t), 1, fp);
-    
-    fclose(fp);
-    
-    return (write_count == 1) ? 0 : -1;
+// Queue a write of arbitrary segment bytes from a private copy of 'data'
+int io_batch_write_copy(io_batch_t* batch, int segment_number, int segment_type,
+                        const void* data, size_t length, off_t offset) {
+    void* copy = malloc(length);
+    if (!copy) return -1;
+    memcpy(copy, data, length);
+    if (io_batch_push(batch, segment_number, segment_type, copy, length, offset, 1, 1) != 0) {
+        free(copy);
+        return -1;
+    }
+    return 0;
 }
 
-//Clear the inode metadata and make the inode empty 
-int free_inode(int inode_num) {
-    int num_inodes_per_segment = (SEGMENT_SIZE - BLOCK_SIZE) / sizeof(inode_t);
-    int segment_number = inode_num / num_inodes_per_segment;
-    int index_in_segment = inode_num % num_inodes_per_segment;
+// Execute queued requests one at a time with pread/pwrite or memcpy
+static int sync_engine_submit(io_batch_t* batch) {
+    int result = 0;
+    for (int i = 0; i < batch->count; i++) {
+        io_request_t* request = &batch->requests[i];
+        request->result = request->is_write
+            ? segment_write(request->segment_number, request->segment_type,
+                            request->buffer, request->length, request->offset)
+            : segment_read(request->segment_number, request->segment_type,
+                           request->buffer, request->length, request->offset);
+        if (request->result != 0) result = -1;
+    }
+    return result;
+}
 
-    FILE* fp = open_segment(segment_number, INODE_SEGMENT, "rb+");
-    if (!fp) return -1;
+// Minimal io_uring instance driven through the raw system calls
+static struct {
+    int ring_fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    pthread_mutex_t lock;
+} uring = { .ring_fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
 
-    // Read bitmap
-    uint8_t bitmap[BLOCK_SIZE];
-    read_bitmap(fp, bitmap, BLOCK_SIZE);
-    
-    // Mark inode as free
-    clear_bit(bitmap, index_in_segment);
-    write_bitmap(fp, bitmap, BLOCK_SIZE);
-    
-    fclose(fp);
+// Create the ring on first use; returns -1 if the kernel does not offer io_uring
+static int uring_setup(void) {
+    if (uring.ring_fd >= 0) return 0;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring_fd < 0) return -1;
+
+    uring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring.cq_ring_size > uring.sq_ring_size) uring.sq_ring_size = uring.cq_ring_size;
+        uring.cq_ring_size = uring.sq_ring_size;
+    }
+
+    uring.sq_ring = mmap(NULL, uring.sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (uring.sq_ring == MAP_FAILED) {
+        close(ring_fd);
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring.cq_ring = uring.sq_ring;
+    } else {
+        uring.cq_ring = mmap(NULL, uring.cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (uring.cq_ring == MAP_FAILED) {
+            munmap(uring.sq_ring, uring.sq_ring_size);
+            close(ring_fd);
+            return -1;
+        }
+    }
+
+    uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        if (uring.cq_ring != uring.sq_ring) munmap(uring.cq_ring, uring.cq_ring_size);
+        munmap(uring.sq_ring, uring.sq_ring_size);
+        close(ring_fd);
+        return -1;
+    }
+
+    char* sq = uring.sq_ring;
+    char* cq = uring.cq_ring;
+    uring.sq_head = (unsigned*)(sq + params.sq_off.head);
+    uring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    uring.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    uring.sq_array = (unsigned*)(sq + params.sq_off.array);
+    uring.cq_head = (unsigned*)(cq + params.cq_off.head);
+    uring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    uring.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    uring.entries = params.sq_entries;
+    uring.ring_fd = ring_fd;
     return 0;
 }
 
-//Identify the first free data block of 4kb in the data segment and 
-int allocate_block() {
-    int segment_number = 0;
+// Tear the ring down, called from shutdown_fs()
+static void uring_shutdown(void) {
+    if (uring.ring_fd < 0) return;
+    munmap(uring.sqes, uring.sqes_size);
+    if (uring.cq_ring != uring.sq_ring) munmap(uring.cq_ring, uring.cq_ring_size);
+    munmap(uring.sq_ring, uring.sq_ring_size);
+    close(uring.ring_fd);
+    uring.ring_fd = -1;
+}
 
-    while (1) {
-        FILE* fp = open_segment(segment_number, DATA_SEGMENT, "rb+");
+// Submit 'pending' prepared SQEs and reap as many completions into the batch.
+// When a submission fails, the SQEs the kernel did not take are dropped from
+// the ring, so no later flush sends them again, and the ones it took are
+// waited for, so the synchronous redo cannot race them on the same buffers.
+static int uring_flush(io_batch_t* batch, unsigned pending) {
+    unsigned submitted = 0;
+    unsigned completed = 0;
+    int failed = 0;
 
-        if (!fp) {
-            if (create_new_segment(segment_number, DATA_SEGMENT) != 0) {
-                return -1;
-            }
-            fp = open_segment(segment_number, DATA_SEGMENT, "rb+");
-            if (!fp) return -1;
+    while (completed < pending) {
+        int ret = syscall(__NR_io_uring_enter, uring.ring_fd, failed ? 0 : pending - submitted,
+                          pending - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+            ret = 0;                 // Reap what completed, then try again
+        } else if (ret < 0) {
+            if (failed) return -1;   // Cannot even wait for the requests in flight
+            __atomic_store_n(uring.sq_tail, __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+            pending = submitted;
+            failed = 1;
+            continue;
+        }
+        if (!failed) submitted += ret;
+
+        unsigned head = *uring.cq_head;
+        while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &uring.cqes[head & *uring.cq_mask];
+            io_request_t* request = &batch->requests[cqe->user_data];
+            // Short or failed transfers are finished synchronously below
+            request->result = (cqe->res == (int)request->length) ? 0 : -1;
+            head++;
+            completed++;
         }
+        __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return failed ? -1 : 0;
+}
+
+// Execute a batch with io_uring: one io_uring_enter per ring-full of requests
+static int uring_engine_submit(io_batch_t* batch) {
+    pthread_mutex_lock(&uring.lock);
+    if (uring_setup() != 0) {
+        pthread_mutex_unlock(&uring.lock);
+        return sync_engine_submit(batch);
+    }
 
-        int num_blocks = (SEGMENT_SIZE - BLOCK_SIZE) / BLOCK_SIZE;
+    segment_handle_t* pinned[URING_ENTRIES];
+    unsigned pending = 0;
+    int result = 0;
 
-        uint8_t bitmap[BLOCK_SIZE];
-        if (read_bitmap(fp, bitmap, BLOCK_SIZE) != BLOCK_SIZE) {
-            fclose(fp);
-            return -1;
+    for (int i = 0; i <= batch->count; i++) {
+        segment_handle_t* handle = NULL;
+        if (i < batch->count) {
+            handle = acquire_segment(batch->requests[i].segment_number,
+                                     batch->requests[i].segment_type);
         }
 
-        int free_block = find_free_bit(bitmap, num_blocks);
-        if (free_block >= 0) {
-            set_bit(bitmap, free_block);
-            write_bitmap(fp, bitmap, BLOCK_SIZE);
-            fclose(fp);
+        // Ring full, batch done or descriptors exhausted: run what is queued
+        if (pending > 0 && (i == batch->count || pending == uring.entries || !handle)) {
+            if (uring_flush(batch, pending) != 0) result = -1;
+            for (unsigned k = 0; k < pending; k++) release_segment(pinned[k]);
+            pending = 0;
+            if (i < batch->count && !handle) {
+                handle = acquire_segment(batch->requests[i].segment_number,
+                                         batch->requests[i].segment_type);
+            }
+        }
+        if (i == batch->count) break;
 
-            return segment_number * num_blocks + free_block;
+        io_request_t* request = &batch->requests[i];
+        if (!handle || handle->map) {
+            // Mapped (or missing) segments gain nothing from the ring
+            if (handle) release_segment(handle);
+            request->result = -1;
+            continue;
         }
 
-        fclose(fp);
-        segment_number++;  // ➔ Important: keep going to next segment
+        unsigned tail = *uring.sq_tail;
+        unsigned index = tail & *uring.sq_mask;
+        struct io_uring_sqe* sqe = &uring.sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = request->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = handle->fd;
+        sqe->off = request->offset;
+        sqe->addr = (unsigned long)request->buffer;
+        sqe->len = request->length;
+        sqe->user_data = i;
+        request->result = -1;   // Until its completion says otherwise
+        uring.sq_array[index] = index;
+        __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+        pinned[pending++] = handle;
     }
+    pthread_mutex_unlock(&uring.lock);
 
-    return -1;
+    // Anything the ring did not complete in full is redone synchronously
+    for (int i = 0; i < batch->count; i++) {
+        io_request_t* request = &batch->requests[i];
+        if (request->result == 0) continue;
+        request->result = request->is_write
+            ? segment_write(request->segment_number, request->segment_type,
+                            request->buffer, request->length, request->offset)
+            : segment_read(request->segment_number, request->segment_type,
+                           request->buffer, request->length, request->offset);
+        if (request->result != 0) result = -1;
+    }
+    return result;
 }
 
-// Copy the 4kb data block into the buffer and read. 
-int read_block(int block_id, void* buffer) {
-    int blocks_per_segment = (SEGMENT_SIZE - BLOCK_SIZE) / BLOCK_SIZE;
-    int segment_number = block_id / blocks_per_segment;
-    int block_index = block_id % blocks_per_segment;
-
-    FILE* fp = open_segment(segment_number, DATA_SEGMENT, "rb");
-    if (!fp) return -1;
+// Release the owned buffers of a batch and empty it for reuse
+static void io_batch_reset(io_batch_t* batch) {
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->requests[i].owned) free(batch->requests[i].buffer);
+    }
+    batch->count = 0;
+}
 
-    // Blocks start after bitmap block
-    fseek(fp, BLOCK_SIZE + block_index * BLOCK_SIZE, SEEK_SET);
-    size_t read_count = fread(buffer, BLOCK_SIZE, 1, fp);
-    
-    fclose(fp);
-    
-    return (read_count == 1) ? 0 : -1;
+// Run every queued request with the selected engine and empty the batch,
+// without looking at the block cache
+static int io_batch_run(io_batch_t* batch) {
+    uint64_t started = stats_clock();
+    stats_count(STAT_BATCH_SUBMITS, 1);
+    stats_count(STAT_BATCH_REQUESTS, batch->count);
+    int result = (io_engine_mode == IO_ENGINE_URING) ? uring_engine_submit(batch)
+                                                     : sync_engine_submit(batch);
+    io_batch_reset(batch);
+    stats_time(STAT_TIME_BATCH_SUBMIT, started);
+    return result;
 }
 
-//write the data from buffer to data block in a segment
-int write_block(int block_id, void* buffer) {
-    int blocks_per_segment = (SEGMENT_SIZE - BLOCK_SIZE) / BLOCK_SIZE;
-    int segment_number = block_id / blocks_per_segment;
-    int block_index = block_id % blocks_per_segment;
+// Slot of a cached block, -1 if it is not cached. The caller holds block_cache_lock.
+static int block_cache_find(block_id_t block_id) {
+    for (int slot = block_cache_heads[BLOCK_CACHE_HASH(block_id)]; slot >= 0;
+         slot = block_cache[slot].next) {
+        if (block_cache[slot].block_id == block_id) return slot;
+    }
+    return -1;
+}
 
-    FILE* fp = open_segment(segment_number, DATA_SEGMENT, "rb+");
-    if (!fp) return -1;
+static void block_cache_unlink(int slot) {
+    int* link = &block_cache_heads[BLOCK_CACHE_HASH(block_cache[slot].block_id)];
+    while (*link != slot) link = &block_cache[*link].next;
+    *link = block_cache[slot].next;
+    if (block_cache[slot].dirty) block_cache_dirty--;
+    block_cache[slot].block_id = -1;
+    block_cache[slot].dirty = 0;
+    block_cache_used--;
+}
 
-    // Blocks start after bitmap block
-    fseek(fp, BLOCK_SIZE + block_index * BLOCK_SIZE, SEEK_SET);
-    size_t write_count = fwrite(buffer, BLOCK_SIZE, 1, fp);
-    
-    fclose(fp);
-    
-    return (write_count == 1) ? 0 : -1;
+static int block_cache_write_slot(int slot) {
+    cached_block_t* cached = &block_cache[slot];
+    int result = segment_write(cached->block_id / blocks_per_segment, DATA_SEGMENT, cached->data,
+                               BLOCK_SIZE, BLOCK_SIZE + (off_t)(cached->block_id % blocks_per_segment) * BLOCK_SIZE);
+    if (result == 0) {
+        cached->dirty = 0;
+        block_cache_dirty--;
+    }
+    return result;
 }
 
-// Mark the block as free in its segment bitmap
-int free_block(int block_id) {
-    int blocks_per_segment = (SEGMENT_SIZE - BLOCK_SIZE) / BLOCK_SIZE;
-    int segment_number = block_id / blocks_per_segment;
-    int block_index = block_id % blocks_per_segment;
+// Free a slot: untouched ones first, then with the CLOCK hand, where referenced
+// blocks get a second chance. Dirty blocks are passed over for two sweeps,
+// since writing one back before its commit gives up the atomicity of the
+// journal; after that it is written back first. -1 if nothing could be evicted.
+static int block_cache_evict(void) {
+    if (!block_cache_ready) {
+        for (int i = 0; i < BLOCK_CACHE_BUCKETS; i++) block_cache_heads[i] = -1;
+        block_cache_ready = 1;
+    }
+    if (block_cache_slots < BLOCK_CACHE_SIZE) return block_cache_slots++;
 
-    FILE* fp = open_segment(segment_number, DATA_SEGMENT, "rb+");
-    if (!fp) return -1;
+    for (int step = 0; step < 3 * BLOCK_CACHE_SIZE; step++) {
+        int slot = block_cache_hand;
+        block_cache_hand = (block_cache_hand + 1) % BLOCK_CACHE_SIZE;
+        cached_block_t* cached = &block_cache[slot];
 
-    // Read bitmap
-    uint8_t bitmap[BLOCK_SIZE];
-    read_bitmap(fp, bitmap, BLOCK_SIZE);
-    
-    // Mark block as free
-    clear_bit(bitmap, block_index);
-    write_bitmap(fp, bitmap, BLOCK_SIZE);
-    
-    fclose(fp);
-    return 0;
+        if (cached->block_id == -1) return slot;
+        if (cached->referenced) {
+            cached->referenced = 0;
+            continue;
+        }
+        if (cached->dirty && (step < 2 * BLOCK_CACHE_SIZE || block_cache_write_slot(slot) != 0)) continue;
+        block_cache_unlink(slot);
+        return slot;
+    }
+    return -1;
 }
 
-// Read a directory block into an entries array
-int load_directory_entries(int block_id, dir_entry_t* entries) {
-    // Directory entries are stored in data blocks
-    char buffer[BLOCK_SIZE];
-    
-    if (read_block(block_id, buffer) != 0) {
-        return -1;
+// Cache a copy of a block; returns -1 if no slot could be freed for it
+static int block_cache_put(block_id_t block_id, const void* data, int dirty) {
+    int slot = block_cache_ready ? block_cache_find(block_id) : -1;
+    if (slot < 0) {
+        if ((slot = block_cache_evict()) < 0) return -1;
+        cached_block_t* cached = &block_cache[slot];
+        cached->block_id = block_id;
+        cached->dirty = 0;
+        cached->next = block_cache_heads[BLOCK_CACHE_HASH(block_id)];
+        block_cache_heads[BLOCK_CACHE_HASH(block_id)] = slot;
+        block_cache_used++;
     }
-    
-    // Copy from block buffer to entries (only copy the actual size of entries)
-    memcpy(entries, buffer, sizeof(dir_entry_t) * DIR_ENTRIES_PER_BLOCK);
-    
+
+    cached_block_t* cached = &block_cache[slot];
+    memcpy(cached->data, data, BLOCK_SIZE);
+    cached->referenced = 1;
+    if (dirty && !cached->dirty) block_cache_dirty++;
+    if (dirty) cached->dirty = 1;
     return 0;
 }
 
-// Write the entries array back to its directory block
-int save_directory_entries(int block_id, dir_entry_t* entries) {
-    // We need to ensure the full block is written, even if entries array is smaller
-    char buffer[BLOCK_SIZE] = {0};  // Initialize with zeros
-    
-    // Copy entries to the beginning of the buffer
-    memcpy(buffer, entries, sizeof(dir_entry_t) * DIR_ENTRIES_PER_BLOCK);
-    
-    // Write the full block
-    return write_block(block_id, buffer);
+// Write back the dirty cached blocks among [first, first + count), for a
+// kernel copy that reads the segment itself
+static int block_cache_write_back(block_id_t first, int count) {
+    int result = 0;
+    pthread_mutex_lock(&block_cache_lock);
+    for (int i = 0; block_cache_dirty > 0 && i < count; i++) {
+        int slot = block_cache_find(first + i);
+        if (slot >= 0 && block_cache[slot].dirty && block_cache_write_slot(slot) != 0) result = -1;
+    }
+    pthread_mutex_unlock(&block_cache_lock);
+    return result;
 }
 
-// Look for a name inside a directory inode, returns the child's inode number 
-int find_entry_in_dir(inode_t* dir_inode, const char* name) {
-    if (dir_inode->type != INODE_DIR) {
-        return -1; // Not a directory
+// Drop cached copies of [first, first + count), dirty or not: the blocks are
+// being overwritten around the cache, or were freed
+static void block_cache_forget(block_id_t first, int count) {
+    pthread_mutex_lock(&block_cache_lock);
+    for (int i = 0; block_cache_used > 0 && i < count; i++) {
+        int slot = block_cache_find(first + i);
+        if (slot >= 0) block_cache_unlink(slot);
     }
-    
-    // Search through all direct blocks of the directory
-    for (int i = 0; i < dir_inode->num_direct; i++) {
-        dir_entry_t entries[DIR_ENTRIES_PER_BLOCK];
-        
-        if (load_directory_entries(dir_inode->direct_blocks[i], entries) != 0) {
-            continue;
-        }
-        
-        // Search through directory entries in this block
-        for (unsigned int j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
-            if (entries[j].inode_num != -1 && strcmp(entries[j].name, name) == 0) {
-                return entries[j].inode_num;
-            }
+    block_cache_generation++;
+    pthread_mutex_unlock(&block_cache_lock);
+}
+
+// Lay the dirty cached copies of [first, first + count) over a buffer just read
+// from the segment
+static void block_cache_overlay(block_id_t first, int count, void* buffer) {
+    pthread_mutex_lock(&block_cache_lock);
+    for (int i = 0; block_cache_dirty > 0 && i < count; i++) {
+        int slot = block_cache_find(first + i);
+        if (slot >= 0 && block_cache[slot].dirty) {
+            memcpy((uint8_t*)buffer + (size_t)i * BLOCK_SIZE, block_cache[slot].data, BLOCK_SIZE);
         }
     }
-    
-    return -1; // Entry not found
+    pthread_mutex_unlock(&block_cache_lock);
 }
 
-// Add (name → child_inode_num) into a directory, making a new block if needed
-int add_entry_to_dir(inode_t* dir_inode, int dir_inode_num, const char* name, int child_inode_num) {
-    if (dir_inode->type != INODE_DIR) {
-        return -1; // Not a directory
+static int compare_cached_slots(const void* a, const void* b) {
+    block_id_t x = block_cache[*(const int*)a].block_id;
+    block_id_t y = block_cache[*(const int*)b].block_id;
+    return (x > y) - (x < y);
+}
+
+// Queue a copy of every dirty cached block on 'batch', in block order, and
+// mark them clean
+static int block_cache_queue(io_batch_t* batch) {
+    int slots[BLOCK_CACHE_SIZE];
+    int num_dirty = 0;
+    int result = 0;
+
+    pthread_mutex_lock(&block_cache_lock);
+    for (int i = 0; block_cache_dirty > 0 && i < block_cache_slots; i++) {
+        if (block_cache[i].block_id != -1 && block_cache[i].dirty) slots[num_dirty++] = i;
     }
-    
-    // First check if the entry already exists
-    if (find_entry_in_dir(dir_inode, name) != -1) {
-        return -1; // Entry with that name already exists
+    qsort(slots, num_dirty, sizeof(int), compare_cached_slots);
+
+    for (int i = 0; i < num_dirty; i++) {
+        cached_block_t* cached = &block_cache[slots[i]];
+        if (io_batch_write_copy(batch, cached->block_id / blocks_per_segment, DATA_SEGMENT, cached->data, BLOCK_SIZE,
+                                BLOCK_SIZE + (off_t)(cached->block_id % blocks_per_segment) * BLOCK_SIZE) != 0) {
+            result = -1;
+            break;
+        }
+        cached->dirty = 0;
+        block_cache_dirty--;
     }
-    
-    // Try to find an empty slot in existing blocks
-    for (int i = 0; i < dir_inode->num_direct; i++) {
-        dir_entry_t entries[DIR_ENTRIES_PER_BLOCK];
-        
-        if (load_directory_entries(dir_inode->direct_blocks[i], entries) != 0) {
-            continue;
+    pthread_mutex_unlock(&block_cache_lock);
+    return result;
+}
+
+// Empty the block cache; dirty blocks are lost, so commit first
+static void block_cache_clear(void) {
+    pthread_mutex_lock(&block_cache_lock);
+    for (int i = 0; i < block_cache_slots; i++) {
+        if (block_cache[i].block_id != -1) block_cache_unlink(i);
+    }
+    block_cache_generation++;
+    pthread_mutex_unlock(&block_cache_lock);
+}
+
+// Run every queued request with the selected engine and empty the batch.
+// Returns 0 only if all of them succeeded. Writes of data blocks drop the
+// cached copies they replace, and reads of whole data blocks get the cache's
+// dirty copies laid over what they read.
+int io_batch_submit(io_batch_t* batch) {
+    uint64_t started = stats_clock();
+    stats_count(STAT_BATCH_SUBMITS, 1);
+    stats_count(STAT_BATCH_REQUESTS, batch->count);
+    for (int i = 0; i < batch->count; i++) {
+        io_request_t* request = &batch->requests[i];
+        if (request->is_write && request->segment_type == DATA_SEGMENT && request->offset >= BLOCK_SIZE) {
+            off_t start = request->offset - BLOCK_SIZE;
+            block_cache_forget((block_id_t)request->segment_number * blocks_per_segment + start / BLOCK_SIZE,
+                               (start % BLOCK_SIZE + request->length + BLOCK_SIZE - 1) / BLOCK_SIZE);
         }
-        
-        // Look for an empty slot
-        for (unsigned int j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
-            if (entries[j].inode_num == -1) {
-                // Empty slot found
-                strncpy(entries[j].name, name, MAX_FILENAME - 1);
-                entries[j].name[MAX_FILENAME - 1] = '\0'; // Ensure null termination
-                entries[j].inode_num = child_inode_num;
-                
-                save_directory_entries(dir_inode->direct_blocks[i], entries);
-                return 0;
-            }
+    }
+
+    int result = (io_engine_mode == IO_ENGINE_URING) ? uring_engine_submit(batch)
+                                                     : sync_engine_submit(batch);
+    for (int i = 0; i < batch->count; i++) {
+        io_request_t* request = &batch->requests[i];
+        if (!request->is_write && request->segment_type == DATA_SEGMENT && request->offset >= BLOCK_SIZE &&
+            request->offset % BLOCK_SIZE == 0 && request->length % BLOCK_SIZE == 0) {
+            block_cache_overlay((block_id_t)request->segment_number * blocks_per_segment +
+                                (request->offset - BLOCK_SIZE) / BLOCK_SIZE,
+                                request->length / BLOCK_SIZE, request->buffer);
         }
     }
-    
-    // No empty slots found, need to allocate new block
-    if (dir_inode->num_direct >= MAX_DIRECT_BLOCKS) {
-        return -1; // No more direct blocks available (need indirect blocks)
+    io_batch_reset(batch);
+    stats_time(STAT_TIME_BATCH_SUBMIT, started);
+    return result;
+}
+
+// Release the request array of a batch (unsubmitted owned buffers included)
+void io_batch_free(io_batch_t* batch) {
+    for (int i = 0; i < batch->count; i++) {
+        if (batch->requests[i].owned) free(batch->requests[i].buffer);
     }
-    
-    // Allocate new data block
-    int new_block_id = allocate_block();
-    if (new_block_id == -1) {
-        return -1;
+    free(batch->requests);
+    memset(batch, 0, sizeof(*batch));
+}
+
+// Raise the file system to at least 'revision'; returns the revision it has
+static uint32_t use_format_revision(uint32_t revision) {
+    pthread_mutex_lock(&superblock_lock);
+    if (fs_superblock.revision < revision) {
+        fs_superblock.revision = revision;
+        superblock_dirty = 1;
     }
-    
-    // Initialize directory entries
-    dir_entry_t entries[DIR_ENTRIES_PER_BLOCK];
-    // Initialize all entries to zero safely
-    memset(entries, 0, sizeof(entries));
-    
-    // Mark all entries as free
-    for (unsigned int i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
-        entries[i].inode_num = -1; 
+    revision = fs_superblock.revision;
+    pthread_mutex_unlock(&superblock_lock);
+    return revision;
+}
+
+// Queue the superblock on 'batch' if its revision was raised since the last commit
+static int queue_superblock(io_batch_t* batch) {
+    int result = 0;
+    pthread_mutex_lock(&superblock_lock);
+    if (superblock_dirty) {
+        result = io_batch_write_copy(batch, 0, INODE_SEGMENT, &fs_superblock, sizeof(fs_superblock),
+                                     SUPERBLOCK_OFFSET);
+        if (result == 0) superblock_dirty = 0;
     }
-    
-    // Add new entry
-    strncpy(entries[0].name, name, MAX_FILENAME - 1);
-    entries[0].name[MAX_FILENAME - 1] = '\0'; // Ensure null termination
-    entries[0].inode_num = child_inode_num;
-    
-    // Save entries
-    if (save_directory_entries(new_block_id, entries) != 0) {
-        free_block(new_block_id);
+    pthread_mutex_unlock(&superblock_lock);
+    return result;
+}
+
+// This function creates a new segment of segment_size bytes on disk
+int create_new_segment(int segment_number, int segment_type) {
+    char filename[SEGMENT_NAME_MAX];
+    if (segment_filename(filename, sizeof(filename), segment_number, segment_type) != 0) {
+        perror("Failed to create new segment");
         return -1;
     }
+
+    uint64_t started = stats_clock();
+    stats_count(STAT_SEGMENT_CREATES, 1);
+    forget_segment(segment_number, segment_type);
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Failed to create new segment");
+        return -1;
+    }
+
+    // Size the segment; the kernel reads the unwritten range back as zeros
+    if (ftruncate(fd, segment_size) != 0) {
+        perror("Failed to initialize segment");
+        close(fd);
+        return -1;
+    }
+
+    if (segment_type == INODE_SEGMENT && segment_number == 0) {
+        // Everything else depends on the superblock, so it is synced right away
+        superblock_t superblock;
+        memset(&superblock, 0, sizeof(superblock));
+        superblock.magic = SUPERBLOCK_MAGIC;
+        superblock.revision = EXFS2_OLDEST_REVISION;
+        superblock.segment_size = segment_size;
+        superblock.block_size = BLOCK_SIZE;
+        if (pwrite(fd, &superblock, sizeof(superblock), SUPERBLOCK_OFFSET) != sizeof(superblock) ||
+            fsync(fd) != 0) {
+            perror("Failed to write superblock");
+            close(fd);
+            return -1;
+        }
+        pthread_mutex_lock(&superblock_lock);
+        fs_superblock = superblock;
+        superblock_dirty = 0;
+        pthread_mutex_unlock(&superblock_lock);
+    }
+
+    pthread_mutex_lock(&segment_cache_lock);
+    segment_handle_t* handle = cache_segment(segment_number, segment_type, fd);
+    pthread_mutex_unlock(&segment_cache_lock);
+    if (!handle) return -1;
+    
+    if (segment_type == INODE_SEGMENT && segment_number == 0) {
+        // Initialize root directory in the first inode segment
+        inode_t root_inode;
+        memset(&root_inode, 0, sizeof(root_inode));
+        root_inode.type = INODE_DIR;
+        root_inode.flags = INODE_FLAG_HASHED_DIR;
+        root_inode.size = 0;
+        root_inode.num_direct = 0;
+        root_inode.indirect_block = -1;
+        root_inode.double_indirect_block = -1;
+        root_inode.triple_indirect_block = -1;
+        
+        // Mark root inode as used in bitmap, which ends before the superblock
+        uint8_t bitmap[SUPERBLOCK_OFFSET] = {0};
+        set_bit(bitmap, ROOT_DIR_INODE);
+        write_bitmap(0, INODE_SEGMENT, bitmap, SUPERBLOCK_OFFSET);
+        
+        // Write root inode
+        write_inode(ROOT_DIR_INODE, &root_inode);
+    }
+
+    stats_time(STAT_TIME_SEGMENT_CREATE, started);
+    return 0;
+}
+
+// Background creation of empty segments ahead of the allocators. created[] is
+// the highest segment known to exist, target[] the highest one wanted.
+int precreate_segments = DEFAULT_PRECREATE_SEGMENTS;
+
+static struct {
+    pthread_t thread;
+    int running;
+    int stop;
+    int created[2];             /* per segment type */
+    int target[2];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} precreator = { .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER };
+
+// Create a segment as an empty, preallocated file unless it exists. It is
+// sized under a temporary name and linked into place, so no one can open a
+// short segment, and link() never replaces one the allocator made meanwhile.
+static void precreate_segment(int segment_number, int segment_type) {
+    char filename[SEGMENT_NAME_MAX], temporary[SEGMENT_NAME_MAX + 8];
+    if (segment_filename(filename, sizeof(filename), segment_number, segment_type) != 0) return;
+    if (access(filename, F_OK) == 0) return;
+
+    snprintf(temporary, sizeof(temporary), "%s.new", filename);
+    int fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+    int sized = fallocate(fd, 0, 0, segment_size) == 0 || ftruncate(fd, segment_size) == 0;
+    close(fd);
+    if (sized) link(temporary, filename);
+    unlink(temporary);
+}
+
+static void* precreate_worker(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&precreator.lock);
+    while (!precreator.stop) {
+        int type = precreator.created[INODE_SEGMENT] < precreator.target[INODE_SEGMENT] ? INODE_SEGMENT
+                 : precreator.created[DATA_SEGMENT] < precreator.target[DATA_SEGMENT] ? DATA_SEGMENT : -1;
+        if (type < 0) {
+            pthread_cond_wait(&precreator.changed, &precreator.lock);
+            continue;
+        }
+        int segment_number = ++precreator.created[type];
+        pthread_mutex_unlock(&precreator.lock);
+        precreate_segment(segment_number, type);
+        pthread_mutex_lock(&precreator.lock);
+    }
+    pthread_mutex_unlock(&precreator.lock);
+    return NULL;
+}
+
+// The allocator just loaded 'segment_number': keep precreate_segments empty
+// ones ready after it, starting the worker on first use
+static void precreate_ahead(int segment_type, int segment_number) {
+    if (precreate_segments <= 0) return;
+
+    pthread_mutex_lock(&precreator.lock);
+    if (precreator.created[segment_type] < segment_number) precreator.created[segment_type] = segment_number;
+    if (precreator.target[segment_type] < segment_number + precreate_segments) {
+        precreator.target[segment_type] = segment_number + precreate_segments;
+        if (!precreator.running && pthread_create(&precreator.thread, NULL, precreate_worker, NULL) == 0) {
+            precreator.running = 1;
+        }
+        pthread_cond_signal(&precreator.changed);
+    }
+    pthread_mutex_unlock(&precreator.lock);
+}
+
+// Stop the worker and forget its progress; segments it made stay on disk
+static void precreate_stop(void) {
+    pthread_mutex_lock(&precreator.lock);
+    int running = precreator.running;
+    precreator.stop = 1;
+    pthread_cond_signal(&precreator.changed);
+    pthread_mutex_unlock(&precreator.lock);
+    if (running) pthread_join(precreator.thread, NULL);
+
+    precreator.running = 0;
+    precreator.stop = 0;
+    memset(precreator.created, 0, sizeof(precreator.created));
+    memset(precreator.target, 0, sizeof(precreator.target));
+}
+
+// This function reads the bitmap from a segment
+int read_bitmap(int segment_number, int segment_type, uint8_t* bitmap, int size) {
+    stats_count(STAT_BITMAP_READS, 1);
+    return segment_read(segment_number, segment_type, bitmap, size, 0) == 0 ? size : -1;
+}
+
+//This function writes the bit map back to the segment
+int write_bitmap(int segment_number, int segment_type, uint8_t* bitmap, int size) {
+    stats_count(STAT_BITMAP_WRITES, 1);
+    return segment_write(segment_number, segment_type, bitmap, size, 0) == 0 ? size : -1;
+}
+
+// Load 64 bits of the bitmap starting at bit word*64; bits past num_bits read as used
+static inline uint64_t load_bitmap_word(const uint8_t* bitmap, int word, int num_bits) {
+    int first_byte = word * 8;
+    int total_bytes = (num_bits + 7) / 8;
+    uint64_t value = ~0ULL;
+
+    if (first_byte + 8 <= total_bytes) {
+        memcpy(&value, bitmap + first_byte, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        value = __builtin_bswap64(value);
+#endif
+    } else {
+        value = 0;
+        for (int i = 0; first_byte + i < total_bytes; i++) {
+            value |= (uint64_t)bitmap[first_byte + i] << (8 * i);
+        }
+    }
+
+    int valid_bits = num_bits - word * 64;
+    if (valid_bits < 64) {
+        value |= ~0ULL << valid_bits;
+    }
+    return value;
+}
+
+// Find the first bit at or after 'from' whose value is 'value' (0 or 1); returns num_bits if none
+static int next_bit_with_value(const uint8_t* bitmap, int num_bits, int from, int value) {
+    if (from >= num_bits) return num_bits;
+
+    int word = from / 64;
+    int num_words = (num_bits + 63) / 64;
+    // Mask off the bits below 'from' in the first word
+    uint64_t below = (1ULL << (from % 64)) - 1;
+
+    for (; word < num_words; word++) {
+        uint64_t bits = load_bitmap_word(bitmap, word, num_bits);
+        uint64_t candidates = value ? bits : ~bits;
+        candidates &= ~below;
+        below = 0;
+
+        if (candidates) {
+            int bit = word * 64 + __builtin_ctzll(candidates);
+            return bit < num_bits ? bit : num_bits;
+        }
+    }
+    return num_bits;
+}
+
+// Indentify the first inode or data block that is marked free (with bit 0) from the bitmap.
+int find_free_bit(uint8_t* bitmap, int num_bits) {
+    int bit = next_bit_with_value(bitmap, num_bits, 0, 0);
+    return (bit < num_bits) ? bit : -1; // -1: No free bits
+}
+
+// Find the first run of at least 'want' free bits. If no run is long enough, the
+// longest run is returned instead; *run_length receives the length of the run.
+// Returns -1 when the bitmap has no free bits at all.
+int find_free_run(uint8_t* bitmap, int num_bits, int want, int* run_length) {
+    int best_start = -1;
+    int best_length = 0;
+    int pos = 0;
+
+    while (pos < num_bits) {
+        int start = next_bit_with_value(bitmap, num_bits, pos, 0);
+        if (start >= num_bits) break;
+
+        int end = next_bit_with_value(bitmap, num_bits, start, 1);
+        int length = end - start;
+        if (length >= want) {
+            *run_length = want;
+            return start;
+        }
+        if (length > best_length) {
+            best_start = start;
+            best_length = length;
+        }
+        pos = end;
+    }
+
+    *run_length = best_length;
+    return best_start;
+}
+
+// Count the bits that are 0 (free) in the first num_bits of the bitmap
+int count_free_bits(uint8_t* bitmap, int num_bits) {
+    int used = 0;
+    int num_words = (num_bits + 63) / 64;
+    for (int word = 0; word < num_words; word++) {
+        used += __builtin_popcountll(load_bitmap_word(bitmap, word, num_bits));
+    }
+    // Padding bits in the last word were counted as used
+    return num_words * 64 - used;
+}
+
+//Set the bit value to 1 in the bitmao indicating that particular inode is allocated
+void set_bit(uint8_t* bitmap, int bit) {
+    bitmap[bit / 8] |= (1 << (bit % 8));
+}
+
+//sets back the bit value to 0 indicating inode as free in bitmap
+void clear_bit(uint8_t* bitmap, int bit) {
+    bitmap[bit / 8] &= ~(1 << (bit % 8));
+}
+
+// Number of inodes or blocks that fit in one segment of the given type
+static int units_per_segment(int segment_type) {
+    if (segment_type == INODE_SEGMENT) {
+        return (segment_size - BLOCK_SIZE) / sizeof(inode_t);
+    }
+    return (segment_size - BLOCK_SIZE) / BLOCK_SIZE;
+}
+
+// Read a data segment's shared block table; an empty one stays NULL
+static int load_block_refs(int segment_number, segment_alloc_t* seg) {
+    uint32_t count;
+    if (segment_read(segment_number, DATA_SEGMENT, &count, sizeof(count), BLOCK_REFS_OFFSET) != 0) return -1;
+    if (count == 0) return 0;
+    if (count > MAX_BLOCK_REFS) {
+        fprintf(stderr, "Corrupt shared block table in data segment %d\n", segment_number);
+        return -1;
+    }
+
+    seg->refs = malloc(sizeof(block_refs_t));
+    if (!seg->refs) return -1;
+    size_t used = sizeof(uint32_t) + count * sizeof(block_ref_t);
+    if (segment_read(segment_number, DATA_SEGMENT, seg->refs, used, BLOCK_REFS_OFFSET) != 0) {
+        free(seg->refs);
+        seg->refs = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Return the in-memory bitmap of a segment, reading it from disk on first use.
+// Returns NULL if the segment does not exist yet.
+static segment_alloc_t* load_segment_alloc(allocator_t* alloc, int segment_number) {
+    if (segment_number < alloc->num_segments && alloc->segments[segment_number].bitmap) {
+        return &alloc->segments[segment_number];
+    }
+
+    if (open_segment(segment_number, alloc->segment_type) < 0) return NULL;
+
+    if (segment_number >= alloc->num_segments) {
+        int new_count = alloc->num_segments ? alloc->num_segments : 16;
+        while (new_count <= segment_number) new_count *= 2;
+
+        segment_alloc_t* grown = realloc(alloc->segments, new_count * sizeof(segment_alloc_t));
+        if (!grown) return NULL;
+        memset(grown + alloc->num_segments, 0,
+               (new_count - alloc->num_segments) * sizeof(segment_alloc_t));
+        alloc->segments = grown;
+        alloc->num_segments = new_count;
+    }
+
+    alloc->units = units_per_segment(alloc->segment_type);
+    int bitmap_bytes = (alloc->units + 7) / 8;
+    segment_alloc_t* seg = &alloc->segments[segment_number];
+    stats_count(STAT_ALLOC_SEGMENT_LOADS, 1);
+    seg->bitmap = malloc(bitmap_bytes);
+    if (!seg->bitmap) return NULL;
+
+    if (read_bitmap(segment_number, alloc->segment_type, seg->bitmap, bitmap_bytes) != bitmap_bytes ||
+        (alloc->segment_type == DATA_SEGMENT && load_block_refs(segment_number, seg) != 0)) {
+        free(seg->bitmap);
+        seg->bitmap = NULL;
+        return NULL;
+    }
+
+    // The reserved block is taken in memory; the bit reaches the disk with
+    // the next change to this bitmap
+    if (alloc->segment_type == DATA_SEGMENT && segment_number == RESERVED_DATA_BLOCK / alloc->units) {
+        set_bit(seg->bitmap, RESERVED_DATA_BLOCK % alloc->units);
+    }
+    seg->free_count = count_free_bits(seg->bitmap, alloc->units);
+    seg->dirty = 0;
+    seg->refs_dirty = 0;
+    precreate_ahead(alloc->segment_type, segment_number);
+    return seg;
+}
+
+// Take the first free unit at or after the cursor, creating segments as needed.
+// The caller holds alloc->lock.
+static int64_t take_unit(allocator_t* alloc) {
+    for (int segment_number = alloc->cursor; ; segment_number++) {
+        segment_alloc_t* seg = load_segment_alloc(alloc, segment_number);
+        if (!seg) {
+            // No segment found, create one
+            if (create_new_segment(segment_number, alloc->segment_type) != 0) {
+                return -1;
+            }
+            seg = load_segment_alloc(alloc, segment_number);
+            if (!seg) return -1;
+        }
+
+        stats_count(STAT_ALLOC_SEGMENT_SCANS, 1);
+        if (seg->free_count == 0) continue;
+
+        int bit = find_free_bit(seg->bitmap, alloc->units);
+        if (bit < 0) continue;
+
+        set_bit(seg->bitmap, bit);
+        seg->free_count--;
+        seg->dirty = 1;
+        alloc->cursor = segment_number;
+        return (int64_t)segment_number * alloc->units + bit;
+    }
+}
+
+static int64_t allocate_unit(allocator_t* alloc) {
+    pthread_mutex_lock(&alloc->lock);
+    int64_t unit = take_unit(alloc);
+    pthread_mutex_unlock(&alloc->lock);
+    return unit;
+}
+
+static int compare_units(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Clear the bits of units in their segments and pull the cursor back if needed.
+// The list is sorted first, so each segment's bitmap is looked up once. The
+// caller holds alloc->lock.
+static int clear_units(allocator_t* alloc, int64_t* list, int count) {
+    int units = units_per_segment(alloc->segment_type);
+    int result = 0;
+    if (count > 1) qsort(list, count, sizeof(int64_t), compare_units);
+
+    for (int i = 0; i < count; ) {
+        int segment_number = list[i] / units;
+        segment_alloc_t* seg = load_segment_alloc(alloc, segment_number);
+        if (!seg) result = -1;
+
+        for (; i < count && list[i] / units == segment_number; i++) {
+            int index = list[i] % units;
+            if (alloc->segment_type == DATA_SEGMENT && list[i] == RESERVED_DATA_BLOCK) continue;
+            if (seg && (seg->bitmap[index / 8] & (1 << (index % 8)))) {
+                clear_bit(seg->bitmap, index);
+                seg->free_count++;
+                seg->dirty = 1;
+            }
+            if (seg && seg->deferred) clear_bit(seg->deferred, index);
+        }
+        if (seg && segment_number < alloc->cursor) {
+            alloc->cursor = segment_number;
+        }
+    }
+    return result;
+}
+
+// Mark units as freed but held in their segments' deferred bitmaps, so a lookup
+// need not search the deferred list. The caller holds alloc->lock.
+static int mark_deferred(allocator_t* alloc, const int64_t* list, int count) {
+    int units = units_per_segment(alloc->segment_type);
+    for (int i = 0; i < count; i++) {
+        segment_alloc_t* seg = load_segment_alloc(alloc, list[i] / units);
+        if (!seg || (!seg->deferred && !(seg->deferred = calloc((units + 7) / 8, 1)))) return -1;
+        set_bit(seg->deferred, list[i] % units);
+    }
+    return 0;
+}
+
+// Give units back, or with defer_frees set note them for the next commit
+static int release_units(allocator_t* alloc, int64_t* list, int count) {
+    int result = 0;
+    pthread_mutex_lock(&alloc->lock);
+    if (!alloc->defer_frees) {
+        result = clear_units(alloc, list, count);
+    } else {
+        if (alloc->num_deferred + count > alloc->deferred_capacity) {
+            int new_capacity = alloc->deferred_capacity ? alloc->deferred_capacity : 1024;
+            while (new_capacity < alloc->num_deferred + count) new_capacity *= 2;
+            int64_t* grown = realloc(alloc->deferred, new_capacity * sizeof(int64_t));
+            if (grown) {
+                alloc->deferred = grown;
+                alloc->deferred_capacity = new_capacity;
+            }
+        }
+        if (alloc->num_deferred + count <= alloc->deferred_capacity && mark_deferred(alloc, list, count) == 0) {
+            memcpy(alloc->deferred + alloc->num_deferred, list, count * sizeof(int64_t));
+            alloc->num_deferred += count;
+        } else {
+            result = clear_units(alloc, list, count);  // No memory to wait with them
+        }
+    }
+    pthread_mutex_unlock(&alloc->lock);
+    return result;
+}
+
+static int release_unit(allocator_t* alloc, int64_t unit) {
+    return release_units(alloc, &unit, 1);
+}
+
+// Position of block 'index' in a shared block table, or where it would be inserted
+static int find_block_ref(const block_refs_t* refs, int index) {
+    int low = 0, high = refs->count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (refs->refs[middle].index < index) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+// Take another reference on an allocated data block. Fails when the block is
+// free or waiting to be, its count is at the limit, or its table is full, and
+// for the reserved block, which an older image may have given to a file.
+static int share_block(block_id_t block_id) {
+    allocator_t* alloc = &block_allocator;
+    int result = -1;
+    pthread_mutex_lock(&alloc->lock);
+
+    int units = units_per_segment(DATA_SEGMENT);
+    segment_alloc_t* seg = load_segment_alloc(alloc, block_id / units);
+    int index = block_id % units;
+    if (!seg || block_id == RESERVED_DATA_BLOCK || !(seg->bitmap[index / 8] & (1 << (index % 8))) ||
+        (seg->deferred && (seg->deferred[index / 8] & (1 << (index % 8))))) {
+        goto out;
+    }
+
+    if (!seg->refs && !(seg->refs = calloc(1, sizeof(block_refs_t)))) goto out;
+    block_refs_t* refs = seg->refs;
+    int slot = find_block_ref(refs, index);
+    if (slot < (int)refs->count && refs->refs[slot].index == index) {
+        if (refs->refs[slot].extra == UINT16_MAX) goto out;
+        refs->refs[slot].extra++;
+    } else {
+        if (refs->count == MAX_BLOCK_REFS) goto out;
+        memmove(&refs->refs[slot + 1], &refs->refs[slot], (refs->count - slot) * sizeof(block_ref_t));
+        refs->refs[slot].index = index;
+        refs->refs[slot].extra = 1;
+        refs->count++;
+    }
+    seg->refs_dirty = 1;
+    use_format_revision(EXFS2_SHARED_REVISION);
+    stats_count(STAT_BLOCK_SHARES, 1);
+    result = 0;
+
+out:
+    pthread_mutex_unlock(&alloc->lock);
+    return result;
+}
+
+// Drop one reference of each listed block that has more than one, removing it
+// from the list; returns how many blocks are left to free
+static int drop_shared_blocks(block_id_t* block_ids, int count) {
+    allocator_t* alloc = &block_allocator;
+    int units = units_per_segment(DATA_SEGMENT);
+    int kept = 0;
+    pthread_mutex_lock(&alloc->lock);
+
+    for (int i = 0; i < count; i++) {
+        segment_alloc_t* seg = load_segment_alloc(alloc, block_ids[i] / units);
+        block_refs_t* refs = seg ? seg->refs : NULL;
+        int index = block_ids[i] % units;
+        int slot = refs ? find_block_ref(refs, index) : 0;
+
+        if (!refs || slot == (int)refs->count || refs->refs[slot].index != index) {
+            block_ids[kept++] = block_ids[i];
+            continue;
+        }
+        if (--refs->refs[slot].extra == 0) {
+            refs->count--;
+            memmove(&refs->refs[slot], &refs->refs[slot + 1], (refs->count - slot) * sizeof(block_ref_t));
+        }
+        seg->refs_dirty = 1;
+    }
+
+    pthread_mutex_unlock(&alloc->lock);
+    return kept;
+}
+
+// Queue a copy of every bitmap changed since the last commit on 'batch'
+static int queue_allocator(allocator_t* alloc, io_batch_t* batch) {
+    int bitmap_bytes = (alloc->units + 7) / 8;
+    int result = 0;
+
+    pthread_mutex_lock(&alloc->lock);
+    for (int i = 0; i < alloc->num_segments; i++) {
+        segment_alloc_t* seg = &alloc->segments[i];
+        if (seg->bitmap && seg->refs_dirty) {
+            size_t used = sizeof(uint32_t) + seg->refs->count * sizeof(block_ref_t);
+            if (io_batch_write_copy(batch, i, alloc->segment_type, seg->refs, used, BLOCK_REFS_OFFSET) != 0) {
+                result = -1;
+                break;
+            }
+            seg->refs_dirty = 0;
+        }
+        if (!seg->bitmap || !seg->dirty) continue;
+
+        if (io_batch_write_copy(batch, i, alloc->segment_type, seg->bitmap, bitmap_bytes, 0) != 0) {
+            result = -1;
+            break;
+        }
+        stats_count(STAT_BITMAP_WRITES, 1);
+        seg->dirty = 0;
+    }
+    pthread_mutex_unlock(&alloc->lock);
+    return result;
+}
+
+// Forget the loaded bitmaps so the next allocation reads them from disk again
+static void drop_allocator(allocator_t* alloc) {
+    pthread_mutex_lock(&alloc->lock);
+    for (int i = 0; i < alloc->num_segments; i++) {
+        free(alloc->segments[i].bitmap);
+        free(alloc->segments[i].refs);
+        free(alloc->segments[i].deferred);
+    }
+    free(alloc->segments);
+    free(alloc->deferred);
+    alloc->segments = NULL;
+    alloc->num_segments = 0;
+    alloc->cursor = 0;
+    alloc->deferred = NULL;
+    alloc->num_deferred = 0;
+    alloc->deferred_capacity = 0;
+    pthread_mutex_unlock(&alloc->lock);
+}
+
+//Finds the first free inode and return its number (creating new inode segment if no free inode is found) 
+int allocate_inode() {
+    int inode_num = (int)allocate_unit(&inode_allocator);
+    if (inode_num >= 0) stats_count(STAT_INODE_ALLOCS, 1);
+    return inode_num;
+}
+
+// Dentry cache slot of a (directory, name hash) pair
+static dentry_t* dentry_slot(int parent, uint32_t hash) {
+    return &dentry_cache[(hash ^ ((uint32_t)parent * 2654435761u)) % DENTRY_CACHE_SIZE];
+}
+
+// Cached result of looking up 'name' in directory 'parent'; returns 1 on a hit
+static int dentry_cache_get(int parent, const char* name, uint32_t hash, int* child) {
+    int hit = 0;
+    pthread_mutex_lock(&metadata_cache_lock);
+    dentry_t* dentry = dentry_slot(parent, hash);
+    if (dentry->in_use && dentry->parent == parent && dentry->hash == hash &&
+        strcmp(dentry->name, name) == 0) {
+        *child = dentry->child;
+        hit = 1;
+    }
+    pthread_mutex_unlock(&metadata_cache_lock);
+    return hit;
+}
+
+// Remember that 'name' in directory 'parent' resolves to child (-1: absent)
+static void dentry_cache_put(int parent, const char* name, uint32_t hash, int child) {
+    pthread_mutex_lock(&metadata_cache_lock);
+    dentry_t* dentry = dentry_slot(parent, hash);
+    dentry->in_use = 1;
+    dentry->parent = parent;
+    dentry->child = child;
+    dentry->hash = hash;
+    strncpy(dentry->name, name, MAX_FILENAME - 1);
+    dentry->name[MAX_FILENAME - 1] = '\0';
+    pthread_mutex_unlock(&metadata_cache_lock);
+}
+
+// Forget everything cached about an inode that is being freed
+static void metadata_cache_forget(int inode_num) {
+    pthread_mutex_lock(&metadata_cache_lock);
+    inode_generation++;
+    cached_inode_t* cached = &inode_cache[inode_num % INODE_CACHE_SIZE];
+    if (cached->in_use && cached->inode_num == inode_num) cached->in_use = 0;
+
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        dentry_t* dentry = &dentry_cache[i];
+        if (dentry->in_use && (dentry->parent == inode_num || dentry->child == inode_num)) {
+            dentry->in_use = 0;
+        }
+    }
+    pthread_mutex_unlock(&metadata_cache_lock);
+}
+
+// Pending copy of an inode, NULL if it was not written since the last commit.
+// The caller holds metadata_cache_lock.
+static pending_inode_t* find_pending_inode(int inode_num) {
+    if (num_pending_inodes == 0) return NULL;
+    for (int i = pending_inode_heads[inode_num % PENDING_INODE_BUCKETS]; i >= 0; i = pending_inodes[i].next) {
+        if (pending_inodes[i].inode_num == inode_num) return &pending_inodes[i];
+    }
+    return NULL;
+}
+
+// Take in an inode read from its segment without metadata_cache_lock, which the
+// caller holds again. If inodes changed meanwhile, a newer copy held for this
+// one replaces what was read, and nothing is cached.
+static void settle_inode_read(int inode_num, inode_t* inode, uint64_t generation) {
+    cached_inode_t* cached = &inode_cache[inode_num % INODE_CACHE_SIZE];
+    if (generation != inode_generation) {
+        pending_inode_t* pending = find_pending_inode(inode_num);
+        if (pending) {
+            memcpy(inode, &pending->inode, sizeof(inode_t));
+        } else if (cached->in_use && cached->inode_num == inode_num) {
+            memcpy(inode, &cached->inode, sizeof(inode_t));
+        }
+        return;
+    }
+    cached->in_use = 1;
+    cached->inode_num = inode_num;
+    memcpy(&cached->inode, inode, sizeof(inode_t));
+}
+
+// Hold an inode for the next commit; -1 if there is no memory for it.
+// The caller holds metadata_cache_lock.
+static int put_pending_inode(int inode_num, const inode_t* inode) {
+    pending_inode_t* pending = find_pending_inode(inode_num);
+    if (!pending) {
+        if (num_pending_inodes == pending_inode_capacity) {
+            int new_capacity = pending_inode_capacity ? pending_inode_capacity * 2 : 64;
+            pending_inode_t* grown = realloc(pending_inodes, new_capacity * sizeof(pending_inode_t));
+            if (!grown) return -1;
+            pending_inodes = grown;
+            pending_inode_capacity = new_capacity;
+        }
+        if (num_pending_inodes == 0) {
+            for (int i = 0; i < PENDING_INODE_BUCKETS; i++) pending_inode_heads[i] = -1;
+        }
+        int bucket = inode_num % PENDING_INODE_BUCKETS;
+        pending = &pending_inodes[num_pending_inodes];
+        pending->inode_num = inode_num;
+        pending->next = pending_inode_heads[bucket];
+        pending_inode_heads[bucket] = num_pending_inodes++;
+    }
+    memcpy(&pending->inode, inode, sizeof(inode_t));
+    return 0;
+}
+
+// Queue every pending inode on 'batch' and forget them
+static int queue_pending_inodes(io_batch_t* batch) {
+    int num_inodes_per_segment = (segment_size - BLOCK_SIZE) / sizeof(inode_t);
+    int result = 0;
+
+    pthread_mutex_lock(&metadata_cache_lock);
+    for (int i = 0; i < num_pending_inodes && result == 0; i++) {
+        int inode_num = pending_inodes[i].inode_num;
+        result = io_batch_write_copy(batch, inode_num / num_inodes_per_segment, INODE_SEGMENT,
+                                     &pending_inodes[i].inode, sizeof(inode_t),
+                                     BLOCK_SIZE + (off_t)(inode_num % num_inodes_per_segment) * sizeof(inode_t));
+    }
+    if (result == 0) num_pending_inodes = 0;
+    pthread_mutex_unlock(&metadata_cache_lock);
+    return result;
+}
+
+// Empty both metadata caches and drop inodes that were never committed
+static void metadata_cache_clear(void) {
+    pthread_mutex_lock(&metadata_cache_lock);
+    inode_generation++;
+    memset(inode_cache, 0, sizeof(inode_cache));
+    memset(dentry_cache, 0, sizeof(dentry_cache));
+    free(pending_inodes);
+    pending_inodes = NULL;
+    num_pending_inodes = 0;
+    pending_inode_capacity = 0;
+    pthread_mutex_unlock(&metadata_cache_lock);
+}
+
+//Read the inode meta data and the pointers, through the inode cache and the
+// inodes waiting for the next commit
+int read_inode(int inode_num, inode_t* out_inode) {
+    int num_inodes_per_segment = (segment_size - BLOCK_SIZE) / sizeof(inode_t);
+    int segment_number = inode_num / num_inodes_per_segment;
+    int index_in_segment = inode_num % num_inodes_per_segment;
+
+    stats_count(STAT_INODE_READS, 1);
+    pthread_mutex_lock(&metadata_cache_lock);
+    cached_inode_t* cached = &inode_cache[inode_num % INODE_CACHE_SIZE];
+    if (cached->in_use && cached->inode_num == inode_num) {
+        memcpy(out_inode, &cached->inode, sizeof(inode_t));
+        pthread_mutex_unlock(&metadata_cache_lock);
+        stats_count(STAT_INODE_CACHE_HITS, 1);
+        return 0;
+    }
+
+    pending_inode_t* pending = find_pending_inode(inode_num);
+    if (pending) {
+        memcpy(out_inode, &pending->inode, sizeof(inode_t));
+        cached->in_use = 1;
+        cached->inode_num = inode_num;
+        memcpy(&cached->inode, out_inode, sizeof(inode_t));
+        pthread_mutex_unlock(&metadata_cache_lock);
+        stats_count(STAT_INODE_CACHE_HITS, 1);
+        return 0;
+    }
+    uint64_t generation = inode_generation;
+    pthread_mutex_unlock(&metadata_cache_lock);
+
+    // Inodes start after bitmap block
+    int result = segment_read(segment_number, INODE_SEGMENT, out_inode, sizeof(inode_t),
+                              BLOCK_SIZE + index_in_segment * sizeof(inode_t));
+    if (result == 0) {
+        pthread_mutex_lock(&metadata_cache_lock);
+        settle_inode_read(inode_num, out_inode, generation);
+        pthread_mutex_unlock(&metadata_cache_lock);
+    }
+    return result;
+}
+
+// Position of one requested inode, sorted by inode number to find runs
+typedef struct {
+    int inode_num;
+    int index;                  /* slot in the caller's output array */
+} inode_request_t;
+
+static int compare_inode_requests(const void* a, const void* b) {
+    const inode_request_t* x = a;
+    const inode_request_t* y = b;
+    return (x->inode_num > y->inode_num) - (x->inode_num < y->inode_num);
+}
+
+// Read several inodes at once. Cache hits are copied; the misses are sorted and
+// every run of consecutive inodes in one segment becomes a single request,
+// all submitted as one I/O batch. Inodes are block aligned, so runs are too.
+int read_inodes(const int* inode_nums, int count, inode_t* out_inodes) {
+    int num_inodes_per_segment = (segment_size - BLOCK_SIZE) / sizeof(inode_t);
+    inode_request_t* missing = malloc((count ? count : 1) * sizeof(inode_request_t));
+    if (!missing) return -1;
+
+    pthread_mutex_lock(&metadata_cache_lock);
+    int num_missing = 0;
+    for (int i = 0; i < count; i++) {
+        cached_inode_t* cached = &inode_cache[inode_nums[i] % INODE_CACHE_SIZE];
+        pending_inode_t* pending;
+        if (cached->in_use && cached->inode_num == inode_nums[i]) {
+            memcpy(&out_inodes[i], &cached->inode, sizeof(inode_t));
+        } else if ((pending = find_pending_inode(inode_nums[i])) != NULL) {
+            memcpy(&out_inodes[i], &pending->inode, sizeof(inode_t));
+        } else {
+            missing[num_missing].inode_num = inode_nums[i];
+            missing[num_missing++].index = i;
+        }
+    }
+
+    uint64_t generation = inode_generation;
+    pthread_mutex_unlock(&metadata_cache_lock);
+    stats_count(STAT_INODE_READS, count);
+    stats_count(STAT_INODE_CACHE_HITS, count - num_missing);
+
+    int result = 0;
+    inode_t* scratch = num_missing ? malloc(num_missing * sizeof(inode_t)) : NULL;
+    if (num_missing && !scratch) result = -1;
+
+    if (scratch) {
+        qsort(missing, num_missing, sizeof(inode_request_t), compare_inode_requests);
+
+        io_batch_t batch = {0};
+        for (int start = 0, run; start < num_missing; start += run) {
+            int segment_number = missing[start].inode_num / num_inodes_per_segment;
+            int index_in_segment = missing[start].inode_num % num_inodes_per_segment;
+            run = 1;
+            while (start + run < num_missing &&
+                   missing[start + run].inode_num == missing[start].inode_num + run &&
+                   index_in_segment + run < num_inodes_per_segment) {
+                run++;
+            }
+            if (io_batch_push(&batch, segment_number, INODE_SEGMENT, scratch + start,
+                              (size_t)run * sizeof(inode_t),
+                              BLOCK_SIZE + (off_t)index_in_segment * sizeof(inode_t), 0, 0) != 0) {
+                result = -1;
+                break;
+            }
+        }
+        if (result == 0 && io_batch_submit(&batch) != 0) result = -1;
+        io_batch_free(&batch);
+
+        pthread_mutex_lock(&metadata_cache_lock);
+        for (int k = 0; result == 0 && k < num_missing; k++) {
+            settle_inode_read(missing[k].inode_num, &scratch[k], generation);
+            memcpy(&out_inodes[missing[k].index], &scratch[k], sizeof(inode_t));
+        }
+        pthread_mutex_unlock(&metadata_cache_lock);
+    }
+
+    free(scratch);
+    free(missing);
+    return result;
+}
+
+//write the metadata to inode, keeping the cached copy in step. The inode
+// reaches its segment with the next journal commit.
+int write_inode(int inode_num, inode_t* in_inode) {
+    int num_inodes_per_segment = (segment_size - BLOCK_SIZE) / sizeof(inode_t);
+    int segment_number = inode_num / num_inodes_per_segment;
+    int index_in_segment = inode_num % num_inodes_per_segment;
+    uint32_t needed = (in_inode->flags & INODE_FLAG_COMPRESSED) ? EXFS2_COMPRESSED_REVISION
+                    : (in_inode->flags & INODE_FLAG_INLINE) ? EXFS2_INLINE_REVISION : EXFS2_OLDEST_REVISION;
+    in_inode->revision = use_format_revision(needed);
+    stats_count(STAT_INODE_WRITES, 1);
+
+    pthread_mutex_lock(&metadata_cache_lock);
+    inode_generation++;
+    int result = put_pending_inode(inode_num, in_inode);
+    if (result != 0) {
+        // No memory to hold it: write it in place. Inodes start after bitmap block
+        result = segment_write(segment_number, INODE_SEGMENT, in_inode, sizeof(inode_t),
+                               BLOCK_SIZE + index_in_segment * sizeof(inode_t));
+    }
+    cached_inode_t* cached = &inode_cache[inode_num % INODE_CACHE_SIZE];
+    if (result == 0) {
+        cached->in_use = 1;
+        cached->inode_num = inode_num;
+        memcpy(&cached->inode, in_inode, sizeof(inode_t));
+    } else if (cached->inode_num == inode_num) {
+        cached->in_use = 0;
+    }
+    pthread_mutex_unlock(&metadata_cache_lock);
+    return result;
+}
+
+//Clear the inode metadata and make the inode empty 
+int free_inode(int inode_num) {
+    stats_count(STAT_INODE_FREES, 1);
+    metadata_cache_forget(inode_num);
+    return release_unit(&inode_allocator, inode_num);
+}
+
+//Identify the first free data block of 4kb in the data segment and 
+block_id_t allocate_block() {
+    block_id_t block_id = allocate_unit(&block_allocator);
+    if (block_id >= 0) stats_count(STAT_BLOCK_ALLOCS, 1);
+    return block_id;
+}
+
+// Reserve up to 'want' contiguous blocks inside one data segment; returns the
+// first block id and stores the number actually reserved in *count
+block_id_t allocate_extent(int want, int* count) {
+    allocator_t* alloc = &block_allocator;
+    if (want > blocks_per_segment) want = blocks_per_segment;
+    if (want < 1) want = 1;
+
+    int best_segment = -1;
+    int best_start = -1;
+    int best_length = 0;
+
+    pthread_mutex_lock(&alloc->lock);
+    // Look a few segments past the cursor for a run that fits the whole request
+    int first_segment = alloc->cursor;
+    for (int segment_number = first_segment;
+         segment_number < first_segment + EXTENT_SCAN_SEGMENTS; segment_number++) {
+        segment_alloc_t* seg = load_segment_alloc(alloc, segment_number);
+        if (!seg) {
+            if (best_segment >= 0) break;  // Settle for the longest run seen
+            if (create_new_segment(segment_number, DATA_SEGMENT) != 0 ||
+                !(seg = load_segment_alloc(alloc, segment_number))) {
+                pthread_mutex_unlock(&alloc->lock);
+                return -1;
+            }
+        }
+
+        stats_count(STAT_ALLOC_SEGMENT_SCANS, 1);
+        if (seg->free_count == 0) {
+            if (segment_number == alloc->cursor) alloc->cursor++;
+            continue;
+        }
+
+        int length = 0;
+        int start = find_free_run(seg->bitmap, alloc->units, want, &length);
+        if (start >= 0 && length > best_length) {
+            best_segment = segment_number;
+            best_start = start;
+            best_length = length;
+        }
+        if (best_length == want) break;
+    }
+
+    if (best_segment < 0) {
+        // Every scanned segment is full, fall back to single block allocation
+        *count = 1;
+        block_id_t block = take_unit(alloc);
+        pthread_mutex_unlock(&alloc->lock);
+        if (block >= 0) stats_count(STAT_BLOCK_ALLOCS, 1);
+        return block;
+    }
+
+    segment_alloc_t* seg = &alloc->segments[best_segment];
+    for (int i = 0; i < best_length; i++) {
+        set_bit(seg->bitmap, best_start + i);
+    }
+    seg->free_count -= best_length;
+    seg->dirty = 1;
+    pthread_mutex_unlock(&alloc->lock);
+    stats_count(STAT_BLOCK_ALLOCS, best_length);
+
+    *count = best_length;
+    return (block_id_t)best_segment * alloc->units + best_start;
+}
+
+// Copy the 4kb data block into the buffer and read, through the block cache
+int read_block(block_id_t block_id, void* buffer) {
+    int segment_number = block_id / blocks_per_segment;
+    int block_index = block_id % blocks_per_segment;
+
+    stats_count(STAT_BLOCK_READS, 1);
+    pthread_mutex_lock(&block_cache_lock);
+    int slot = block_cache_ready ? block_cache_find(block_id) : -1;
+    if (slot >= 0) {
+        memcpy(buffer, block_cache[slot].data, BLOCK_SIZE);
+        block_cache[slot].referenced = 1;
+        pthread_mutex_unlock(&block_cache_lock);
+        stats_count(STAT_BLOCK_CACHE_HITS, 1);
+        return 0;
+    }
+    unsigned long generation = block_cache_generation;
+    pthread_mutex_unlock(&block_cache_lock);
+
+    // Blocks start after bitmap block. The read runs unlocked, so the copy is
+    // only cached if nothing rewrote or dropped a cached block meanwhile.
+    int result = segment_read(segment_number, DATA_SEGMENT, buffer, BLOCK_SIZE,
+                              BLOCK_SIZE + (off_t)block_index * BLOCK_SIZE);
+    if (result == 0) {
+        pthread_mutex_lock(&block_cache_lock);
+        if (generation == block_cache_generation) block_cache_put(block_id, buffer, 0);
+        pthread_mutex_unlock(&block_cache_lock);
+    }
+    return result;
+}
+
+// Write the data from buffer to a data block. The block cache keeps the new
+// contents until it is flushed or the block is evicted.
+int write_block(block_id_t block_id, void* buffer) {
+    int segment_number = block_id / blocks_per_segment;
+    int block_index = block_id % blocks_per_segment;
+    stats_count(STAT_BLOCK_WRITES, 1);
+
+    pthread_mutex_lock(&block_cache_lock);
+    block_cache_generation++;
+    int cached = block_cache_put(block_id, buffer, 1);
+    pthread_mutex_unlock(&block_cache_lock);
+    if (cached == 0) return 0;
+
+    // Blocks start after bitmap block
+    return segment_write(segment_number, DATA_SEGMENT, buffer, BLOCK_SIZE,
+                         BLOCK_SIZE + (off_t)block_index * BLOCK_SIZE);
+}
+
+// Read 'count' consecutive blocks of one segment with a single request
+int read_blocks(block_id_t first_block, int count, void* buffer) {
+    int segment_number = first_block / blocks_per_segment;
+    int block_index = first_block % blocks_per_segment;
+    size_t length = (size_t)count * BLOCK_SIZE;
+
+    if (block_index + count > blocks_per_segment) return -1;
+    stats_count(STAT_BLOCK_READS, count);
+
+    if (segment_read(segment_number, DATA_SEGMENT, buffer, length,
+                     BLOCK_SIZE + (off_t)block_index * BLOCK_SIZE) != 0) {
+        return -1;
+    }
+    block_cache_overlay(first_block, count, buffer);
+    return 0;
+}
+
+// Write 'count' consecutive blocks of one segment with a single request
+int write_blocks(block_id_t first_block, int count, void* buffer) {
+    int segment_number = first_block / blocks_per_segment;
+    int block_index = first_block % blocks_per_segment;
+    size_t length = (size_t)count * BLOCK_SIZE;
+
+    if (block_index + count > blocks_per_segment) return -1;
+    stats_count(STAT_BLOCK_WRITES, count);
+    block_cache_forget(first_block, count);
+
+    return segment_write(segment_number, DATA_SEGMENT, buffer, length,
+                         BLOCK_SIZE + (off_t)block_index * BLOCK_SIZE);
+}
+
+static void dedup_index_filename(char* filename, size_t len) {
+    snprintf(filename, len, "%s/%s", segment_directory, DEDUP_INDEX_FILE);
+}
+
+// Freed file data blocks leave the fingerprint index; no other block is ever in
+// it. A process that has not loaded the index cannot keep the saved one
+// current, so it deletes it instead.
+static int dedup_index_deleted = 0;
+
+static void forget_fingerprints(const block_id_t* block_ids, int count) {
+    if (count == 0) return;
+    if (dedup_index_loaded()) {
+        dedup_index_forget(block_ids, count);
+    } else if (__atomic_exchange_n(&dedup_index_deleted, 1, __ATOMIC_RELAXED) == 0) {
+        char filename[SEGMENT_NAME_MAX];
+        dedup_index_filename(filename, sizeof(filename));
+        unlink(filename);
+    }
+}
+
+// Mark the block as free in its segment bitmap
+int free_block(block_id_t block_id) {
+    if (drop_shared_blocks(&block_id, 1) == 0) return 0;
+    stats_count(STAT_BLOCK_FREES, 1);
+    block_cache_forget(block_id, 1);
+    return release_unit(&block_allocator, block_id);
+}
+
+// Free many blocks with one pass over their segments; sorts block_ids. Shared
+// blocks only lose a reference and are dropped from the list.
+int free_blocks(block_id_t* block_ids, int count) {
+    count = drop_shared_blocks(block_ids, count);
+    stats_count(STAT_BLOCK_FREES, count);
+
+    pthread_mutex_lock(&block_cache_lock);
+    for (int i = 0; block_cache_used > 0 && i < count; i++) {
+        int slot = block_cache_find(block_ids[i]);
+        if (slot >= 0) block_cache_unlink(slot);
+    }
+    block_cache_generation++;
+    pthread_mutex_unlock(&block_cache_lock);
+    return release_units(&block_allocator, block_ids, count);
+}
+
+// Give back a file's data blocks: shared ones lose this file's reference, the
+// rest leave the fingerprint index and are freed. Sorts and shrinks 'data'.
+static int release_file_blocks(block_map_t* data) {
+    data->count = drop_shared_blocks(data->blocks, data->count);
+    forget_fingerprints(data->blocks, data->count);
+    return free_blocks(data->blocks, data->count);
+}
+
+// Checker repair: record 'extra' references beyond the first in a data block's
+// shared block table (0 drops its entry). Committed with the next journal commit.
+int repair_block_refs(block_id_t block_id, int extra) {
+    allocator_t* alloc = &block_allocator;
+    int units = units_per_segment(DATA_SEGMENT);
+    int index = block_id % units;
+    int result = -1;
+    if (extra > UINT16_MAX) extra = UINT16_MAX;
+    pthread_mutex_lock(&alloc->lock);
+
+    segment_alloc_t* seg = load_segment_alloc(alloc, block_id / units);
+    if (!seg) goto out;
+    if (!seg->refs && !(seg->refs = calloc(1, sizeof(block_refs_t)))) goto out;
+    block_refs_t* refs = seg->refs;
+    int slot = find_block_ref(refs, index);
+    int found = slot < (int)refs->count && refs->refs[slot].index == index;
+    if (found && extra > 0) {
+        refs->refs[slot].extra = extra;
+    } else if (found) {
+        refs->count--;
+        memmove(&refs->refs[slot], &refs->refs[slot + 1], (refs->count - slot) * sizeof(block_ref_t));
+    } else if (extra > 0) {
+        if (refs->count == MAX_BLOCK_REFS) goto out;
+        memmove(&refs->refs[slot + 1], &refs->refs[slot], (refs->count - slot) * sizeof(block_ref_t));
+        refs->refs[slot].index = index;
+        refs->refs[slot].extra = extra;
+        refs->count++;
+    }
+    seg->refs_dirty = 1;
+    result = 0;
+
+out:
+    pthread_mutex_unlock(&alloc->lock);
+    return result;
+}
+
+// Checker repair: mark a data block used without allocating it, or release a
+// leaked one whatever its shared block table says
+int repair_block_bit(block_id_t block_id, int used) {
+    allocator_t* alloc = &block_allocator;
+    if (!used) {
+        if (repair_block_refs(block_id, 0) != 0) return -1;
+        block_cache_forget(block_id, 1);
+        forget_fingerprints(&block_id, 1);
+        return release_unit(alloc, block_id);
+    }
+
+    int units = units_per_segment(DATA_SEGMENT);
+    int index = block_id % units;
+    pthread_mutex_lock(&alloc->lock);
+    segment_alloc_t* seg = load_segment_alloc(alloc, block_id / units);
+    if (seg && !(seg->bitmap[index / 8] & (1 << (index % 8)))) {
+        set_bit(seg->bitmap, index);
+        seg->free_count--;
+        seg->dirty = 1;
+    }
+    pthread_mutex_unlock(&alloc->lock);
+    return seg ? 0 : -1;
+}
+
+// Append a physical block id to a block map, growing it as needed
+static int block_map_push(block_map_t* map, block_id_t block_id) {
+    if (map->count == map->capacity) {
+        int new_capacity = map->capacity ? map->capacity * 2 : 1024;
+        block_id_t* grown = realloc(map->blocks, new_capacity * sizeof(block_id_t));
+        if (!grown) return -1;
+        map->blocks = grown;
+        map->capacity = new_capacity;
+    }
+    map->blocks[map->count++] = block_id;
+    return 0;
+}
+
+// Start mapping data blocks into an empty inode, in logical order. With a batch,
+// completed pointer blocks are queued on it instead of being written directly.
+void pointer_builder_init(pointer_builder_t* builder, inode_t* inode, io_batch_t* batch) {
+    memset(builder, 0, sizeof(*builder));
+    builder->inode = inode;
+    builder->batch = batch;
+}
+
+// Write one open pointer block, or queue a copy of it on the builder's batch
+static int pointer_builder_write(pointer_builder_t* builder, int level) {
+    block_id_t block_id = builder->node_ids[level];
+    if (!builder->batch) {
+        return write_block(block_id, builder->nodes[level]);
+    }
+    return io_batch_write_copy(builder->batch, block_id / blocks_per_segment, DATA_SEGMENT,
+                               builder->nodes[level], BLOCK_SIZE,
+                               BLOCK_SIZE + (off_t)(block_id % blocks_per_segment) * BLOCK_SIZE);
+}
+
+// Write out every pointer block of the tree that is currently open
+static int pointer_builder_flush(pointer_builder_t* builder) {
+    int result = 0;
+    for (int level = 0; level < builder->depth; level++) {
+        if (pointer_builder_write(builder, level) != 0) {
+            result = -1;
+        }
+    }
+    builder->depth = 0;
+    return result;
+}
+
+// Append the next data block of the file. Pointer blocks are filled in memory and
+// each one is written exactly once, when it is full or when the tree is finished.
+int pointer_builder_add(pointer_builder_t* builder, block_id_t block_id) {
+    inode_t* inode = builder->inode;
+    long long index = builder->total_blocks;
+
+    // Noted first, so the caller can give back a block that could not be mapped
+    if (builder->taken && block_id != COMPRESSED_SLOT && block_map_push(builder->taken, block_id) != 0) {
+        free_block(block_id);
+        return -1;
+    }
+
+    if (index < MAX_DIRECT_BLOCKS) {
+        inode->direct_blocks[inode->num_direct++] = block_id;
+        builder->total_blocks++;
+        return 0;
+    }
+
+    // Find which tree the block falls in and its index inside that tree
+    index -= MAX_DIRECT_BLOCKS;
+    int depth = 1;
+    long long span = POINTERS_PER_BLOCK;
+    while (index >= span) {
+        index -= span;
+        if (++depth > 3) {
+            fprintf(stderr, "File exceeds the triple indirect range\n");
+            return -1;
+        }
+        span *= POINTERS_PER_BLOCK;
+    }
+
+    if (index == 0) {
+        // Entering a new tree, the previous one is complete
+        if (pointer_builder_flush(builder) != 0) return -1;
+        builder->depth = depth;
+    }
+
+    int digits[3];
+    long long rest = index;
+    for (int level = depth - 1; level >= 0; level--) {
+        digits[level] = rest % POINTERS_PER_BLOCK;
+        rest /= POINTERS_PER_BLOCK;
+    }
+
+    // A level needs a fresh pointer block whenever every digit below it wraps to zero
+    for (int level = 0; level < depth; level++) {
+        int wrapped = 1;
+        for (int k = level; k < depth; k++) {
+            if (digits[k] != 0) wrapped = 0;
+        }
+        if (!wrapped) continue;
+
+        if (level > 0 && index > 0) {
+            // The previous block at this level is full
+            if (pointer_builder_write(builder, level) != 0) return -1;
+        }
+
+        block_id_t new_block = allocate_block();
+        if (new_block == -1) {
+            fprintf(stderr, "Failed to allocate pointer block\n");
+            return -1;
+        }
+        if (builder->taken && block_map_push(builder->taken, new_block) != 0) {
+            free_block(new_block);
+            return -1;
+        }
+        builder->node_ids[level] = new_block;
+        memset(builder->nodes[level], 0, sizeof(builder->nodes[level]));
+
+        if (level == 0) {
+            if (depth == 1) inode->indirect_block = new_block;
+            else if (depth == 2) inode->double_indirect_block = new_block;
+            else inode->triple_indirect_block = new_block;
+        } else {
+            builder->nodes[level - 1][digits[level - 1]] = new_block;
+        }
+    }
+
+    builder->nodes[depth - 1][digits[depth - 1]] = block_id;
+    builder->total_blocks++;
+    return 0;
+}
+
+// Write the pointer blocks that are still only in memory
+int pointer_builder_finish(pointer_builder_t* builder) {
+    return pointer_builder_flush(builder);
+}
+
+// Collect the data blocks below a pointer block of the given depth (1 = indirect),
+// and with 'nodes' the pointer blocks that were read. The tree is read one level
+// at a time, MAP_BATCH_BLOCKS pointer blocks per I/O batch.
+static int collect_pointer_tree(block_id_t root, int depth, block_map_t* map, long long limit,
+                                block_map_t* nodes) {
+    block_map_t level = {0};
+    block_map_t next = {0};
+    block_id_t* pointers = malloc((size_t)MAP_BATCH_BLOCKS * BLOCK_SIZE);
+    io_batch_t batch = {0};
+    int result = -1;
+
+    if (!pointers || block_map_push(&level, root) != 0) goto out;
+
+    // Interior nodes may be partly filled, so only the data level is cut off at
+    // the file size
+    for (int d = depth; d >= 1; d--) {
+        next.count = 0;
+
+        for (int start = 0; start < level.count && map->count < limit; start += MAP_BATCH_BLOCKS) {
+            int n = level.count - start;
+            if (n > MAP_BATCH_BLOCKS) n = MAP_BATCH_BLOCKS;
+
+            for (int i = 0; i < n; i++) {
+                io_batch_read_blocks(&batch, level.blocks[start + i], 1, pointers + i * POINTERS_PER_BLOCK);
+                if (nodes && block_map_push(nodes, level.blocks[start + i]) != 0) goto out;
+            }
+            if (io_batch_submit(&batch) != 0) goto out;
+
+            for (int i = 0; i < n && map->count < limit; i++) {
+                block_id_t* node = pointers + i * POINTERS_PER_BLOCK;
+                for (int j = 0; j < POINTERS_PER_BLOCK && map->count < limit; j++) {
+                    if (node[j] == 0) break;
+                    if (block_map_push(d == 1 ? map : &next, node[j]) != 0) goto out;
+                }
+            }
+        }
+
+        block_map_t swap = level;
+        level = next;
+        next = swap;
+    }
+    result = 0;
+
+out:
+    io_batch_free(&batch);
+    free(pointers);
+    free(level.blocks);
+    free(next.blocks);
+    return result;
+}
+
+// Where logical block 'logical' of an inode lives: 0 for a direct block, else the
+// depth of the pointer tree holding it, with *index its position inside that tree
+static int logical_block_depth(long long logical, long long* index) {
+    if (logical < MAX_DIRECT_BLOCKS) {
+        *index = logical;
+        return 0;
+    }
+
+    long long rest = logical - MAX_DIRECT_BLOCKS;
+    long long span = POINTERS_PER_BLOCK;
+    for (int depth = 1; depth <= 3; depth++, span *= POINTERS_PER_BLOCK) {
+        if (rest < span) {
+            *index = rest;
+            return depth;
+        }
+        rest -= span;
+    }
+    return -1;
+}
+
+// Root pointer of the tree of the given depth
+static block_id_t* inode_tree_root(inode_t* inode, int depth) {
+    if (depth == 1) return &inode->indirect_block;
+    if (depth == 2) return &inode->double_indirect_block;
+    return &inode->triple_indirect_block;
+}
+
+// Allocate a pointer block with every slot empty
+static block_id_t allocate_pointer_block(void) {
+    block_id_t block_id = allocate_block();
+    if (block_id == -1) return -1;
+
+    block_id_t pointers[POINTERS_PER_BLOCK] = {0};
+    if (write_block(block_id, pointers) != 0) {
+        free_block(block_id);
+        return -1;
+    }
+    return block_id;
+}
+
+// Physical block behind logical block 'logical' of an inode, -1 if it is not mapped
+block_id_t inode_block_at(inode_t* inode, long long logical) {
+    long long index;
+    int depth = logical_block_depth(logical, &index);
+    if (depth < 0) return -1;
+    if (depth == 0) return logical < inode->num_direct ? inode->direct_blocks[logical] : -1;
+
+    long long span = 1;
+    for (int d = 1; d < depth; d++) span *= POINTERS_PER_BLOCK;
+
+    block_id_t node = *inode_tree_root(inode, depth);
+    for (int level = depth; level >= 1; level--, span /= POINTERS_PER_BLOCK) {
+        block_id_t pointers[POINTERS_PER_BLOCK];
+        if (node == -1 || read_block(node, pointers) != 0) return -1;
+
+        node = pointers[index / span];
+        index %= span;
+        if (node == 0) return -1;
+    }
+    return node;
+}
+
+// Map logical block 'logical' of an inode to block_id, allocating the pointer
+// blocks on the way. Direct blocks are filled in order; the caller writes the inode.
+int inode_set_block(inode_t* inode, long long logical, block_id_t block_id) {
+    long long index;
+    int depth = logical_block_depth(logical, &index);
+    if (depth < 0) return -1;
+    if (depth == 0) {
+        if (logical > inode->num_direct) return -1;
+        inode->direct_blocks[logical] = block_id;
+        if (logical == inode->num_direct) inode->num_direct++;
+        return 0;
+    }
+
+    block_id_t* root = inode_tree_root(inode, depth);
+    if (*root == -1 && (*root = allocate_pointer_block()) == -1) return -1;
+
+    long long span = 1;
+    for (int d = 1; d < depth; d++) span *= POINTERS_PER_BLOCK;
+
+    block_id_t node = *root;
+    for (int level = depth; level >= 1; level--, span /= POINTERS_PER_BLOCK) {
+        block_id_t pointers[POINTERS_PER_BLOCK];
+        if (read_block(node, pointers) != 0) return -1;
+
+        int slot = index / span;
+        index %= span;
+        if (level == 1) {
+            pointers[slot] = block_id;
+            return write_block(node, pointers);
+        }
+        if (pointers[slot] == 0) {
+            if ((pointers[slot] = allocate_pointer_block()) == -1) return -1;
+            if (write_block(node, pointers) != 0) return -1;
+        }
+        node = pointers[slot];
+    }
+    return -1;
+}
+
+// Resolve every data block of a file, in logical order, into map->blocks
+int build_block_map(inode_t* inode, block_map_t* map) {
+    memset(map, 0, sizeof(*map));
+    long long limit = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    for (int i = 0; i < inode->num_direct && map->count < limit; i++) {
+        if (block_map_push(map, inode->direct_blocks[i]) != 0) goto fail;
+    }
+
+    block_id_t roots[3] = { inode->indirect_block, inode->double_indirect_block,
+                     inode->triple_indirect_block };
+    for (int depth = 1; depth <= 3 && map->count < limit; depth++) {
+        if (roots[depth - 1] == -1) break;
+        if (collect_pointer_tree(roots[depth - 1], depth, map, limit, NULL) != 0) goto fail;
+    }
+    return 0;
+
+fail:
+    free_block_map(map);
+    return -1;
+}
+
+// Every block an inode holds: data blocks in logical order into 'data', pointer
+// blocks into 'nodes'. Unlike build_block_map() nothing is cut off at the file
+// size, so blocks mapped past the end are reclaimed too.
+static int collect_inode_blocks(inode_t* inode, block_map_t* data, block_map_t* nodes) {
+    memset(data, 0, sizeof(*data));
+    memset(nodes, 0, sizeof(*nodes));
+
+    for (int i = 0; i < inode->num_direct; i++) {
+        if (block_map_push(data, inode->direct_blocks[i]) != 0) goto fail;
+    }
+    for (int depth = 1; depth <= 3; depth++) {
+        block_id_t root = *inode_tree_root(inode, depth);
+        if (root != -1 && collect_pointer_tree(root, depth, data, LLONG_MAX, nodes) != 0) goto fail;
+    }
+
+    // Slots a compressed cluster saved hold no block
+    if (inode->flags & INODE_FLAG_COMPRESSED) {
+        int kept = 0;
+        for (int i = 0; i < data->count; i++) {
+            if (data->blocks[i] != COMPRESSED_SLOT) data->blocks[kept++] = data->blocks[i];
+        }
+        data->count = kept;
+    }
+    return 0;
+
+fail:
+    free_block_map(data);
+    free_block_map(nodes);
+    return -1;
+}
+
+// Append the data blocks with indices [from, to) inside a pointer tree of the
+// given depth, reading only the pointer blocks that cover that range
+static int collect_tree_range(block_id_t node, int depth, long long from, long long to, block_map_t* map) {
+    block_id_t pointers[POINTERS_PER_BLOCK];
+    if (read_block(node, pointers) != 0) return -1;
+
+    long long span = 1;
+    for (int d = 1; d < depth; d++) span *= POINTERS_PER_BLOCK;
+
+    for (long long slot = from / span; slot < POINTERS_PER_BLOCK && slot * span < to; slot++) {
+        if (pointers[slot] == 0) break;
+        if (depth == 1) {
+            if (block_map_push(map, pointers[slot]) != 0) return -1;
+            continue;
+        }
+        long long base = slot * span;
+        long long lo = from > base ? from - base : 0;
+        long long hi = to < base + span ? to - base : span;
+        if (collect_tree_range(pointers[slot], depth - 1, lo, hi, map) != 0) return -1;
+    }
+    return 0;
+}
+
+// Resolve logical blocks [first, first + count) of a file into map->blocks. The
+// range is cut at the end of the file; the pointer slots are found arithmetically.
+int build_range_map(inode_t* inode, long long first, long long count, block_map_t* map) {
+    memset(map, 0, sizeof(*map));
+    long long limit = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    long long end = first + count;
+    if (end > limit) end = limit;
+
+    for (long long i = first; i < end && i < inode->num_direct; i++) {
+        if (block_map_push(map, inode->direct_blocks[i]) != 0) goto fail;
+    }
+
+    // Logical blocks covered by each tree start where the previous one ends
+    long long tree_start = MAX_DIRECT_BLOCKS;
+    long long span = POINTERS_PER_BLOCK;
+    for (int depth = 1; depth <= 3 && tree_start < end; depth++, tree_start += span, span *= POINTERS_PER_BLOCK) {
+        long long lo = first > tree_start ? first - tree_start : 0;
+        long long hi = end - tree_start < span ? end - tree_start : span;
+        block_id_t root = *inode_tree_root(inode, depth);
+        if (lo >= hi) continue;
+        if (root == -1) break;
+        if (collect_tree_range(root, depth, lo, hi, map) != 0) goto fail;
+    }
+    return 0;
+
+fail:
+    free_block_map(map);
+    return -1;
+}
+
+void free_block_map(block_map_t* map) {
+    free(map->blocks);
+    memset(map, 0, sizeof(*map));
+}
+
+// Copy 'length' bytes starting 'skip' bytes into a data block straight from its
+// segment to out_fd. The bytes must lie inside one segment. Tries copy_file_range or sendfile first
+// and drops to a read/write loop (for good) when the kernel refuses.
+int send_blocks(block_id_t first_block, size_t skip, size_t length, int out_fd, int* method) {
+    int segment_number = first_block / blocks_per_segment;
+    int block_index = first_block % blocks_per_segment;
+    off_t offset = BLOCK_SIZE + (off_t)block_index * BLOCK_SIZE + skip;
+    if (block_cache_write_back(first_block, (skip + length + BLOCK_SIZE - 1) / BLOCK_SIZE) != 0) return -1;
+
+    segment_handle_t* handle = acquire_segment(segment_number, DATA_SEGMENT);
+    if (!handle) return -1;
+    int fd = handle->fd;
+
+    while (length > 0 && *method != SEND_BUFFERED) {
+        ssize_t sent;
+        if (*method == SEND_COPY_FILE_RANGE) {
+            sent = copy_file_range(fd, &offset, out_fd, NULL, length, 0);
+        } else {
+            sent = sendfile(out_fd, fd, &offset, length);
+        }
+
+        if (sent > 0) {
+            length -= sent;
+        } else if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && (errno == EINVAL || errno == ENOSYS || errno == EXDEV ||
+                                errno == EOPNOTSUPP || errno == EBADF)) {
+            // Not supported between these descriptors, retry without kernel copying
+            *method = (*method == SEND_COPY_FILE_RANGE) ? SEND_SENDFILE : SEND_BUFFERED;
+        } else {
+            release_segment(handle);
+            return -1;
+        }
+    }
+    release_segment(handle);
+
+    char buffer[16 * BLOCK_SIZE];
+    while (length > 0) {
+        size_t chunk = (length > sizeof(buffer)) ? sizeof(buffer) : length;
+        if (segment_read(segment_number, DATA_SEGMENT, buffer, chunk, offset) != 0) return -1;
+
+        for (size_t written = 0; written < chunk; ) {
+            ssize_t n = write(out_fd, buffer + written, chunk - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            written += n;
+        }
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+// Length of the run of physically adjacent blocks starting at map->blocks[i], capped at max_run
+static int block_run_length(block_map_t* map, int i, int max_run) {
+    block_id_t first = map->blocks[i];
+    int run = 1;
+    while (run < max_run && i + run < map->count && map->blocks[i + run] == first + run &&
+           (first % blocks_per_segment) + run < blocks_per_segment) {
+        run++;
+    }
+    return run;
+}
+
+// Shared state of a read-ahead extraction; slot (range index % window) holds one range
+typedef struct {
+    block_map_t* map;
+    int* range_start;           /* index into map->blocks of each range */
+    int* range_blocks;          /* blocks in each range */
+    int num_ranges;
+    int window;                 /* ranges that may be in flight ahead of the writer */
+    char* buffers;              /* window * READAHEAD_RUN_BLOCKS blocks */
+    int* ready;                 /* range index sitting in each slot, -1 if none */
+    int next_read;              /* next range a worker should pick up */
+    int next_write;             /* next range the writer will emit */
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} readahead_t;
+
+// Worker: claim the next range once its slot is free, read it, publish it
+static void* readahead_worker(void* arg) {
+    readahead_t* ra = arg;
+
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->failed && ra->next_read < ra->num_ranges) {
+        if (ra->next_read - ra->next_write >= ra->window) {
+            pthread_cond_wait(&ra->changed, &ra->lock);
+            continue;
+        }
+        int range = ra->next_read++;
+        pthread_mutex_unlock(&ra->lock);
+
+        int slot = range % ra->window;
+        char* buffer = ra->buffers + (size_t)slot * READAHEAD_RUN_BLOCKS * BLOCK_SIZE;
+        int result = read_blocks(ra->map->blocks[ra->range_start[range]],
+                                 ra->range_blocks[range], buffer);
+
+        pthread_mutex_lock(&ra->lock);
+        if (result != 0) ra->failed = 1;
+        ra->ready[slot] = range;
+        pthread_cond_broadcast(&ra->changed);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+// Write 'size' bytes of the mapped blocks, starting 'skip' bytes into the first,
+// to out_fd, reading ranges on worker threads up to a window ahead of the
+// (in-order) writer
+int extract_readahead(block_map_t* map, size_t skip, size_t size, int out_fd, int threads, int window) {
+    readahead_t ra;
+    memset(&ra, 0, sizeof(ra));
+    ra.map = map;
+    ra.window = window;
+    ra.range_start = malloc(map->count * sizeof(int));
+    ra.range_blocks = malloc(map->count * sizeof(int));
+    ra.buffers = malloc((size_t)window * READAHEAD_RUN_BLOCKS * BLOCK_SIZE);
+    ra.ready = malloc(window * sizeof(int));
+    pthread_t* workers = malloc(threads * sizeof(pthread_t));
+
+    int result = -1;
+    if (!ra.range_start || !ra.range_blocks || !ra.buffers || !ra.ready || !workers) goto out;
+
+    for (int i = 0; i < map->count; ) {
+        int run = block_run_length(map, i, READAHEAD_RUN_BLOCKS);
+        ra.range_start[ra.num_ranges] = i;
+        ra.range_blocks[ra.num_ranges++] = run;
+        i += run;
+    }
+    for (int i = 0; i < window; i++) ra.ready[i] = -1;
+    pthread_mutex_init(&ra.lock, NULL);
+    pthread_cond_init(&ra.changed, NULL);
+
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, readahead_worker, &ra) != 0) break;
+    }
+
+    result = (started > 0) ? 0 : -1;
+    size_t remaining = size;
+    for (int range = 0; started > 0 && range < ra.num_ranges && remaining > 0; range++) {
+        int slot = range % window;
+
+        pthread_mutex_lock(&ra.lock);
+        while (ra.ready[slot] != range && !ra.failed) {
+            pthread_cond_wait(&ra.changed, &ra.lock);
+        }
+        int failed = ra.failed;
+        pthread_mutex_unlock(&ra.lock);
+        if (failed) {
+            result = -1;
+            break;
+        }
+
+        size_t head = (range == 0) ? skip : 0;
+        size_t length = (size_t)ra.range_blocks[range] * BLOCK_SIZE - head;
+        if (length > remaining) length = remaining;
+        char* buffer = ra.buffers + (size_t)slot * READAHEAD_RUN_BLOCKS * BLOCK_SIZE + head;
+        for (size_t written = 0; written < length; ) {
+            ssize_t n = write(out_fd, buffer + written, length - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                result = -1;
+                break;
+            }
+            written += n;
+        }
+        remaining -= length;
+
+        pthread_mutex_lock(&ra.lock);
+        ra.ready[slot] = -1;
+        ra.next_write++;
+        if (result != 0) ra.failed = 1;
+        pthread_cond_broadcast(&ra.changed);
+        pthread_mutex_unlock(&ra.lock);
+        if (result != 0) break;
+    }
+
+    // Stop workers that are still waiting for a free slot
+    pthread_mutex_lock(&ra.lock);
+    ra.failed = 1;
+    pthread_cond_broadcast(&ra.changed);
+    pthread_mutex_unlock(&ra.lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&ra.lock);
+    pthread_cond_destroy(&ra.changed);
+
+out:
+    free(ra.range_start);
+    free(ra.range_blocks);
+    free(ra.buffers);
+    free(ra.ready);
+    free(workers);
+    return result;
+}
+
+// Read a directory block into an entries array
+int load_directory_entries(block_id_t block_id, dir_entry_t* entries) {
+    // Directory entries are stored in data blocks
+    char buffer[BLOCK_SIZE];
+    
+    if (read_block(block_id, buffer) != 0) {
+        return -1;
+    }
+    
+    // Copy from block buffer to entries (only copy the actual size of entries)
+    memcpy(entries, buffer, sizeof(dir_entry_t) * DIR_ENTRIES_PER_BLOCK);
     
-    // Update directory inode
-    dir_inode->direct_blocks[dir_inode->num_direct++] = new_block_id;
-    dir_inode->size += BLOCK_SIZE;
-    
-    // Save directory inode
-    write_inode(dir_inode_num, dir_inode);
+    return 0;
+}
+
+// Look for a name inside a linear (legacy) directory, returns the child's inode number 
+static int find_entry_in_linear_dir(inode_t* dir_inode, const char* name) {
+    // Search through all direct blocks of the directory
+    for (int i = 0; i < dir_inode->num_direct; i++) {
+        dir_entry_t entries[DIR_ENTRIES_PER_BLOCK];
+        
+        if (load_directory_entries(dir_inode->direct_blocks[i], entries) != 0) {
+            continue;
+        }
+        
+        // Search through directory entries in this block
+        for (unsigned int j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
+            if (entries[j].inode_num != -1 && strcmp(entries[j].name, name) == 0) {
+                return entries[j].inode_num;
+            }
+        }
+    }
     
+    return -1; // Entry not found
+}
+
+// Call visit() for every used entry of a linear directory
+static int iterate_linear_dir(inode_t* dir_inode, dir_visit_fn visit, void* ctx) {
+    for (int i = 0; i < dir_inode->num_direct; i++) {
+        dir_entry_t entries[DIR_ENTRIES_PER_BLOCK];
+        if (load_directory_entries(dir_inode->direct_blocks[i], entries) != 0) continue;
+
+        for (unsigned int j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
+            if (entries[j].inode_num != -1) {
+                int stop = visit(entries[j].name, entries[j].inode_num, INODE_FREE, ctx);
+                if (stop) return stop;
+            }
+        }
+    }
+    return 0;
+}
+
+// FNV-1a hash of an entry name, picks the bucket of a hashed directory
+uint32_t dir_name_hash(const char* name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)name; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Bucket of a hash under linear hashing: buckets below the split point have
+// already been split and use one more hash bit
+static int hashed_bucket_for(uint32_t hash, int num_buckets) {
+    uint32_t level = 1;
+    while (level * 2 <= (uint32_t)num_buckets) level *= 2;
+
+    uint32_t bucket = hash & (level - 1);
+    if (bucket < (uint32_t)num_buckets - level) {
+        bucket = hash & (2 * level - 1);
+    }
+    return bucket;
+}
+
+// Buckets of a hashed directory; overflow blocks are not part of its size
+static int hashed_bucket_count(inode_t* dir_inode) {
+    return (int)(dir_inode->size / BLOCK_SIZE);
+}
+
+// Reset a hashed directory block to an empty bucket: one free record covering it
+static void init_hashed_block(hashed_dir_block_t* block) {
+    memset(block, 0, sizeof(*block));
+    block->header.magic = DIR_BLOCK_MAGIC;
+    block->header.next_block = -1;
+
+    dir_record_t* record = (dir_record_t*)block->records;
+    record->inode_num = -1;
+    record->rec_len = BLOCK_SIZE - DIR_RECORDS_OFFSET;
+}
+
+// Record starting 'offset' bytes into the block, NULL if its header is damaged
+static dir_record_t* hashed_record(hashed_dir_block_t* block, int offset) {
+    if (offset + (int)sizeof(dir_record_t) > BLOCK_SIZE) return NULL;
+
+    dir_record_t* record = (dir_record_t*)((uint8_t*)block + offset);
+    if (record->rec_len < sizeof(dir_record_t) || record->rec_len % DIR_RECORD_ALIGN != 0 ||
+        offset + record->rec_len > BLOCK_SIZE ||
+        DIR_RECORD_LEN(record->name_len) > record->rec_len) {
+        return NULL;
+    }
+    return record;
+}
+
+// Bytes of a record in use; a free record can be reused entirely
+static int hashed_record_used(dir_record_t* record) {
+    return record->inode_num == -1 ? 0 : (int)DIR_RECORD_LEN(record->name_len);
+}
+
+// Offset of a record with room for a 'name_len' byte name, -1 if the block is full
+static int find_hashed_room(hashed_dir_block_t* block, size_t name_len) {
+    int needed = DIR_RECORD_LEN(name_len);
+    dir_record_t* record;
+
+    for (int offset = DIR_RECORDS_OFFSET; offset < BLOCK_SIZE; offset += record->rec_len) {
+        record = hashed_record(block, offset);
+        if (!record) return -1;
+        if (record->rec_len - hashed_record_used(record) >= needed) return offset;
+    }
+    return -1;
+}
+
+// Store an entry in the block, splitting the slack off a used record if needed.
+// Returns -1 when the block has no room left.
+static int put_hashed_entry(hashed_dir_block_t* block, const char* name, uint32_t hash,
+                            int inode_num, int file_type) {
+    size_t name_len = strlen(name);
+    int offset = find_hashed_room(block, name_len);
+    if (offset == -1) return -1;
+
+    dir_record_t* record = (dir_record_t*)((uint8_t*)block + offset);
+    int used = hashed_record_used(record);
+    if (used > 0) {
+        dir_record_t* slack = (dir_record_t*)((uint8_t*)record + used);
+        slack->rec_len = record->rec_len - used;
+        record->rec_len = used;
+        record = slack;
+    }
+
+    record->hash = hash;
+    record->inode_num = inode_num;
+    record->name_len = name_len;
+    record->file_type = file_type;
+    memcpy(record->name, name, name_len);
+    block->header.count++;
+    return 0;
+}
+
+// Does a live record hold exactly this name?
+static int hashed_record_matches(dir_record_t* record, const char* name, size_t name_len, uint32_t hash) {
+    return record->inode_num != -1 && record->hash == hash && record->name_len == name_len &&
+           memcmp(record->name, name, name_len) == 0;
+}
+
+// Locate 'name' in its bucket chain. On success returns the child's inode number,
+// fills *block (when non-NULL) with the block holding it and its id and record offset.
+static int find_hashed_entry(inode_t* dir_inode, const char* name, uint32_t hash,
+                             hashed_dir_block_t* block, block_id_t* block_id, int* offset) {
+    int num_buckets = hashed_bucket_count(dir_inode);
+    if (num_buckets == 0) return -1;
+
+    hashed_dir_block_t local;
+    if (!block) block = &local;
+    size_t name_len = strlen(name);
+
+    block_id_t current = inode_block_at(dir_inode, hashed_bucket_for(hash, num_buckets));
+    while (current != -1) {
+        if (read_block(current, block) != 0 || block->header.magic != DIR_BLOCK_MAGIC) return -1;
+
+        dir_record_t* record;
+        for (int at = DIR_RECORDS_OFFSET; at < BLOCK_SIZE; at += record->rec_len) {
+            record = hashed_record(block, at);
+            if (!record) break;
+            if (hashed_record_matches(record, name, name_len, hash)) {
+                if (block_id) *block_id = current;
+                if (offset) *offset = at;
+                return record->inode_num;
+            }
+        }
+        current = block->header.next_block;
+    }
+    return -1;
+}
+
+// Pack entries into the chain starting at 'primary'. Overflow blocks come from
+// the spare list first and are allocated only when it runs out.
+static int write_hashed_chain(block_id_t primary, hashed_entry_t* entries, int count,
+                              block_id_t* spares, int* num_spares) {
+    block_id_t current = primary;
+    int index = 0;
+
+    do {
+        hashed_dir_block_t block;
+        init_hashed_block(&block);
+        while (index < count &&
+               put_hashed_entry(&block, entries[index].name, entries[index].hash,
+                                entries[index].inode_num, entries[index].file_type) == 0) {
+            index++;
+        }
+
+        block_id_t next = -1;
+        if (index < count) {
+            if (*num_spares > 0) {
+                next = spares[--(*num_spares)];
+            } else {
+                next = allocate_block();
+                if (next == -1) return -1;
+            }
+        }
+        block.header.next_block = next;
+        if (write_block(current, &block) != 0) return -1;
+        current = next;
+    } while (current != -1);
+
+    return 0;
+}
+
+// Split the bucket at the linear-hashing split point into itself and a new bucket
+static int split_hashed_bucket(inode_t* dir_inode) {
+    int num_buckets = hashed_bucket_count(dir_inode);
+    stats_count(STAT_DIR_SPLITS, 1);
+
+    uint32_t level = 1;
+    while (level * 2 <= (uint32_t)num_buckets) level *= 2;
+    int split = num_buckets - level;
+
+    // Gather every entry and overflow block of the bucket being split
+    hashed_entry_t* entries = NULL;
+    block_id_t* chain = NULL;
+    int num_entries = 0;
+    int chain_length = 0;
+    int result = -1;
+
+    block_id_t current = inode_block_at(dir_inode, split);
+    while (current != -1) {
+        hashed_dir_block_t block;
+        if (read_block(current, &block) != 0 || block.header.magic != DIR_BLOCK_MAGIC) goto out;
+
+        block_id_t* grown_chain = realloc(chain, (chain_length + 1) * sizeof(block_id_t));
+        if (grown_chain) chain = grown_chain;
+        hashed_entry_t* grown = realloc(entries, (num_entries + DIR_MAX_RECORDS_PER_BLOCK) * sizeof(hashed_entry_t));
+        if (grown) entries = grown;
+        if (!grown_chain || !grown) goto out;
+        chain[chain_length++] = current;
+
+        dir_record_t* record;
+        for (int at = DIR_RECORDS_OFFSET; at < BLOCK_SIZE; at += record->rec_len) {
+            record = hashed_record(&block, at);
+            if (!record) break;
+            if (record->inode_num == -1) continue;
+
+            hashed_entry_t* entry = &entries[num_entries++];
+            entry->hash = record->hash;
+            entry->inode_num = record->inode_num;
+            entry->file_type = record->file_type;
+            memcpy(entry->name, record->name, record->name_len);
+            entry->name[record->name_len] = '\0';
+        }
+        current = block.header.next_block;
+    }
+
+    block_id_t new_primary = allocate_block();
+    if (new_primary == -1) goto out;
+    if (inode_set_block(dir_inode, num_buckets, new_primary) != 0) {
+        free_block(new_primary);
+        goto out;
+    }
+
+    // Entries whose next hash bit is set move to the new bucket
+    int staying = 0;
+    for (int i = 0; i < num_entries; i++) {
+        if ((entries[i].hash & (2 * level - 1)) == (uint32_t)split) {
+            hashed_entry_t tmp = entries[staying];
+            entries[staying++] = entries[i];
+            entries[i] = tmp;
+        }
+    }
+
+    block_id_t* spares = chain + 1;
+    int num_spares = chain_length - 1;
+    if (write_hashed_chain(chain[0], entries, staying, spares, &num_spares) != 0 ||
+        write_hashed_chain(new_primary, entries + staying, num_entries - staying,
+                           spares, &num_spares) != 0) {
+        goto out;
+    }
+    for (int i = 0; i < num_spares; i++) {
+        free_block(spares[i]);
+    }
+
+    dir_inode->size += BLOCK_SIZE;
+    result = 0;
+
+out:
+    free(entries);
+    free(chain);
+    return result;
+}
+
+// Add (name → child_inode_num) to a hashed directory; an insert that has to chain
+// an overflow block also splits the next bucket so chains stay short
+static int add_entry_to_hashed_dir(inode_t* dir_inode, int dir_inode_num, const char* name,
+                                   int child_inode_num, int child_type) {
+    uint32_t hash = dir_name_hash(name);
+    size_t name_len = strlen(name);
+    int num_buckets = hashed_bucket_count(dir_inode);
+
+    if (num_buckets == 0) {
+        block_id_t block_id = allocate_block();
+        if (block_id == -1) return -1;
+
+        hashed_dir_block_t block;
+        init_hashed_block(&block);
+        put_hashed_entry(&block, name, hash, child_inode_num, child_type);
+        if (write_block(block_id, &block) != 0 || inode_set_block(dir_inode, 0, block_id) != 0) {
+            free_block(block_id);
+            return -1;
+        }
+
+        dir_inode->size += BLOCK_SIZE;
+        return write_inode(dir_inode_num, dir_inode);
+    }
+
+    // Walk the bucket chain: reject duplicates and remember the first block with room
+    hashed_dir_block_t block;
+    hashed_dir_block_t room_block;
+    block_id_t room_block_id = -1;
+    block_id_t last_block_id = -1;
+
+    block_id_t current = inode_block_at(dir_inode, hashed_bucket_for(hash, num_buckets));
+    while (current != -1) {
+        if (read_block(current, &block) != 0 || block.header.magic != DIR_BLOCK_MAGIC) return -1;
+
+        dir_record_t* record;
+        for (int at = DIR_RECORDS_OFFSET; at < BLOCK_SIZE; at += record->rec_len) {
+            record = hashed_record(&block, at);
+            if (!record) break;
+            if (hashed_record_matches(record, name, name_len, hash)) {
+                return -1; // Entry with that name already exists
+            }
+        }
+        if (room_block_id == -1 && find_hashed_room(&block, name_len) != -1) {
+            room_block_id = current;
+            room_block = block;
+        }
+        last_block_id = current;
+        current = block.header.next_block;
+    }
+
+    if (room_block_id != -1) {
+        put_hashed_entry(&room_block, name, hash, child_inode_num, child_type);
+        return write_block(room_block_id, &room_block);
+    }
+
+    // Bucket is full: chain an overflow block behind the last one
+    block_id_t overflow = allocate_block();
+    if (overflow == -1) return -1;
+
+    hashed_dir_block_t new_block;
+    init_hashed_block(&new_block);
+    put_hashed_entry(&new_block, name, hash, child_inode_num, child_type);
+    if (write_block(overflow, &new_block) != 0) {
+        free_block(overflow);
+        return -1;
+    }
+
+    block.header.next_block = overflow;
+    if (write_block(last_block_id, &block) != 0) return -1;
+
+    if (split_hashed_bucket(dir_inode) != 0) return -1;
+    return write_inode(dir_inode_num, dir_inode);
+}
+
+// Drop the entry called 'name' from a hashed directory, merging its record
+// into the one before it
+static int remove_entry_from_hashed_dir(inode_t* dir_inode, const char* name) {
+    hashed_dir_block_t block;
+    block_id_t block_id;
+    int offset;
+    if (find_hashed_entry(dir_inode, name, dir_name_hash(name), &block, &block_id, &offset) == -1) {
+        return -1;
+    }
+
+    dir_record_t* record = (dir_record_t*)((uint8_t*)&block + offset);
+    dir_record_t* previous = NULL;
+    dir_record_t* walk;
+    for (int at = DIR_RECORDS_OFFSET; at < offset; at += walk->rec_len) {
+        walk = hashed_record(&block, at);
+        if (!walk) break;
+        if (at + walk->rec_len == offset) previous = walk;
+    }
+
+    if (previous) {
+        previous->rec_len += record->rec_len;
+    } else {
+        record->inode_num = -1;
+        record->name_len = 0;
+    }
+    block.header.count--;
+    return write_block(block_id, &block);
+}
+
+// Call visit() for every used entry of a hashed directory, bucket by bucket
+static int iterate_hashed_dir(inode_t* dir_inode, dir_visit_fn visit, void* ctx) {
+    block_map_t buckets;
+    if (build_block_map(dir_inode, &buckets) != 0) return -1;
+
+    int stop = 0;
+    for (int bucket = 0; bucket < buckets.count && !stop; bucket++) {
+        block_id_t current = buckets.blocks[bucket];
+        while (current != -1 && !stop) {
+            hashed_dir_block_t block;
+            if (read_block(current, &block) != 0 || block.header.magic != DIR_BLOCK_MAGIC) break;
+
+            dir_record_t* record;
+            for (int at = DIR_RECORDS_OFFSET; at < BLOCK_SIZE && !stop; at += record->rec_len) {
+                record = hashed_record(&block, at);
+                if (!record) break;
+                if (record->inode_num == -1) continue;
+
+                char name[MAX_FILENAME];
+                memcpy(name, record->name, record->name_len);
+                name[record->name_len] = '\0';
+                stop = visit(name, record->inode_num, record->file_type, ctx);
+            }
+            current = block.header.next_block;
+        }
+    }
+
+    free_block_map(&buckets);
+    return stop;
+}
+
+// Legacy linear directories are read-only; returns 1 if entries can change
+static int is_writable_dir(const inode_t* dir_inode) {
+    if (dir_inode->type != INODE_DIR) {
+        return 0; // Not a directory
+    }
+    if (!(dir_inode->flags & INODE_FLAG_HASHED_DIR)) {
+        fprintf(stderr, "Legacy linear directories are read-only\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Look for a name inside a directory inode, returns the child's inode number 
+int find_entry_in_dir(inode_t* dir_inode, const char* name) {
+    if (dir_inode->type != INODE_DIR) {
+        return -1; // Not a directory
+    }
+    if (dir_inode->flags & INODE_FLAG_HASHED_DIR) {
+        return find_hashed_entry(dir_inode, name, dir_name_hash(name), NULL, NULL, NULL);
+    }
+    return find_entry_in_linear_dir(dir_inode, name);
+}
+
+// Add (name → child_inode_num) into a directory, making a new block if needed.
+// The entry records child_type.
+int add_entry_to_dir(inode_t* dir_inode, int dir_inode_num, const char* name, int child_inode_num, int child_type) {
+    if (!is_writable_dir(dir_inode)) return -1;
+    uint64_t started = stats_clock();
+    int result = add_entry_to_hashed_dir(dir_inode, dir_inode_num, name, child_inode_num, child_type);
+    if (result == 0) {
+        dentry_cache_put(dir_inode_num, name, dir_name_hash(name), child_inode_num);
+        stats_count(STAT_DIR_ADDS, 1);
+    }
+    stats_time(STAT_TIME_DIR_ADD, started);
+    return result;
+}
+
+// Remove the entry called 'name' from a directory
+int remove_entry_from_dir(inode_t* dir_inode, int dir_inode_num, const char* name) {
+    if (!is_writable_dir(dir_inode)) return -1;
+    uint64_t started = stats_clock();
+    int result = remove_entry_from_hashed_dir(dir_inode, name);
+    if (result == 0) {
+        dentry_cache_put(dir_inode_num, name, dir_name_hash(name), -1);
+        stats_count(STAT_DIR_REMOVES, 1);
+    }
+    stats_time(STAT_TIME_DIR_REMOVE, started);
+    return result;
+}
+
+// Call visit(name, inode_num, ctx) for each entry; a nonzero return stops the walk
+// and is passed back to the caller
+int iterate_dir(inode_t* dir_inode, dir_visit_fn visit, void* ctx) {
+    if (dir_inode->type != INODE_DIR) {
+        return -1; // Not a directory
+    }
+    if (dir_inode->flags & INODE_FLAG_HASHED_DIR) {
+        return iterate_hashed_dir(dir_inode, visit, ctx);
+    }
+    return iterate_linear_dir(dir_inode, visit, ctx);
+}
+
+// Every block an inode owns: collect_inode_blocks() plus, for a hashed
+// directory, the overflow blocks chained off its buckets (appended to 'data').
+// Remove and the checker both walk inodes through it.
+int collect_owned_blocks(inode_t* inode, block_map_t* data, block_map_t* nodes) {
+    if (collect_inode_blocks(inode, data, nodes) != 0) return -1;
+
+    if (inode->type == INODE_DIR && (inode->flags & INODE_FLAG_HASHED_DIR)) {
+        int num_buckets = data->count;
+        for (int i = 0; i < num_buckets; i++) {
+            block_id_t current = data->blocks[i];
+            hashed_dir_block_t block;
+            while (read_block(current, &block) == 0 && block.header.magic == DIR_BLOCK_MAGIC &&
+                   (current = block.header.next_block) != -1) {
+                if (block_map_push(data, current) != 0) {
+                    free_block_map(data);
+                    free_block_map(nodes);
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Free every block a directory uses for its entries (overflow chains and
+// pointer blocks included), a segment at a time; returns 0 if all were freed
+int free_dir_blocks(inode_t* dir_inode) {
+    block_map_t blocks, nodes;
+    if (collect_owned_blocks(dir_inode, &blocks, &nodes) != 0) return -1;
+
+    int result = 0;
+    if (free_blocks(blocks.blocks, blocks.count) != 0) result = -1;
+    if (free_blocks(nodes.blocks, nodes.count) != 0) result = -1;
+    free_block_map(&blocks);
+    free_block_map(&nodes);
+    return result;
+}
+
+// A directory waiting to be visited by a tree walk
+typedef struct {
+    int inode_num;
+    void* item;
+} walk_task_t;
+
+// Tasks of one worker: the owner pushes and pops at the bottom, thieves take from the top
+typedef struct {
+    walk_task_t* tasks;
+    int top;
+    int bottom;
+    int capacity;
+    pthread_mutex_t lock;
+} walk_deque_t;
+
+typedef struct {
+    tree_walk_t* walk;
+    int worker;
+    pthread_t thread;
+} walk_worker_t;
+
+struct tree_walk {
+    walk_dir_fn visit;
+    void* ctx;
+    int num_workers;            /* deques; one per worker thread */
+    walk_deque_t* deques;
+    walk_worker_t* workers;
+    int started;                /* threads running, 0 if the walk ran on the caller */
+    int queued;                 /* tasks sitting in some deque */
+    int active;                 /* tasks queued or being visited */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     /* a task was queued, or none are left */
+};
+
+static int walk_deque_push(walk_deque_t* deque, int inode_num, void* item) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->capacity && deque->top > 0) {
+        memmove(deque->tasks, deque->tasks + deque->top,
+                (deque->bottom - deque->top) * sizeof(walk_task_t));
+        deque->bottom -= deque->top;
+        deque->top = 0;
+    }
+    if (deque->bottom == deque->capacity) {
+        int new_capacity = deque->capacity ? deque->capacity * 2 : 64;
+        walk_task_t* grown = realloc(deque->tasks, new_capacity * sizeof(walk_task_t));
+        if (!grown) {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+        deque->tasks = grown;
+        deque->capacity = new_capacity;
+    }
+    deque->tasks[deque->bottom].inode_num = inode_num;
+    deque->tasks[deque->bottom++].item = item;
+    pthread_mutex_unlock(&deque->lock);
     return 0;
 }
 
+// Take the newest task of a deque, or the oldest when stealing; returns 1 if one was taken
+static int walk_deque_take(walk_deque_t* deque, int steal, walk_task_t* task) {
+    pthread_mutex_lock(&deque->lock);
+    int taken = deque->bottom > deque->top;
+    if (taken) {
+        *task = steal ? deque->tasks[deque->top++] : deque->tasks[--deque->bottom];
+    }
+    if (deque->top == deque->bottom) deque->top = deque->bottom = 0;
+    pthread_mutex_unlock(&deque->lock);
+    return taken;
+}
+
+// Queue a directory for any worker. Called from a visit; a task that cannot be
+// queued is visited right away instead.
+void tree_walk_spawn(tree_walk_t* walk, int worker, int inode_num, void* item) {
+    // Counted first, so no worker can see the walk run dry while it is pushed
+    pthread_mutex_lock(&walk->lock);
+    walk->queued++;
+    walk->active++;
+    pthread_mutex_unlock(&walk->lock);
+
+    if (walk_deque_push(&walk->deques[worker], inode_num, item) == 0) {
+        pthread_cond_signal(&walk->changed);
+        return;
+    }
+
+    pthread_mutex_lock(&walk->lock);
+    walk->queued--;
+    walk->active--;
+    pthread_mutex_unlock(&walk->lock);
+    walk->visit(walk, worker, inode_num, item);
+}
+
+void* tree_walk_context(tree_walk_t* walk) {
+    return walk->ctx;
+}
+
+// Visit tasks, own deque first and then stolen ones, until none are queued or running
+static void walk_run_worker(tree_walk_t* walk, int worker) {
+    for (;;) {
+        walk_task_t task;
+        int taken = walk_deque_take(&walk->deques[worker], 0, &task);
+        for (int i = 1; !taken && i < walk->num_workers; i++) {
+            taken = walk_deque_take(&walk->deques[(worker + i) % walk->num_workers], 1, &task);
+        }
+
+        pthread_mutex_lock(&walk->lock);
+        if (taken) {
+            walk->queued--;
+            pthread_mutex_unlock(&walk->lock);
+            walk->visit(walk, worker, task.inode_num, task.item);
+            pthread_mutex_lock(&walk->lock);
+            if (--walk->active == 0) pthread_cond_broadcast(&walk->changed);
+        } else {
+            while (walk->queued == 0 && walk->active > 0) {
+                pthread_cond_wait(&walk->changed, &walk->lock);
+            }
+        }
+        int finished = (walk->active == 0);
+        pthread_mutex_unlock(&walk->lock);
+        if (finished) return;
+    }
+}
+
+static void* walk_worker_main(void* arg) {
+    walk_worker_t* worker = arg;
+    walk_run_worker(worker->walk, worker->worker);
+    return NULL;
+}
+
+static void tree_walk_free(tree_walk_t* walk) {
+    for (int i = 0; i < walk->num_workers; i++) {
+        pthread_mutex_destroy(&walk->deques[i].lock);
+        free(walk->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&walk->lock);
+    pthread_cond_destroy(&walk->changed);
+    free(walk->deques);
+    free(walk->workers);
+    free(walk);
+}
+
+// Visit the directory root_inode and every directory visit() spawns below it
+// on 'threads' workers. Returns once they run; with threads <= 0 (or when no
+// thread starts) the whole walk runs on the calling thread before returning.
+// NULL if the walk could not be set up.
+tree_walk_t* tree_walk_start(int root_inode, void* root_item, walk_dir_fn visit, void* ctx, int threads) {
+    tree_walk_t* walk = calloc(1, sizeof(tree_walk_t));
+    if (!walk) return NULL;
+    walk->num_workers = threads > 0 ? threads : 1;
+    walk->deques = calloc(walk->num_workers, sizeof(walk_deque_t));
+    walk->workers = calloc(walk->num_workers, sizeof(walk_worker_t));
+    if (!walk->deques || !walk->workers) {
+        free(walk->deques);
+        free(walk->workers);
+        free(walk);
+        return NULL;
+    }
+
+    walk->visit = visit;
+    walk->ctx = ctx;
+    pthread_mutex_init(&walk->lock, NULL);
+    pthread_cond_init(&walk->changed, NULL);
+    for (int i = 0; i < walk->num_workers; i++) {
+        pthread_mutex_init(&walk->deques[i].lock, NULL);
+    }
+
+    if (walk_deque_push(&walk->deques[0], root_inode, root_item) != 0) {
+        tree_walk_free(walk);
+        return NULL;
+    }
+    walk->queued = 1;
+    walk->active = 1;
+
+    for (; threads > 0 && walk->started < walk->num_workers; walk->started++) {
+        walk_worker_t* worker = &walk->workers[walk->started];
+        worker->walk = walk;
+        worker->worker = walk->started;
+        if (pthread_create(&worker->thread, NULL, walk_worker_main, worker) != 0) break;
+    }
+    if (walk->started == 0) walk_run_worker(walk, 0);
+    return walk;
+}
+
+// Wait until every directory of the walk has been visited, then free it
+void tree_walk_finish(tree_walk_t* walk) {
+    for (int i = 0; i < walk->started; i++) {
+        pthread_join(walk->workers[i].thread, NULL);
+    }
+    tree_walk_free(walk);
+}
+
+// Inode number of 'name' inside directory dir_inode_num, -1 if it is absent or
+// dir_inode_num is not a directory. Answers, misses included, go to the dentry cache.
+int lookup_entry(int dir_inode_num, const char* name) {
+    uint32_t hash = dir_name_hash(name);
+    int child;
+    stats_count(STAT_DIR_LOOKUPS, 1);
+    if (dentry_cache_get(dir_inode_num, name, hash, &child)) {
+        stats_count(STAT_DENTRY_CACHE_HITS, 1);
+        return child;
+    }
+
+    uint64_t started = stats_clock();
+    inode_t dir_inode;
+    if (read_inode(dir_inode_num, &dir_inode) != 0 || dir_inode.type != INODE_DIR) {
+        return -1;
+    }
+    child = find_entry_in_dir(&dir_inode, name);
+    dentry_cache_put(dir_inode_num, name, hash, child);
+    stats_time(STAT_TIME_DIR_LOOKUP, started);
+    return child;
+}
+
+// Resolve parts[0..count-1] from the root directory. Returns the inode number,
+// or -1 with *failed_at set to the first component that could not be found.
+int resolve_path(char parts[][MAX_FILENAME], int count, int* failed_at) {
+    int inode_num = ROOT_DIR_INODE;
+    for (int i = 0; i < count; i++) {
+        inode_num = lookup_entry(inode_num, parts[i]);
+        if (inode_num == -1) {
+            if (failed_at) *failed_at = i;
+            return -1;
+        }
+    }
+    return inode_num;
+}
+
 // split the directory path
 int split_path(const char* path, char parts[][MAX_FILENAME], int* count) {
     *count = 0;
@@ -443,283 +3299,1050 @@ int split_path(const char* path, char parts[][MAX_FILENAME], int* count) {
         (*count)++;
         token = strtok(NULL, "/");
     }
-    
-    return 0;
+    
+    return 0;
+}
+
+// Where add_file() takes the new file's contents from
+typedef struct {
+    FILE* fp;                   /* stream to copy, or NULL when data is set */
+    char* data;                 /* whole file in memory, zero padded to a block multiple */
+    off_t size;                 /* bytes in data, or expected stream size (-1 if unknown) */
+} add_source_t;
+
+// Blocks an add has queued for writing but not written yet, with their
+// fingerprints. They are matched in memory and join the index once written.
+typedef struct {
+    uint64_t fingerprint;
+    block_id_t block_id;        /* -1 until the block is allocated */
+    const char* data;
+} queued_block_t;
+
+typedef struct {
+    queued_block_t* blocks;
+    int count;
+    int capacity;
+    char scratch[BLOCK_SIZE];   /* stored copy being compared */
+} dedup_queue_t;
+
+// Latest queued block with the contents of 'data', or -1
+static int find_queued_block(dedup_queue_t* queue, const char* data, uint64_t fingerprint) {
+    for (int i = queue->count - 1; i >= 0; i--) {
+        if (queue->blocks[i].fingerprint == fingerprint && memcmp(queue->blocks[i].data, data, BLOCK_SIZE) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// A stored block with the contents of 'data' that took another reference, or -1
+static block_id_t share_stored_block(dedup_queue_t* queue, const char* data, uint64_t fingerprint) {
+    block_id_t candidate = dedup_index_find(fingerprint);
+    if (candidate == -1 || read_blocks(candidate, 1, queue->scratch) != 0 ||
+        memcmp(queue->scratch, data, BLOCK_SIZE) != 0 || share_block(candidate) != 0) {
+        return -1;
+    }
+    return candidate;
+}
+
+// Add the blocks the last batch wrote to the fingerprint index
+static void publish_queued_blocks(dedup_queue_t* queue) {
+    for (int i = 0; i < queue->count; i++) {
+        if (queue->blocks[i].block_id != -1) dedup_index_add(queue->blocks[i].fingerprint, queue->blocks[i].block_id);
+    }
+    queue->count = 0;
+}
+
+// Allocate 'count' blocks for data, queue their writes on the batch and map
+// them as the file's next blocks; their ids are noted in 'queued' if given.
+// On failure the blocks of the extent that were not handed to the builder are freed.
+static int write_new_blocks(io_batch_t* batch, pointer_builder_t* builder, char* data, int count,
+                            queued_block_t* queued) {
+    for (int done = 0; done < count; ) {
+        int extent_length = 0;
+        block_id_t first_block = allocate_extent(count - done, &extent_length);
+        if (first_block == -1) {
+            fprintf(stderr, "Failed to allocate data block\n");
+            return -1;
+        }
+
+        io_batch_write_blocks(batch, first_block, extent_length, data + (size_t)done * BLOCK_SIZE);
+
+        for (int e = 0; e < extent_length; e++) {
+            if (queued) queued[done + e].block_id = first_block + e;
+            if (pointer_builder_add(builder, first_block + e) != 0) {
+                fprintf(stderr, "Failed to map data block\n");
+                while (++e < extent_length) free_block(first_block + e);
+                return -1;
+            }
+        }
+        done += extent_length;
+    }
+    return 0;
+}
+
+// Write the queued blocks [*run_start, end) of data, the last ones in the queue
+static int write_queued_run(io_batch_t* batch, pointer_builder_t* builder, char* data, int* run_start, int end,
+                            dedup_queue_t* queue) {
+    int length = end - *run_start;
+    int result = 0;
+    if (length > 0) {
+        result = write_new_blocks(batch, builder, data + (size_t)*run_start * BLOCK_SIZE, length,
+                                  queue->blocks + queue->count - length);
+    }
+    *run_start = end;
+    return result;
+}
+
+// Store 'count' blocks of data as the file's next blocks. With a dedup queue,
+// a block equal to one already stored or queued shares it, and the others are
+// written in runs.
+static int store_file_blocks(io_batch_t* batch, pointer_builder_t* builder, char* data, int count,
+                             dedup_queue_t* queue) {
+    if (!queue) return write_new_blocks(batch, builder, data, count, NULL);
+
+    int run_start = 0;          /* first block of the run not written yet */
+    for (int i = 0; i < count; i++) {
+        char* block = data + (size_t)i * BLOCK_SIZE;
+        uint64_t fingerprint = dedup_fingerprint(block);
+        int match = find_queued_block(queue, block, fingerprint);
+
+        // A block of the run itself has no id to share until the run is written
+        if (match >= queue->count - (i - run_start) &&
+            write_queued_run(batch, builder, data, &run_start, i, queue) != 0) {
+            return -1;
+        }
+
+        block_id_t shared = -1;
+        if (match >= 0) {
+            if (share_block(queue->blocks[match].block_id) == 0) shared = queue->blocks[match].block_id;
+        } else {
+            shared = share_stored_block(queue, block, fingerprint);
+        }
+
+        if (shared == -1) {
+            if (queue->count == queue->capacity) {
+                int new_capacity = queue->capacity ? queue->capacity * 2 : 256;
+                queued_block_t* grown = realloc(queue->blocks, new_capacity * sizeof(queued_block_t));
+                if (!grown) return -1;
+                queue->blocks = grown;
+                queue->capacity = new_capacity;
+            }
+            queue->blocks[queue->count++] = (queued_block_t){ fingerprint, -1, block };
+            continue;
+        }
+
+        // The run before it is mapped first, keeping the file's blocks in order
+        if (write_queued_run(batch, builder, data, &run_start, i, queue) != 0) {
+            free_block(shared);     // Drop the reference just taken
+            return -1;
+        }
+        if (pointer_builder_add(builder, shared) != 0) {
+            fprintf(stderr, "Failed to map data block\n");
+            return -1;
+        }
+        run_start = i + 1;
+    }
+    return write_queued_run(batch, builder, data, &run_start, count, queue);
+}
+
+// Store 'count' blocks of data as compressed clusters, packing them into
+// 'packed' (as large as data), which must stay valid until the batch is submitted
+static int store_compressed_blocks(io_batch_t* batch, pointer_builder_t* builder, char* data, int count,
+                                   char* packed, dedup_queue_t* queue) {
+    for (int first = 0; first < count; first += COMPRESS_CLUSTER_BLOCKS) {
+        int blocks = count - first < COMPRESS_CLUSTER_BLOCKS ? count - first : COMPRESS_CLUSTER_BLOCKS;
+        char* raw = data + (size_t)first * BLOCK_SIZE;
+        size_t raw_length = (size_t)blocks * BLOCK_SIZE;
+
+        // Packing has to save at least one block
+        cluster_header_t* header = (cluster_header_t*)packed;
+        size_t limit = (size_t)(blocks - 1) * BLOCK_SIZE;
+        size_t length = 0;
+        if (limit > sizeof(*header)) {
+            length = lz_compress(raw, raw_length, packed + sizeof(*header), limit - sizeof(*header));
+        }
+        if (length == 0) {
+            if (store_file_blocks(batch, builder, raw, blocks, queue) != 0) return -1;
+            continue;
+        }
+
+        header->length = length;
+        header->raw_length = raw_length;
+        int used = (sizeof(*header) + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        memset(packed + sizeof(*header) + length, 0, (size_t)used * BLOCK_SIZE - sizeof(*header) - length);
+
+        if (store_file_blocks(batch, builder, packed, used, queue) != 0) return -1;
+        for (int slot = used; slot < blocks; slot++) {
+            if (pointer_builder_add(builder, COMPRESSED_SLOT) != 0) {
+                fprintf(stderr, "Failed to map data block\n");
+                return -1;
+            }
+        }
+        packed += (size_t)used * BLOCK_SIZE;
+    }
+    return 0;
+}
+
+// Take back the topmost directory a failed add created (-1: none) and
+// everything below it, then its entry in the parent
+static void remove_created_dir(int parent_inode_num, const char* name, int dir_inode_num) {
+    if (dir_inode_num == -1) return;
+    exfs2_remove_recursive(dir_inode_num);
+
+    inode_t parent;
+    if (read_inode(parent_inode_num, &parent) == 0) remove_entry_from_dir(&parent, parent_inode_num, name);
+}
+
+// Store a new file at exfs2_path, creating any missing folders; returns 0 on success
+static int add_file(const char* exfs2_path, add_source_t* source) {
+    char parts[32][MAX_FILENAME];
+    int num_parts = 0;
+    split_path(exfs2_path, parts, &num_parts);
+
+    if (num_parts == 0) {
+        fprintf(stderr, "Invalid path\n");
+        return -1;
+    }
+
+    int current_inode_num = ROOT_DIR_INODE;
+    inode_t current_inode;
+
+    if (read_inode(current_inode_num, &current_inode) != 0) {
+        fprintf(stderr, "Failed to read root inode\n");
+        return -1;
+    }
+
+    // Walk and create intermediate directories. A failed add takes back the
+    // topmost one it created, along with everything below it.
+    int created_dir = -1, created_parent = -1;
+    const char* created_name = NULL;
+    for (int i = 0; i < num_parts - 1; i++) {
+        int next_inode_num = lookup_entry(current_inode_num, parts[i]);
+        if (next_inode_num == -1) {
+            printf("Creating directory: %s\n", parts[i]);
+
+            int new_dir_inode_num = allocate_inode();
+            if (new_dir_inode_num == -1) {
+                fprintf(stderr, "Failed to allocate inode for directory\n");
+                remove_created_dir(created_parent, created_name, created_dir);
+                return -1;
+            }
+
+            inode_t new_dir_inode;
+            memset(&new_dir_inode, 0, sizeof(new_dir_inode));
+            new_dir_inode.type = INODE_DIR;
+            new_dir_inode.flags = INODE_FLAG_HASHED_DIR;
+            new_dir_inode.size = 0;
+            new_dir_inode.num_direct = 0;
+            new_dir_inode.indirect_block = -1;
+            new_dir_inode.double_indirect_block = -1;
+            new_dir_inode.triple_indirect_block = -1;
+
+            if (write_inode(new_dir_inode_num, &new_dir_inode) != 0 ||
+                add_entry_to_dir(&current_inode, current_inode_num, parts[i], new_dir_inode_num, INODE_DIR) != 0) {
+                fprintf(stderr, "Failed to add new directory entry\n");
+                free_inode(new_dir_inode_num);
+                remove_created_dir(created_parent, created_name, created_dir);
+                return -1;
+            }
+            if (created_dir == -1) {
+                created_dir = new_dir_inode_num;
+                created_parent = current_inode_num;
+                created_name = parts[i];
+            }
+
+            current_inode_num = new_dir_inode_num;
+            memcpy(&current_inode, &new_dir_inode, sizeof(inode_t));
+        } else {
+            current_inode_num = next_inode_num;
+            if (read_inode(current_inode_num, &current_inode) != 0) {
+                fprintf(stderr, "Failed to read existing directory inode\n");
+                return -1;
+            }
+
+            if (current_inode.type != INODE_DIR) {
+                fprintf(stderr, "%s is not a directory\n", parts[i]);
+                return -1;
+            }
+        }
+    }
+
+    const char* filename = parts[num_parts - 1];
+
+    if (lookup_entry(current_inode_num, filename) != -1) {
+        fprintf(stderr, "File already exists: %s\n", filename);
+        return -1;
+    }
+
+    int file_inode_num = allocate_inode();
+    if (file_inode_num == -1) {
+        fprintf(stderr, "Failed to allocate file inode\n");
+        remove_created_dir(created_parent, created_name, created_dir);
+        return -1;
+    }
+
+    inode_t file_inode;
+    memset(&file_inode, 0, sizeof(file_inode));
+    file_inode.type = INODE_FILE;
+    file_inode.size = 0;
+    file_inode.num_direct = 0;
+    file_inode.indirect_block = -1;
+    file_inode.double_indirect_block = -1;
+    file_inode.triple_indirect_block = -1;
+
+    // Extents are sized from the expected file size so its blocks land contiguously
+    off_t expected_size = source->size;
+    char* buffer = NULL;
+    char* packed = NULL;
+    size_t bytes_read;
+    int max_chunk_blocks = blocks_per_segment;
+
+    // Pointer blocks are built in memory and written once each; a chunk's data
+    // and the pointer blocks it completes go to disk as one I/O batch. Every
+    // block the builder takes is noted, to be given back if the add fails.
+    io_batch_t batch = {0};
+    block_map_t taken = {0};
+    pointer_builder_t* builder = malloc(sizeof(pointer_builder_t));
+    dedup_queue_t* queue = dedup_files ? calloc(1, sizeof(dedup_queue_t)) : NULL;
+    int failed = 0;
+    if (!builder || (dedup_files && !queue)) {
+        fprintf(stderr, "Failed to allocate pointer builder\n");
+        failed = 1;
+    } else {
+        pointer_builder_init(builder, &file_inode, &batch);
+        builder->taken = &taken;
+    }
+
+    if (!failed && source->fp && !(buffer = malloc((size_t)blocks_per_segment * BLOCK_SIZE))) {
+        fprintf(stderr, "Failed to allocate read buffer\n");
+        failed = 1;
+    }
+
+    // Compressed files are read in whole clusters, up to a segment's worth
+    if (compress_files) {
+        max_chunk_blocks -= blocks_per_segment % COMPRESS_CLUSTER_BLOCKS;
+        if (!failed && !(packed = malloc((size_t)max_chunk_blocks * BLOCK_SIZE))) {
+            fprintf(stderr, "Failed to allocate compression buffer\n");
+            failed = 1;
+        }
+    }
+
+    while (!failed) {
+        int chunk_blocks = max_chunk_blocks;
+        if (expected_size >= 0) {
+            off_t left = expected_size - (off_t)file_inode.size;
+            off_t left_blocks = (left + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if (left_blocks < chunk_blocks) chunk_blocks = (left_blocks > 0) ? left_blocks : 1;
+        }
+
+        char* chunk;
+        if (source->fp) {
+            bytes_read = fread(buffer, 1, (size_t)chunk_blocks * BLOCK_SIZE, source->fp);
+            chunk = buffer;
+        } else {
+            bytes_read = expected_size - (off_t)file_inode.size;
+            if (bytes_read > (size_t)chunk_blocks * BLOCK_SIZE) bytes_read = (size_t)chunk_blocks * BLOCK_SIZE;
+            chunk = source->data + file_inode.size;
+        }
+        if (bytes_read == 0) break;
+
+        // A whole file that fits in the inode needs no data blocks. The first
+        // chunk is at least a block, so a shorter one is the entire file.
+        if (file_inode.size == 0 && bytes_read <= (size_t)INODE_INLINE_MAX) {
+            memcpy(file_inode.inline_data, chunk, bytes_read);
+            file_inode.flags |= INODE_FLAG_INLINE;
+            file_inode.size = bytes_read;
+            break;
+        }
+
+        chunk_blocks = (bytes_read + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (source->fp && bytes_read % BLOCK_SIZE) {
+            memset(buffer + bytes_read, 0, BLOCK_SIZE - bytes_read % BLOCK_SIZE);
+        }
+
+        // Clusters start at multiples of COMPRESS_CLUSTER_SIZE in the file, which
+        // only a stream that grew while it was read can break
+        if (packed && file_inode.size % COMPRESS_CLUSTER_SIZE == 0) {
+            file_inode.flags |= INODE_FLAG_COMPRESSED;
+            if (store_compressed_blocks(&batch, builder, chunk, chunk_blocks, packed, queue) != 0) failed = 1;
+        } else if (store_file_blocks(&batch, builder, chunk, chunk_blocks, queue) != 0) {
+            failed = 1;
+        }
+
+        if (io_batch_submit(&batch) != 0) {
+            fprintf(stderr, "Failed to write data block\n");
+            failed = 1;
+        } else if (queue && !failed) {
+            publish_queued_blocks(queue);
+        }
+
+        file_inode.size += bytes_read;
+    }
+
+    if (!failed && pointer_builder_finish(builder) != 0) {
+        fprintf(stderr, "Failed to write pointer blocks\n");
+        failed = 1;
+    }
+    if (!failed && io_batch_submit(&batch) != 0) {
+        fprintf(stderr, "Failed to write pointer blocks\n");
+        failed = 1;
+    }
+    io_batch_free(&batch);
+    free(builder);
+    if (queue) free(queue->blocks);
+    free(queue);
+    free(buffer);
+    free(packed);
+
+    if (!failed && write_inode(file_inode_num, &file_inode) != 0) {
+        fprintf(stderr, "Failed to write file inode\n");
+        failed = 1;
+    }
+    if (!failed && add_entry_to_dir(&current_inode, current_inode_num, filename, file_inode_num, INODE_FILE) != 0) {
+        fprintf(stderr, "Failed to add file entry\n");
+        failed = 1;
+    }
+
+    // Nothing names the file yet, so its blocks and inode can simply go back
+    if (failed) {
+        release_file_blocks(&taken);
+        free_inode(file_inode_num);
+        remove_created_dir(created_parent, created_name, created_dir);
+    }
+    free_block_map(&taken);
+    return failed ? -1 : 0;
+}
+
+// Copy a local file into the File system at directory path by creating any missing folders
+void exfs2_add(const char* exfs2_path, const char* local_file) {
+    printf("Adding file '%s' from local path '%s'...\n", exfs2_path, local_file);
+
+    FILE* local_fp = fopen(local_file, "rb");
+    if (!local_fp) {
+        perror("Failed to open local file");
+        return;
+    }
+
+    add_source_t source = { local_fp, NULL, -1 };
+    struct stat local_stat;
+    if (fstat(fileno(local_fp), &local_stat) == 0 && S_ISREG(local_stat.st_mode)) {
+        source.size = local_stat.st_size;
+    }
+
+    int result = add_file(exfs2_path, &source);
+    fclose(local_fp);
+    if (result == 0) {
+        const char* filename = strrchr(exfs2_path, '/');
+        printf("File '%s' added successfully.\n", filename ? filename + 1 : exfs2_path);
+    }
+}
+
+// One file of a batch ingest
+typedef struct {
+    char* exfs2_path;
+    char* local_path;
+} ingest_job_t;
+
+typedef struct {
+    ingest_job_t* jobs;
+    int count;
+    int capacity;
+} ingest_list_t;
+
+static int ingest_list_push(ingest_list_t* list, const char* exfs2_path, const char* local_path) {
+    if (list->count == list->capacity) {
+        int new_capacity = list->capacity ? list->capacity * 2 : 256;
+        ingest_job_t* grown = realloc(list->jobs, new_capacity * sizeof(ingest_job_t));
+        if (!grown) return -1;
+        list->jobs = grown;
+        list->capacity = new_capacity;
+    }
+
+    ingest_job_t* job = &list->jobs[list->count];
+    job->exfs2_path = strdup(exfs2_path);
+    job->local_path = strdup(local_path);
+    if (!job->exfs2_path || !job->local_path) {
+        free(job->exfs2_path);
+        free(job->local_path);
+        return -1;
+    }
+    list->count++;
+    return 0;
+}
+
+static void ingest_list_free(ingest_list_t* list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->jobs[i].exfs2_path);
+        free(list->jobs[i].local_path);
+    }
+    free(list->jobs);
+    memset(list, 0, sizeof(*list));
+}
+
+// Read "<exfs2_path><TAB><local_file>" lines ("-" is stdin). Lines without a tab
+// split at the first space; blank lines and '#' comments are skipped.
+static int read_manifest(const char* manifest, ingest_list_t* list) {
+    FILE* fp = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (!fp) {
+        perror("Failed to open manifest");
+        return -1;
+    }
+
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    int line_number = 0;
+    int result = 0;
+    while ((length = getline(&line, &line_size, fp)) != -1) {
+        line_number++;
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if (length == 0 || line[0] == '#') continue;
+
+        char* separator = strchr(line, '\t');
+        if (!separator) separator = strchr(line, ' ');
+        if (!separator) {
+            fprintf(stderr, "Manifest line %d has no local file\n", line_number);
+            result = -1;
+            continue;
+        }
+        *separator = '\0';
+        if (ingest_list_push(list, line, separator + 1) != 0) {
+            result = -1;
+            break;
+        }
+    }
+
+    free(line);
+    if (fp != stdin) fclose(fp);
+    return result;
+}
+
+// Queue every regular file below local_dir, mirrored under exfs2_dir
+static int collect_local_tree(const char* local_dir, const char* exfs2_dir, ingest_list_t* list) {
+    DIR* dir = opendir(local_dir);
+    if (!dir) {
+        fprintf(stderr, "Failed to open directory %s: %s\n", local_dir, strerror(errno));
+        return -1;
+    }
+
+    int result = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        char local_path[MAX_PATH];
+        char exfs2_path[MAX_PATH];
+        if (snprintf(local_path, sizeof(local_path), "%s/%s", local_dir, entry->d_name) >= (int)sizeof(local_path) ||
+            snprintf(exfs2_path, sizeof(exfs2_path), "%s/%s", exfs2_dir, entry->d_name) >= (int)sizeof(exfs2_path)) {
+            fprintf(stderr, "Path too long: %s/%s\n", local_dir, entry->d_name);
+            result = -1;
+            continue;
+        }
+
+        struct stat st;
+        if (lstat(local_path, &st) != 0) {
+            fprintf(stderr, "Failed to stat %s: %s\n", local_path, strerror(errno));
+            result = -1;
+        } else if (S_ISDIR(st.st_mode)) {
+            if (collect_local_tree(local_path, exfs2_path, list) != 0) result = -1;
+        } else if (S_ISREG(st.st_mode)) {
+            if (ingest_list_push(list, exfs2_path, local_path) != 0) {
+                result = -1;
+                break;
+            }
+        }
+    }
+
+    closedir(dir);
+    return result;
 }
 
-// Copy a local file into the File system at directory path by creating any missing folders
-void exfs2_add(const char* exfs2_path, const char* local_file) {
-    printf("Adding file '%s' from local path '%s'...\n", exfs2_path, local_file);
+// Shared state of a batch ingest; slot (job index % window) holds one preloaded file
+typedef struct {
+    ingest_list_t* list;
+    int window;                 /* files that may be loaded ahead of the writer */
+    char** data;                /* per slot: contents padded to blocks, NULL to stream it */
+    off_t* size;                /* per slot: bytes in data */
+    int* ready;                 /* job index sitting in each slot, -1 if none */
+    int next_read;              /* next job a worker should pick up */
+    int next_write;             /* next job the writer will store */
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ingest_t;
 
-    char parts[32][MAX_FILENAME];
-    int num_parts = 0;
-    split_path(exfs2_path, parts, &num_parts);
+// Load a small regular file whole; leaves *data NULL when it should be streamed instead
+static void preload_local_file(const char* local_path, char** data, off_t* size) {
+    *data = NULL;
+    int fd = open(local_path, O_RDONLY);
+    if (fd < 0) return;
 
-    if (num_parts == 0) {
-        fprintf(stderr, "Invalid path\n");
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > INGEST_PRELOAD_MAX) {
+        close(fd);
         return;
     }
 
-    int current_inode_num = ROOT_DIR_INODE;
-    inode_t current_inode;
+    size_t padded = ((size_t)st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    char* buffer = malloc(padded ? padded : 1);
+    size_t loaded = 0;
+    while (buffer && loaded < (size_t)st.st_size) {
+        ssize_t n = read(fd, buffer + loaded, st.st_size - loaded);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        loaded += n;
+    }
+    close(fd);
 
-    if (read_inode(current_inode_num, &current_inode) != 0) {
-        fprintf(stderr, "Failed to read root inode\n");
+    // A file that changed size under us goes through the streaming path
+    if (!buffer || loaded != (size_t)st.st_size) {
+        free(buffer);
         return;
     }
+    memset(buffer + loaded, 0, padded - loaded);
+    *data = buffer;
+    *size = loaded;
+}
 
-    // Walk and create intermediate directories
-    for (int i = 0; i < num_parts - 1; i++) {
-        int next_inode_num = find_entry_in_dir(&current_inode, parts[i]);
-        if (next_inode_num == -1) {
-            printf("Creating directory: %s\n", parts[i]);
+// Worker: claim the next job once its slot is free, load the file, publish it
+static void* ingest_worker(void* arg) {
+    ingest_t* ingest = arg;
 
-            int new_dir_inode_num = allocate_inode();
-            if (new_dir_inode_num == -1) {
-                fprintf(stderr, "Failed to allocate inode for directory\n");
-                return;
-            }
+    pthread_mutex_lock(&ingest->lock);
+    while (!ingest->stop && ingest->next_read < ingest->list->count) {
+        if (ingest->next_read - ingest->next_write >= ingest->window) {
+            pthread_cond_wait(&ingest->changed, &ingest->lock);
+            continue;
+        }
+        int job = ingest->next_read++;
+        pthread_mutex_unlock(&ingest->lock);
 
-            inode_t new_dir_inode;
-            memset(&new_dir_inode, 0, sizeof(new_dir_inode));
-            new_dir_inode.type = INODE_DIR;
-            new_dir_inode.size = 0;
-            new_dir_inode.num_direct = 0;
-            new_dir_inode.indirect_block = -1;
-            new_dir_inode.double_indirect_block = -1;
-            new_dir_inode.triple_indirect_block = -1;
+        int slot = job % ingest->window;
+        char* data;
+        off_t size = 0;
+        preload_local_file(ingest->list->jobs[job].local_path, &data, &size);
 
-            if (write_inode(new_dir_inode_num, &new_dir_inode) != 0) {
-                fprintf(stderr, "Failed to write new directory inode\n");
-                return;
-            }
+        pthread_mutex_lock(&ingest->lock);
+        ingest->data[slot] = data;
+        ingest->size[slot] = size;
+        ingest->ready[slot] = job;
+        pthread_cond_broadcast(&ingest->changed);
+    }
+    pthread_mutex_unlock(&ingest->lock);
+    return NULL;
+}
 
-            if (add_entry_to_dir(&current_inode, current_inode_num, parts[i], new_dir_inode_num) != 0) {
-                fprintf(stderr, "Failed to add new directory entry\n");
-                return;
-            }
+// Store one job, from preloaded contents when a worker loaded them
+static int ingest_one(ingest_job_t* job, char* data, off_t size) {
+    if (data) {
+        add_source_t source = { NULL, data, size };
+        return add_file(job->exfs2_path, &source);
+    }
 
-            current_inode_num = new_dir_inode_num;
-            memcpy(&current_inode, &new_dir_inode, sizeof(inode_t));
-        } else {
-            current_inode_num = next_inode_num;
-            if (read_inode(current_inode_num, &current_inode) != 0) {
-                fprintf(stderr, "Failed to read existing directory inode\n");
-                return;
-            }
+    FILE* local_fp = fopen(job->local_path, "rb");
+    if (!local_fp) {
+        fprintf(stderr, "Failed to open local file %s: %s\n", job->local_path, strerror(errno));
+        return -1;
+    }
+    add_source_t source = { local_fp, NULL, -1 };
+    struct stat local_stat;
+    if (fstat(fileno(local_fp), &local_stat) == 0 && S_ISREG(local_stat.st_mode)) {
+        source.size = local_stat.st_size;
+    }
+    int result = add_file(job->exfs2_path, &source);
+    fclose(local_fp);
+    return result;
+}
 
-            if (current_inode.type != INODE_DIR) {
-                fprintf(stderr, "%s is not a directory\n", parts[i]);
-                return;
+// Store every job in order. Worker threads load small files up to a window
+// ahead of the writer, which owns all file system updates.
+static int ingest_files(ingest_list_t* list, int threads, int window, int* failures) {
+    *failures = 0;
+    if (threads <= 0 || window <= 0) {
+        for (int i = 0; i < list->count; i++) {
+            if (ingest_one(&list->jobs[i], NULL, 0) != 0) (*failures)++;
+            if (journal_pending_bytes() >= JOURNAL_GROUP_BYTES) journal_commit();
+        }
+        return 0;
+    }
+
+    ingest_t ingest;
+    memset(&ingest, 0, sizeof(ingest));
+    ingest.list = list;
+    ingest.window = window;
+    ingest.data = calloc(window, sizeof(char*));
+    ingest.size = calloc(window, sizeof(off_t));
+    ingest.ready = malloc(window * sizeof(int));
+    pthread_t* workers = malloc(threads * sizeof(pthread_t));
+
+    int result = -1;
+    if (!ingest.data || !ingest.size || !ingest.ready || !workers) goto out;
+
+    for (int i = 0; i < window; i++) ingest.ready[i] = -1;
+    pthread_mutex_init(&ingest.lock, NULL);
+    pthread_cond_init(&ingest.changed, NULL);
+
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, ingest_worker, &ingest) != 0) break;
+    }
+
+    for (int job = 0; job < list->count; job++) {
+        int slot = job % window;
+        char* data = NULL;
+        off_t size = 0;
+
+        if (started > 0) {
+            pthread_mutex_lock(&ingest.lock);
+            while (ingest.ready[slot] != job) {
+                pthread_cond_wait(&ingest.changed, &ingest.lock);
             }
+            data = ingest.data[slot];
+            size = ingest.size[slot];
+            pthread_mutex_unlock(&ingest.lock);
+        }
+
+        if (ingest_one(&list->jobs[job], data, size) != 0) (*failures)++;
+        free(data);
+        // Group the commits of many small files
+        if (journal_pending_bytes() >= JOURNAL_GROUP_BYTES) journal_commit();
+
+        if (started > 0) {
+            pthread_mutex_lock(&ingest.lock);
+            ingest.ready[slot] = -1;
+            ingest.data[slot] = NULL;
+            ingest.next_write++;
+            pthread_cond_broadcast(&ingest.changed);
+            pthread_mutex_unlock(&ingest.lock);
         }
     }
+    result = 0;
 
-    const char* filename = parts[num_parts - 1];
+    pthread_mutex_lock(&ingest.lock);
+    ingest.stop = 1;
+    pthread_cond_broadcast(&ingest.changed);
+    pthread_mutex_unlock(&ingest.lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&ingest.lock);
+    pthread_cond_destroy(&ingest.changed);
 
-    if (find_entry_in_dir(&current_inode, filename) != -1) {
-        fprintf(stderr, "File already exists: %s\n", filename);
+out:
+    free(ingest.data);
+    free(ingest.size);
+    free(ingest.ready);
+    free(workers);
+    return result;
+}
+
+// Add many files in one run: the lines of a manifest, or (with local_dir) every
+// regular file below local_dir stored under the directory 'target'
+void exfs2_add_batch(const char* target, const char* local_dir) {
+    ingest_list_t list = {0};
+    int collected = local_dir ? collect_local_tree(local_dir, target, &list)
+                              : read_manifest(target, &list);
+    if (collected != 0 && list.count == 0) {
+        ingest_list_free(&list);
         return;
     }
 
-    int file_inode_num = allocate_inode();
-    if (file_inode_num == -1) {
-        fprintf(stderr, "Failed to allocate file inode\n");
+    int failures = 0;
+    if (ingest_files(&list, extract_threads, extract_window, &failures) != 0) {
+        fprintf(stderr, "Failed to start batch ingest\n");
+        ingest_list_free(&list);
         return;
     }
 
-    inode_t file_inode;
-    memset(&file_inode, 0, sizeof(file_inode));
-    file_inode.type = INODE_FILE;
-    file_inode.size = 0;
-    file_inode.num_direct = 0;
-    file_inode.indirect_block = -1;
-    file_inode.double_indirect_block = -1;
-    file_inode.triple_indirect_block = -1;
+    printf("Added %d of %d files.\n", list.count - failures, list.count);
+    ingest_list_free(&list);
+}
 
-    FILE* local_fp = fopen(local_file, "rb");
-    if (!local_fp) {
-        perror("Failed to open local file");
-        return;
-    }
+// Listing of one directory as the walk produces it: its own lines, with the
+// listing of each subdirectory spliced in after the line that names it
+typedef struct list_node list_node_t;
 
-    char buffer[BLOCK_SIZE];
-    size_t bytes_read;
+typedef struct {
+    size_t offset;              /* splice point in the parent's text */
+    list_node_t* child;
+} list_splice_t;
 
-    // Buffers for indirect, double, triple
-    int indirect_block[BLOCK_SIZE / sizeof(int)] = {0};
-    int double_indirect_block[BLOCK_SIZE / sizeof(int)] = {0};
+struct list_node {
+    int depth;
+    int done;                   /* the walk has visited this directory */
+    char* text;
+    size_t length;
+    size_t capacity;
+    list_splice_t* splices;
+    int num_splices;
+    int splice_capacity;
+};
 
-    // Track total blocks separately from direct blocks
-    int total_blocks = 0;
-    int indirect_count = 0;
-    int double_indirect_level1_count = 0;
-    int double_indirect_level2_count = 0;
+// Shared state of a listing; the calling thread prints nodes as they finish
+typedef struct {
+    int show_sizes;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;    /* some node became done */
+} list_walk_t;
 
-    while ((bytes_read = fread(buffer, 1, BLOCK_SIZE, local_fp)) > 0) {
-        int block_id = allocate_block();
-        if (block_id == -1) {
-            fprintf(stderr, "Failed to allocate data block\n");
-            fclose(local_fp);
-            return;
+// Listing state of one directory: entries are buffered INODE_BATCH_SIZE at a
+// time so the inodes that must be read (sizes, or types an entry does not
+// record) come from one read_inodes() call
+typedef struct {
+    list_node_t* node;
+    tree_walk_t* walk;
+    int worker;
+    int show_sizes;
+    int count;
+    char names[INODE_BATCH_SIZE][MAX_FILENAME];
+    int inode_nums[INODE_BATCH_SIZE];
+    int types[INODE_BATCH_SIZE];
+} list_state_t;
+
+static list_node_t* list_node_new(int depth) {
+    list_node_t* node = calloc(1, sizeof(list_node_t));
+    if (node) node->depth = depth;
+    return node;
+}
+
+// Append one formatted, indented line to a node
+static int list_node_printf(list_node_t* node, const char* format, ...) {
+    for (;;) {
+        size_t room = node->capacity - node->length;
+        va_list args;
+        va_start(args, format);
+        int needed = vsnprintf(node->text ? node->text + node->length : NULL, room, format, args);
+        va_end(args);
+        if (needed < 0) return -1;
+        if ((size_t)needed < room) {
+            node->length += needed;
+            return 0;
         }
 
-        if (bytes_read < BLOCK_SIZE) {
-            memset(buffer + bytes_read, 0, BLOCK_SIZE - bytes_read);
+        size_t new_capacity = node->capacity ? node->capacity * 2 : 4096;
+        while (new_capacity < node->length + needed + 1) new_capacity *= 2;
+        char* grown = realloc(node->text, new_capacity);
+        if (!grown) return -1;
+        node->text = grown;
+        node->capacity = new_capacity;
+    }
+}
+
+// Splice a child's listing in at the current end of the node's text
+static int list_node_splice(list_node_t* node, list_node_t* child) {
+    if (node->num_splices == node->splice_capacity) {
+        int new_capacity = node->splice_capacity ? node->splice_capacity * 2 : 16;
+        list_splice_t* grown = realloc(node->splices, new_capacity * sizeof(list_splice_t));
+        if (!grown) return -1;
+        node->splices = grown;
+        node->splice_capacity = new_capacity;
+    }
+    node->splices[node->num_splices].offset = node->length;
+    node->splices[node->num_splices++].child = child;
+    return 0;
+}
+
+// Format the buffered entries; subdirectories become walk tasks of their own
+static void flush_list_entries(list_state_t* state) {
+    int wanted[INODE_BATCH_SIZE];
+    int slots[INODE_BATCH_SIZE];
+    int num_wanted = 0;
+    for (int i = 0; i < state->count; i++) {
+        if (state->types[i] == INODE_FREE || (state->show_sizes && state->types[i] == INODE_FILE)) {
+            slots[i] = num_wanted;
+            wanted[num_wanted++] = state->inode_nums[i];
         }
+    }
 
-        if (write_block(block_id, buffer) != 0) {
-            fprintf(stderr, "Failed to write data block\n");
-            fclose(local_fp);
-            return;
+    inode_t* inodes = NULL;
+    if (num_wanted > 0) {
+        inodes = malloc(num_wanted * sizeof(inode_t));
+        if (inodes && read_inodes(wanted, num_wanted, inodes) != 0) {
+            free(inodes);
+            inodes = NULL;
         }
+    }
 
-        // Track where to put this block based on total count
-        if (total_blocks < MAX_DIRECT_BLOCKS) {
-            // Direct block
-            file_inode.direct_blocks[file_inode.num_direct++] = block_id;
-        } 
-        else if (total_blocks < (int)(MAX_DIRECT_BLOCKS + (BLOCK_SIZE / sizeof(int)))) {
-            // Single indirect block territory
-            if (file_inode.indirect_block == -1) {
-                file_inode.indirect_block = allocate_block();
-                if (file_inode.indirect_block == -1) {
-                    fprintf(stderr, "Failed to allocate indirect block\n");
-                    fclose(local_fp);
-                    return;
-                }
-                // Initialize indirect block
-                memset(indirect_block, 0, BLOCK_SIZE);
-            } else {
-                // Read the current indirect block
-                read_block(file_inode.indirect_block, indirect_block);
-            }
+    list_node_t* node = state->node;
+    int indent = node->depth * 2;
+    for (int i = 0; i < state->count; i++) {
+        int type = state->types[i];
+        inode_t* inode = NULL;
+        if (type == INODE_FREE || (state->show_sizes && type == INODE_FILE)) {
+            if (!inodes) continue;
+            inode = &inodes[slots[i]];
+            type = inode->type;
+        }
 
-            // Store block in indirect block and write it back
-            indirect_block[indirect_count++] = block_id;
-            write_block(file_inode.indirect_block, indirect_block);
-        } 
-        else {
-            // Double indirect block territory
-            int indirect_blocks_per_block = BLOCK_SIZE / sizeof(int);
-            
-            // Check if we need to initialize double indirect block
-            if (file_inode.double_indirect_block == -1) {
-                file_inode.double_indirect_block = allocate_block();
-                if (file_inode.double_indirect_block == -1) {
-                    fprintf(stderr, "Failed to allocate double indirect block\n");
-                    fclose(local_fp);
-                    return;
-                }
-                // Initialize double indirect block
-                memset(double_indirect_block, 0, BLOCK_SIZE);
-                write_block(file_inode.double_indirect_block, double_indirect_block);
+        if (type == INODE_DIR) {
+            list_node_printf(node, "%*s%s/\n", indent, "", state->names[i]);
+            list_node_t* child = list_node_new(node->depth + 1);
+            if (child && list_node_splice(node, child) == 0) {
+                tree_walk_spawn(state->walk, state->worker, state->inode_nums[i], child);
             } else {
-                // Read current double indirect block
-                read_block(file_inode.double_indirect_block, double_indirect_block);
+                free(child);
             }
+        } else if (state->show_sizes && inode) {
+            list_node_printf(node, "%*s%s  %" PRIu64 "\n", indent, "", state->names[i], inode->size);
+        } else {
+            list_node_printf(node, "%*s%s\n", indent, "", state->names[i]);
+        }
+    }
 
-            // If we need a new level 1 block
-            if (double_indirect_level2_count >= indirect_blocks_per_block || double_indirect_block[double_indirect_level1_count] == 0) {
-                double_indirect_level2_count = 0;
-                
-                // Allocate a new level 1 block
-                int new_level1_block = allocate_block();
-                if (new_level1_block == -1) {
-                    fprintf(stderr, "Failed to allocate level 1 block\n");
-                    fclose(local_fp);
-                    return;
-                }
-                
-                // Update double indirect block with new level 1 block
-                double_indirect_block[double_indirect_level1_count++] = new_level1_block;
-                
-                // Initialize the new level 1 block
-                int level1_data[BLOCK_SIZE / sizeof(int)] = {0};
-                write_block(new_level1_block, level1_data);
-            }
+    free(inodes);
+    state->count = 0;
+}
 
-            // Read the current level 1 block
-            int level1_block_id = double_indirect_block[double_indirect_level1_count - 1];
-            int level1_data[BLOCK_SIZE / sizeof(int)];
-            read_block(level1_block_id, level1_data);
-            
-            // Store block in level 1 block and write it back
-            level1_data[double_indirect_level2_count++] = block_id;
-            write_block(level1_block_id, level1_data);
-            
-            // Write updated double indirect block
-            write_block(file_inode.double_indirect_block, double_indirect_block);
-        }
+static int list_entry(const char* name, int inode_num, int type, void* ctx) {
+    list_state_t* state = ctx;
+    snprintf(state->names[state->count], MAX_FILENAME, "%s", name);
+    state->inode_nums[state->count] = inode_num;
+    state->types[state->count++] = type;
+    if (state->count == INODE_BATCH_SIZE) flush_list_entries(state);
+    return 0;
+}
 
-        // Track total blocks and update file size
-        total_blocks++;
-        file_inode.size += bytes_read;
+// Walk task of a listing: format one directory into its node
+static void list_directory_task(tree_walk_t* walk, int worker, int inode_num, void* item) {
+    list_walk_t* listing = tree_walk_context(walk);
+    list_node_t* node = item;
+
+    inode_t inode;
+    list_state_t* state = malloc(sizeof(list_state_t));
+    if (state && read_inode(inode_num, &inode) == 0 && inode.type == INODE_DIR) {
+        state->node = node;
+        state->walk = walk;
+        state->worker = worker;
+        state->show_sizes = listing->show_sizes;
+        state->count = 0;
+        iterate_dir(&inode, list_entry, state);
+        flush_list_entries(state);
     }
+    free(state);
 
-    fclose(local_fp);
+    pthread_mutex_lock(&listing->lock);
+    node->done = 1;
+    pthread_cond_broadcast(&listing->finished);
+    pthread_mutex_unlock(&listing->lock);
+}
 
-    if (write_inode(file_inode_num, &file_inode) != 0) {
-        fprintf(stderr, "Failed to write file inode\n");
-        return;
+// Print a node once it is done, each spliced subtree in its place, and free them
+static void print_list_node(list_walk_t* listing, list_node_t* node) {
+    pthread_mutex_lock(&listing->lock);
+    while (!node->done) {
+        pthread_cond_wait(&listing->finished, &listing->lock);
     }
+    pthread_mutex_unlock(&listing->lock);
 
-    if (add_entry_to_dir(&current_inode, current_inode_num, filename, file_inode_num) != 0) {
-        fprintf(stderr, "Failed to add file entry\n");
-        return;
+    size_t printed = 0;
+    for (int i = 0; i < node->num_splices; i++) {
+        fwrite(node->text + printed, 1, node->splices[i].offset - printed, stdout);
+        printed = node->splices[i].offset;
+        print_list_node(listing, node->splices[i].child);
     }
+    if (node->length > printed) fwrite(node->text + printed, 1, node->length - printed, stdout);
 
-    printf("File '%s' added successfully.\n", filename);
+    free(node->text);
+    free(node->splices);
+    free(node);
 }
 
-// Print directory contents starting at inode_num
-void exfs2_list_recursive(int inode_num, int depth) {
-    inode_t inode;
-    if (read_inode(inode_num, &inode) != 0) {
-        return;
-    }
+// Print directory contents starting at inode_num. Subdirectories are listed in
+// parallel by a tree walk; the output keeps depth-first order. Entry types come
+// from the directory blocks; inodes are only read for sizes (show_sizes) and
+// for entries that do not record a type.
+void exfs2_list_recursive(int inode_num, int depth, int show_sizes) {
+    list_node_t* root = list_node_new(depth);
+    if (!root) return;
 
-    if (inode.type != INODE_DIR) {
-        return;
+    list_walk_t listing;
+    listing.show_sizes = show_sizes;
+    pthread_mutex_init(&listing.lock, NULL);
+    pthread_cond_init(&listing.finished, NULL);
+
+    tree_walk_t* walk = tree_walk_start(inode_num, root, list_directory_task, &listing, extract_threads);
+    if (walk) {
+        print_list_node(&listing, root);
+        tree_walk_finish(walk);
+    } else {
+        fprintf(stderr, "Failed to start listing\n");
+        free(root);
     }
 
-    for (int i = 0; i < inode.num_direct; i++) {
-        dir_entry_t entries[DIR_ENTRIES_PER_BLOCK];
-        if (load_directory_entries(inode.direct_blocks[i], entries) != 0) {
-            continue;
-        }
+    pthread_mutex_destroy(&listing.lock);
+    pthread_cond_destroy(&listing.finished);
+}
 
-        for (unsigned int j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
-            if (entries[j].inode_num != -1) {
-                // Indentation
-                for (int k = 0; k < depth; k++) {
-                    printf("  ");
-                }
+// Show the whole filesystem tree from the root directory, with file sizes in bytes if asked
+void exfs2_list(int show_sizes) {
+    printf("/\n"); // Root
+    exfs2_list_recursive(ROOT_DIR_INODE, 1, show_sizes);
+}
 
-                printf("%s", entries[j].name);
+// Copy bytes [offset, offset + length) of a compressed file into buffer,
+// decoding every cluster the range touches; returns 0 on success
+static int read_compressed(inode_t* inode, char* buffer, size_t length, off_t offset) {
+    long long first = offset / COMPRESS_CLUSTER_SIZE * COMPRESS_CLUSTER_BLOCKS;
+    long long end = ((offset + length - 1) / COMPRESS_CLUSTER_SIZE + 1) * COMPRESS_CLUSTER_BLOCKS;
+    long long file_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (end > file_blocks) end = file_blocks;
 
-                inode_t child_inode;
-                if (read_inode(entries[j].inode_num, &child_inode) == 0) {
-                    if (child_inode.type == INODE_DIR) {
-                        printf("/\n");
-                        exfs2_list_recursive(entries[j].inode_num, depth + 1);
-                    } else {
-                        printf("\n");
-                    }
-                }
+    block_map_t map;
+    if (build_range_map(inode, first, end - first, &map) != 0) return -1;
+    char* packed = malloc(COMPRESS_CLUSTER_SIZE);
+    char* plain = malloc(COMPRESS_CLUSTER_SIZE);
+    int result = (packed && plain && map.count == end - first) ? 0 : -1;
+    size_t done = 0;
+
+    for (int i = 0; result == 0 && i < map.count; i += COMPRESS_CLUSTER_BLOCKS) {
+        int blocks = map.count - i < COMPRESS_CLUSTER_BLOCKS ? map.count - i : COMPRESS_CLUSTER_BLOCKS;
+        int stored = 0;
+        while (stored < blocks && map.blocks[i + stored] != COMPRESSED_SLOT) stored++;
+
+        // A cluster with all its blocks was stored as it is
+        char* target = (stored == blocks) ? plain : packed;
+        for (int j = i; result == 0 && j < i + stored; ) {
+            int run = block_run_length(&map, j, i + stored - j);
+            if (read_blocks(map.blocks[j], run, target + (size_t)(j - i) * BLOCK_SIZE) != 0) result = -1;
+            j += run;
+        }
+
+        size_t raw_length = (size_t)blocks * BLOCK_SIZE;
+        if (result == 0 && stored < blocks) {
+            cluster_header_t* header = (cluster_header_t*)packed;
+            if (header->raw_length != raw_length ||
+                header->length > (size_t)stored * BLOCK_SIZE - sizeof(*header) ||
+                lz_decompress(packed + sizeof(*header), header->length, plain, raw_length) != (ssize_t)raw_length) {
+                fprintf(stderr, "Corrupt compressed cluster at block %" PRId64 "\n", map.blocks[i]);
+                result = -1;
             }
         }
+        if (result != 0) break;
+
+        size_t skip = offset + done - (off_t)(first + i) * BLOCK_SIZE;
+        size_t chunk = raw_length - skip;
+        if (chunk > length - done) chunk = length - done;
+        memcpy(buffer + done, plain + skip, chunk);
+        done += chunk;
     }
-}
 
-// Show the whole filesystem tree from the root directory
-void exfs2_list() {
-    printf("/\n"); // Root
-    exfs2_list_recursive(ROOT_DIR_INODE, 1);
+    free(packed);
+    free(plain);
+    free_block_map(&map);
+    return (result == 0 && done == length) ? 0 : -1;
 }
 
 // Extract the file information stored in the data segments to a file
 void exfs2_extract(const char* exfs2_path) {
+    exfs2_extract_range(exfs2_path, 0, -1);
+}
+
+// Write 'length' bytes of a file from byte 'offset' to stdout (-1: to the end).
+// Only the pointer and data blocks covering the range are read.
+void exfs2_extract_range(const char* exfs2_path, off_t offset, off_t length) {
     // Split path
     char parts[32][MAX_FILENAME];
     int num_parts = 0;
@@ -730,25 +4353,17 @@ void exfs2_extract(const char* exfs2_path) {
         return;
     }
 
-    int current_inode_num = ROOT_DIR_INODE;
-    inode_t current_inode;
-    if (read_inode(current_inode_num, &current_inode) != 0) {
-        fprintf(stderr, "Failed to read root inode\n");
+    int failed_at;
+    int current_inode_num = resolve_path(parts, num_parts, &failed_at);
+    if (current_inode_num == -1) {
+        fprintf(stderr, "Path not found: %s\n", parts[failed_at]);
         return;
     }
 
-    // Walk through path
-    for (int i = 0; i < num_parts; i++) {
-        int next_inode_num = find_entry_in_dir(&current_inode, parts[i]);
-        if (next_inode_num == -1) {
-            fprintf(stderr, "Path not found: %s\n", parts[i]);
-            return;
-        }
-        current_inode_num = next_inode_num;
-        if (read_inode(current_inode_num, &current_inode) != 0) {
-            fprintf(stderr, "Failed to read inode\n");
-            return;
-        }
+    inode_t current_inode;
+    if (read_inode(current_inode_num, &current_inode) != 0) {
+        fprintf(stderr, "Failed to read inode\n");
+        return;
     }
 
     // Now current_inode should be the file
@@ -757,131 +4372,185 @@ void exfs2_extract(const char* exfs2_path) {
         return;
     }
 
-    char buffer[BLOCK_SIZE];
-    int remaining = current_inode.size; // total bytes remaining to write
-
-    // Read direct blocks
-    for (int i = 0; i < current_inode.num_direct && remaining > 0; i++) {
-        if (read_block(current_inode.direct_blocks[i], buffer) == 0) {
-            int to_write = (remaining > BLOCK_SIZE) ? BLOCK_SIZE : remaining;
-            fwrite(buffer, 1, to_write, stdout);
-            remaining -= to_write;
-        }
-    }
-
-    // Read single indirect blocks
-    if (current_inode.indirect_block != -1 && remaining > 0) {
-        int indirect_block[BLOCK_SIZE / sizeof(int)];
-        if (read_block(current_inode.indirect_block, indirect_block) == 0) {
-            for (size_t i = 0; i < BLOCK_SIZE / sizeof(int) && remaining > 0; i++) {
-                if (indirect_block[i] == 0) break;
-                if (read_block(indirect_block[i], buffer) == 0) {
-                    int to_write = (remaining > BLOCK_SIZE) ? BLOCK_SIZE : remaining;
-                    fwrite(buffer, 1, to_write, stdout);
-                    remaining -= to_write;
-                }
-            }
+    // Clamp the range to the file
+    if ((size_t)offset >= current_inode.size) return;
+    size_t remaining = current_inode.size - offset; // total bytes remaining to write
+    if (length >= 0 && (size_t)length < remaining) remaining = length;
+    if (remaining == 0) return;
+
+    if (current_inode.flags & INODE_FLAG_INLINE) {
+        if (fwrite(current_inode.inline_data + offset, 1, remaining, stdout) != remaining ||
+            fflush(stdout) != 0) {
+            perror("Failed to write file contents");
         }
+        return;
     }
 
-    // Read double indirect blocks
-    if (current_inode.double_indirect_block != -1 && remaining > 0) {
-        int double_indirect_block[BLOCK_SIZE / sizeof(int)];
-        if (read_block(current_inode.double_indirect_block, double_indirect_block) == 0) {
-            for (size_t i = 0; i < BLOCK_SIZE / sizeof(int) && remaining > 0; i++) {
-                if (double_indirect_block[i] == 0) break;
-                int indirect_block[BLOCK_SIZE / sizeof(int)];
-                if (read_block(double_indirect_block[i], indirect_block) == 0) {
-                    for (size_t j = 0; j < BLOCK_SIZE / sizeof(int) && remaining > 0; j++) {
-                        if (indirect_block[j] == 0) break;
-                        if (read_block(indirect_block[j], buffer) == 0) {
-                            int to_write = (remaining > BLOCK_SIZE) ? BLOCK_SIZE : remaining;
-                            fwrite(buffer, 1, to_write, stdout);
-                            remaining -= to_write;
-                        }
-                    }
-                }
+    // Compressed files are decoded a few clusters at a time, in cluster steps
+    if (current_inode.flags & INODE_FLAG_COMPRESSED) {
+        size_t step = (size_t)COMPRESS_EXTRACT_CLUSTERS * COMPRESS_CLUSTER_SIZE;
+        char* decoded = malloc(step);
+        if (!decoded) {
+            fprintf(stderr, "Failed to allocate decode buffer\n");
+            return;
+        }
+        while (remaining > 0) {
+            size_t chunk = step - offset % COMPRESS_CLUSTER_SIZE;
+            if (chunk > remaining) chunk = remaining;
+            if (read_compressed(&current_inode, decoded, chunk, offset) != 0) {
+                fprintf(stderr, "Failed to read file contents\n");
+                break;
+            }
+            if (fwrite(decoded, 1, chunk, stdout) != chunk) {
+                perror("Failed to write file contents");
+                break;
             }
+            offset += chunk;
+            remaining -= chunk;
         }
+        fflush(stdout);
+        free(decoded);
+        return;
     }
 
-    // Read triple indirect blocks
-    if (current_inode.triple_indirect_block != -1 && remaining > 0) {
-        int triple_indirect_block[BLOCK_SIZE / sizeof(int)];
-        if (read_block(current_inode.triple_indirect_block, triple_indirect_block) == 0) {
-            for (size_t i = 0; i < BLOCK_SIZE / sizeof(int) && remaining > 0; i++) {
-                if (triple_indirect_block[i] == 0) break;
-                int double_indirect_block[BLOCK_SIZE / sizeof(int)];
-                if (read_block(triple_indirect_block[i], double_indirect_block) == 0) {
-                    for (size_t j = 0; j < BLOCK_SIZE / sizeof(int) && remaining > 0; j++) {
-                        if (double_indirect_block[j] == 0) break;
-                        int indirect_block[BLOCK_SIZE / sizeof(int)];
-                        if (read_block(double_indirect_block[j], indirect_block) == 0) {
-                            for (size_t k = 0; k < BLOCK_SIZE / sizeof(int) && remaining > 0; k++) {
-                                if (indirect_block[k] == 0) break;
-                                if (read_block(indirect_block[k], buffer) == 0) {
-                                    int to_write = (remaining > BLOCK_SIZE) ? BLOCK_SIZE : remaining;
-                                    fwrite(buffer, 1, to_write, stdout);
-                                    remaining -= to_write;
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-        }
+    long long first_logical = offset / BLOCK_SIZE;
+    size_t skip = offset % BLOCK_SIZE;
+    long long num_blocks = (skip + remaining + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    block_map_t map;
+    if (build_range_map(&current_inode, first_logical, num_blocks, &map) != 0 || map.count < num_blocks) {
+        if (map.blocks) free_block_map(&map);
+        fprintf(stderr, "Failed to read block pointers\n");
+        return;
     }
-}
 
-// Delete everything under inode_num and free its space.
-void exfs2_remove_recursive(int inode_num) {
-    inode_t inode;
-    if (read_inode(inode_num, &inode) != 0) {
+    // Anything already buffered by stdio must reach the descriptor first
+    fflush(stdout);
+
+    struct stat out_stat;
+    int have_stat = (fstat(STDOUT_FILENO, &out_stat) == 0);
+
+    // Pipes and terminals get read-ahead; files and sockets are copied by the kernel
+    if (extract_threads > 0 && extract_window > 0 &&
+        !(have_stat && (S_ISREG(out_stat.st_mode) || S_ISSOCK(out_stat.st_mode)))) {
+        if (extract_readahead(&map, skip, remaining, STDOUT_FILENO, extract_threads, extract_window) != 0) {
+            perror("Failed to write file contents");
+        }
+        free_block_map(&map);
         return;
     }
 
-    if (inode.type == INODE_FILE) {
-        // Free data blocks
-        for (int i = 0; i < inode.num_direct; i++) {
-            free_block(inode.direct_blocks[i]);
-        }
-
-        // Free indirect blocks
-        if (inode.indirect_block != -1) {
-            int indirect_block_data[BLOCK_SIZE / sizeof(int)];
-            if (read_block(inode.indirect_block, indirect_block_data) == 0) {
-                for (size_t i = 0; i < BLOCK_SIZE / sizeof(int); i++) {
-                    if (indirect_block_data[i] == 0) break;
-                    free_block(indirect_block_data[i]);
-                }
-            }
-            free_block(inode.indirect_block);
+    int method = SEND_SENDFILE;
+    if (have_stat && S_ISREG(out_stat.st_mode)) {
+        method = SEND_COPY_FILE_RANGE;
+    }
+
+    // Physically adjacent blocks of the same segment go out as one range
+    for (int i = 0; i < map.count && remaining > 0; ) {
+        int run = block_run_length(&map, i, blocks_per_segment);
+
+        size_t length = (size_t)run * BLOCK_SIZE - skip;
+        if (length > remaining) length = remaining;
+
+        if (send_blocks(map.blocks[i], skip, length, STDOUT_FILENO, &method) != 0) {
+            perror("Failed to write file contents");
+            break;
         }
+        remaining -= length;
+        skip = 0;
+        i += run;
+    }
+
+    free_block_map(&map);
+}
+
+// Free a file's data blocks and the pointer blocks of every tree, gathered in
+// one walk and released a segment at a time, then its inode. Shared data
+// blocks only lose this file's reference. Returns 0 if everything was freed.
+static int free_file(int inode_num, inode_t* inode) {
+    block_map_t data, nodes;
+    int result = -1;
+    if (collect_owned_blocks(inode, &data, &nodes) == 0) {
+        result = 0;
+        if (release_file_blocks(&data) != 0) result = -1;
+        if (free_blocks(nodes.blocks, nodes.count) != 0) result = -1;
+        free_block_map(&data);
+        free_block_map(&nodes);
+    }
+    if (free_inode(inode_num) != 0) result = -1;
+    return result;
+}
 
-        // Free the inode
-        free_inode(inode_num);
+typedef struct {
+    tree_walk_t* walk;
+    int worker;
+} remove_state_t;
 
+// Note that part of a recursive remove failed; its walk's context is the flag
+static void remove_failed(tree_walk_t* walk) {
+    __atomic_store_n((int*)tree_walk_context(walk), 1, __ATOMIC_RELAXED);
+}
+
+static int remove_entry_tree(const char* name, int inode_num, int type, void* ctx) {
+    (void)name;
+    remove_state_t* state = ctx;
+    inode_t inode;
+    if (type == INODE_DIR) {
+        tree_walk_spawn(state->walk, state->worker, inode_num, NULL);
+    } else if (read_inode(inode_num, &inode) != 0) {
+        remove_failed(state->walk);
     } else if (inode.type == INODE_DIR) {
-        // Recursively delete directory contents
-        for (int i = 0; i < inode.num_direct; i++) {
-            dir_entry_t entries[DIR_ENTRIES_PER_BLOCK];
-            if (load_directory_entries(inode.direct_blocks[i], entries) != 0) continue;
-            
-            for (unsigned int j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
-                if (entries[j].inode_num != -1) {
-                    exfs2_remove_recursive(entries[j].inode_num);
-                }
-            }
+        tree_walk_spawn(state->walk, state->worker, inode_num, NULL);
+    } else if (inode.type == INODE_FILE && free_file(inode_num, &inode) != 0) {
+        remove_failed(state->walk);
+    }
+    return 0;
+}
 
-            free_block(inode.direct_blocks[i]);
-        }
+// Walk task of a recursive remove: free the files of one directory and queue
+// its subdirectories, then free the directory itself. All its entries have been
+// read by then, and the subdirectory tasks need nothing but their own inodes.
+static void remove_directory_task(tree_walk_t* walk, int worker, int inode_num, void* item) {
+    (void)item;
+    inode_t inode;
+    if (read_inode(inode_num, &inode) != 0 || inode.type != INODE_DIR) {
+        remove_failed(walk);
+        return;
+    }
 
-        free_inode(inode_num);
+    remove_state_t state = { walk, worker };
+    if (iterate_dir(&inode, remove_entry_tree, &state) != 0 || free_dir_blocks(&inode) != 0 ||
+        free_inode(inode_num) != 0) {
+        remove_failed(walk);
     }
 }
 
-// Remove a file or folder at exfs2_path from the FS.
-void exfs2_remove(const char* exfs2_path) {
+// Delete everything under inode_num and free its space. Directory trees are
+// taken apart by a parallel tree walk. Returns 0 if all of it was freed.
+int exfs2_remove_recursive(int inode_num) {
+    inode_t inode;
+    if (read_inode(inode_num, &inode) != 0) {
+        return -1;
+    }
+
+    if (inode.type == INODE_FILE) {
+        return free_file(inode_num, &inode);
+    }
+    if (inode.type != INODE_DIR) {
+        return -1;
+    }
+    int failed = 0;
+    tree_walk_t* walk = tree_walk_start(inode_num, NULL, remove_directory_task, &failed, extract_threads);
+    if (!walk) {
+        fprintf(stderr, "Failed to start removal\n");
+        return -1;
+    }
+    tree_walk_finish(walk);
+    return failed ? -1 : 0;
+}
+
+// Remove a file or folder at exfs2_path from the FS; returns 0 on success
+static int remove_path(const char* exfs2_path) {
     // Split path
     char parts[32][MAX_FILENAME];
     int num_parts = 0;
@@ -889,55 +4558,59 @@ void exfs2_remove(const char* exfs2_path) {
 
     if (num_parts == 0) {
         fprintf(stderr, "Invalid path\n");
-        return;
+        return -1;
     }
 
-    int current_inode_num = ROOT_DIR_INODE;
-    inode_t current_inode;
-    if (read_inode(current_inode_num, &current_inode) != 0) {
-        fprintf(stderr, "Failed to read root inode\n");
-        return;
+    // Resolve the parent directory
+    int failed_at;
+    int current_inode_num = resolve_path(parts, num_parts - 1, &failed_at);
+    if (current_inode_num == -1) {
+        fprintf(stderr, "Path not found: %s\n", parts[failed_at]);
+        return -1;
     }
 
-    // Walk through path up to parent
-    for (int i = 0; i < num_parts - 1; i++) {
-        int next_inode_num = find_entry_in_dir(&current_inode, parts[i]);
-        if (next_inode_num == -1) {
-            fprintf(stderr, "Path not found: %s\n", parts[i]);
-            return;
-        }
-        current_inode_num = next_inode_num;
-        if (read_inode(current_inode_num, &current_inode) != 0) {
-            fprintf(stderr, "Failed to read inode\n");
-            return;
-        }
+    inode_t current_inode;
+    if (read_inode(current_inode_num, &current_inode) != 0) {
+        fprintf(stderr, "Failed to read inode\n");
+        return -1;
     }
 
     // Now current_inode is parent dir, find child to delete
-    int target_inode_num = find_entry_in_dir(&current_inode, parts[num_parts-1]);
+    int target_inode_num = lookup_entry(current_inode_num, parts[num_parts-1]);
     if (target_inode_num == -1) {
         fprintf(stderr, "File not found: %s\n", parts[num_parts-1]);
-        return;
+        return -1;
+    }
+
+    // The entry has to go too, so nothing is freed below a read-only directory
+    if (!is_writable_dir(&current_inode)) {
+        return -1;
     }
 
-    exfs2_remove_recursive(target_inode_num);
+    // The entry goes even if part of the tree could not be freed; -F finds the rest
+    int removed = exfs2_remove_recursive(target_inode_num);
+    if (removed != 0) {
+        fprintf(stderr, "Failed to free everything under %s\n", parts[num_parts-1]);
+    }
 
     // Remove entry from directory
-    for (int i = 0; i < current_inode.num_direct; i++) {
-        dir_entry_t entries[DIR_ENTRIES_PER_BLOCK];
-        if (load_directory_entries(current_inode.direct_blocks[i], entries) != 0) continue;
+    if (remove_entry_from_dir(&current_inode, current_inode_num, parts[num_parts-1]) != 0) return -1;
+    return removed;
+}
 
-        for (unsigned int j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
-            if (entries[j].inode_num == target_inode_num) {
-                entries[j].inode_num = -1;
-                memset(entries[j].name, 0, MAX_FILENAME);
-                save_directory_entries(current_inode.direct_blocks[i], entries);
-                break;
-            }
-        }
+// Remove a file or directory and report it
+void exfs2_remove(const char* exfs2_path) {
+    if (remove_path(exfs2_path) == 0) {
+        const char* name = strrchr(exfs2_path, '/');
+        printf("Removed %s successfully.\n", name ? name + 1 : exfs2_path);
     }
+}
 
-    printf("Removed %s successfully.\n", parts[num_parts-1]);
+static int print_debug_entry(const char* name, int inode_num, int type, void* ctx) {
+    (void)type;
+    (void)ctx;
+    printf("  '%s' %d\n", name, inode_num);
+    return 0;
 }
 
 // Print a human-readable dump of the structures along exfs2_path.
@@ -958,19 +4631,10 @@ void exfs2_debug(const char* exfs2_path) {
     }
 
     printf("directory '/':\n");
-    for (int i = 0; i < current_inode.num_direct; i++) {
-        dir_entry_t entries[DIR_ENTRIES_PER_BLOCK];
-        if (load_directory_entries(current_inode.direct_blocks[i], entries) != 0) continue;
-        
-        for (unsigned int j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
-            if (entries[j].inode_num != -1) {
-                printf("  '%s' %d\n", entries[j].name, entries[j].inode_num);
-            }
-        }
-    }
+    iterate_dir(&current_inode, print_debug_entry, NULL);
 
     for (int d = 0; d < num_parts; d++) {
-        int next_inode_num = find_entry_in_dir(&current_inode, parts[d]);
+        int next_inode_num = lookup_entry(current_inode_num, parts[d]);
         if (next_inode_num == -1) {
             printf("Component not found: %s\n", parts[d]);
             return;
@@ -984,24 +4648,25 @@ void exfs2_debug(const char* exfs2_path) {
 
         if (current_inode.type == INODE_DIR) {
             printf("directory '%s':\n", parts[d]);
-            for (int i = 0; i < current_inode.num_direct; i++) {
-                dir_entry_t entries[DIR_ENTRIES_PER_BLOCK];
-                if (load_directory_entries(current_inode.direct_blocks[i], entries) != 0) continue;
-                
-                for (unsigned int j = 0; j < DIR_ENTRIES_PER_BLOCK; j++) {
-                    if (entries[j].inode_num != -1) {
-                        printf("  '%s' %d\n", entries[j].name, entries[j].inode_num);
-                    }
-                }
-            }
+            iterate_dir(&current_inode, print_debug_entry, NULL);
         } else if (current_inode.type == INODE_FILE) {
             printf("\nfile '%s':\n", parts[d]);
-            printf("  size: %zu bytes\n", current_inode.size);
+            printf("  size: %" PRIu64 " bytes\n", current_inode.size);
+            if (current_inode.flags & INODE_FLAG_INLINE) {
+                printf("  stored inline in the inode\n");
+            }
+            block_map_t stored, nodes;
+            if ((current_inode.flags & INODE_FLAG_COMPRESSED) &&
+                collect_inode_blocks(&current_inode, &stored, &nodes) == 0) {
+                printf("  compressed: %d data blocks for %" PRIu64 " bytes\n", stored.count, current_inode.size);
+                free_block_map(&stored);
+                free_block_map(&nodes);
+            }
             printf("Blocks summary:\n");
             
             // Direct blocks summary
             if (current_inode.num_direct > 0) {
-                printf("    direct blocks: %d (from %d to %d)\n", 
+                printf("    direct blocks: %d (from %" PRId64 " to %" PRId64 ")\n", 
                        current_inode.num_direct,
                        current_inode.direct_blocks[0],
                        current_inode.direct_blocks[current_inode.num_direct - 1]);
@@ -1011,14 +4676,14 @@ void exfs2_debug(const char* exfs2_path) {
             
             // Indirect blocks summary
             int indirect_count = 0;
-            int first_indirect = -1;
-            int last_indirect = -1;
+            block_id_t first_indirect = -1;
+            block_id_t last_indirect = -1;
             
             if (current_inode.indirect_block != -1) {
-                int indirect_data[BLOCK_SIZE / sizeof(int)];
+                block_id_t indirect_data[POINTERS_PER_BLOCK];
                 if (read_block(current_inode.indirect_block, indirect_data) == 0) {
                     // Count and find first/last blocks
-                    for (unsigned int j = 0; j < BLOCK_SIZE / sizeof(int); j++) {
+                    for (unsigned int j = 0; j < (unsigned int)POINTERS_PER_BLOCK; j++) {
                         if (indirect_data[j] != 0) {
                             if (first_indirect == -1) first_indirect = indirect_data[j];
                             last_indirect = indirect_data[j];
@@ -1027,7 +4692,7 @@ void exfs2_debug(const char* exfs2_path) {
                     }
                 }
                 
-                printf("    indirect blocks: %d (from %d to %d) via indirect block %d\n",
+                printf("    indirect blocks: %d (from %" PRId64 " to %" PRId64 ") via indirect block %" PRId64 "\n",
                        indirect_count, 
                        first_indirect != -1 ? first_indirect : 0, 
                        last_indirect != -1 ? last_indirect : 0,
@@ -1038,22 +4703,22 @@ void exfs2_debug(const char* exfs2_path) {
             
             // Double indirect blocks summary
             int double_indirect_count = 0;
-            int first_double_indirect = -1;
-            int last_double_indirect = -1;
+            block_id_t first_double_indirect = -1;
+            block_id_t last_double_indirect = -1;
             int level1_count = 0;
             
             if (current_inode.double_indirect_block != -1) {
-                int double_indirect_data[BLOCK_SIZE / sizeof(int)];
+                block_id_t double_indirect_data[POINTERS_PER_BLOCK];
                 if (read_block(current_inode.double_indirect_block, double_indirect_data) == 0) {
                     // Count level-1 blocks
-                    for (unsigned int i = 0; i < BLOCK_SIZE / sizeof(int); i++) {
+                    for (unsigned int i = 0; i < (unsigned int)POINTERS_PER_BLOCK; i++) {
                         if (double_indirect_data[i] != 0) {
                             level1_count++;
                             
                             // Read level-1 block to find data blocks
-                            int level1_data[BLOCK_SIZE / sizeof(int)];
+                            block_id_t level1_data[POINTERS_PER_BLOCK];
                             if (read_block(double_indirect_data[i], level1_data) == 0) {
-                                for (unsigned int j = 0; j < BLOCK_SIZE / sizeof(int); j++) {
+                                for (unsigned int j = 0; j < (unsigned int)POINTERS_PER_BLOCK; j++) {
                                     if (level1_data[j] != 0) {
                                         if (first_double_indirect == -1) first_double_indirect = level1_data[j];
                                         last_double_indirect = level1_data[j];
@@ -1065,7 +4730,7 @@ void exfs2_debug(const char* exfs2_path) {
                     }
                 }
                 
-                printf("    double indirect blocks: %d (from %d to %d) \n",
+                printf("    double indirect blocks: %d (from %" PRId64 " to %" PRId64 ") \n",
                        double_indirect_count,
                        first_double_indirect != -1 ? first_double_indirect : 0,
                        last_double_indirect != -1 ? last_double_indirect : 0);
@@ -1073,30 +4738,30 @@ void exfs2_debug(const char* exfs2_path) {
             
             // Triple indirect blocks summary
             int triple_indirect_count = 0;
-            int first_triple_indirect = -1;
-            int last_triple_indirect = -1;
+            block_id_t first_triple_indirect = -1;
+            block_id_t last_triple_indirect = -1;
             int triple_level1_count = 0;
             int triple_level2_count = 0;
             
             if (current_inode.triple_indirect_block != -1) {
-                int triple_indirect_data[BLOCK_SIZE / sizeof(int)];
+                block_id_t triple_indirect_data[POINTERS_PER_BLOCK];
                 if (read_block(current_inode.triple_indirect_block, triple_indirect_data) == 0) {
                     // Count level-1 blocks
-                    for (unsigned int i = 0; i < BLOCK_SIZE / sizeof(int); i++) {
+                    for (unsigned int i = 0; i < (unsigned int)POINTERS_PER_BLOCK; i++) {
                         if (triple_indirect_data[i] != 0) {
                             triple_level1_count++;
                             
                             // Read level-1 blocks to find level-2 blocks
-                            int level1_data[BLOCK_SIZE / sizeof(int)];
+                            block_id_t level1_data[POINTERS_PER_BLOCK];
                             if (read_block(triple_indirect_data[i], level1_data) == 0) {
-                                for (unsigned int j = 0; j < BLOCK_SIZE / sizeof(int); j++) {
+                                for (unsigned int j = 0; j < (unsigned int)POINTERS_PER_BLOCK; j++) {
                                     if (level1_data[j] != 0) {
                                         triple_level2_count++;
                                         
                                         // Read level-2 blocks to find data blocks
-                                        int level2_data[BLOCK_SIZE / sizeof(int)];
+                                        block_id_t level2_data[POINTERS_PER_BLOCK];
                                         if (read_block(level1_data[j], level2_data) == 0) {
-                                            for (unsigned int k = 0; k < BLOCK_SIZE / sizeof(int); k++) {
+                                            for (unsigned int k = 0; k < (unsigned int)POINTERS_PER_BLOCK; k++) {
                                                 if (level2_data[k] != 0) {
                                                     if (first_triple_indirect == -1) first_triple_indirect = level2_data[k];
                                                     last_triple_indirect = level2_data[k];
@@ -1111,7 +4776,7 @@ void exfs2_debug(const char* exfs2_path) {
                     }
                 }
                 
-                printf("    triple indirect blocks: %d (from %d to %d) \n",
+                printf("    triple indirect blocks: %d (from %" PRId64 " to %" PRId64 ") \n",
                        triple_indirect_count,
                        first_triple_indirect != -1 ? first_triple_indirect : 0,
                        last_triple_indirect != -1 ? last_triple_indirect : 0);
@@ -1124,81 +4789,764 @@ void exfs2_debug(const char* exfs2_path) {
     }
 }
 
-// Create the first inode/data segments and root dir if they don’t exist yet.
-int init_fs() {
-    FILE* fp = fopen(INODE_SEG_PREFIX "0", "rb");
-    if (fp) {
-        // inode_seg_0 already exists
-        fclose(fp);
-        return 0;
+// The one file system a process may have open through the library API
+static exfs2_fs_t open_fs;
+static int fs_is_open = 0;
+
+// Resolve an absolute path and read its inode
+static int open_path(const char* path, int* inode_num, inode_t* inode) {
+    char parts[32][MAX_FILENAME];
+    int num_parts = 0;
+    split_path(path, parts, &num_parts);
+
+    int found = resolve_path(parts, num_parts, NULL);
+    if (found == -1 || read_inode(found, inode) != 0) return -1;
+    if (inode_num) *inode_num = found;
+    return 0;
+}
+
+// Open (creating it if needed) the file system whose segments live in 'directory'
+exfs2_fs_t* exfs2_open(const char* directory) {
+    if (fs_is_open) {
+        errno = EBUSY;
+        return NULL;
+    }
+    // The longest segment name must fit too
+    char longest[SEGMENT_NAME_MAX];
+    if (snprintf(segment_directory, sizeof(segment_directory), "%s", directory) >= (int)sizeof(segment_directory) ||
+        segment_filename(longest, sizeof(longest), INT_MAX, INODE_SEGMENT) != 0) {
+        snprintf(segment_directory, sizeof(segment_directory), ".");
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    if (init_fs() != 0) {
+        snprintf(segment_directory, sizeof(segment_directory), ".");
+        return NULL;
     }
 
-    // inode_seg_0 does not exist, create initial inode and data segments
-    if (create_new_segment(0, INODE_SEGMENT) != 0) {
-        fprintf(stderr, "Failed to create inode segment 0\n");
+    snprintf(open_fs.directory, sizeof(open_fs.directory), "%s", directory);
+    fs_is_open = 1;
+    return &open_fs;
+}
+
+// Describe the file or directory at 'path'
+int exfs2_lookup(exfs2_fs_t* fs, const char* path, exfs2_stat_t* st) {
+    inode_t inode;
+    int inode_num;
+    if (!fs || open_path(path, &inode_num, &inode) != 0) return -1;
+
+    st->inode_num = inode_num;
+    st->type = inode.type;
+    st->size = inode.size;
+    return 0;
+}
+
+// Copy up to 'length' bytes of a file starting at 'offset' into buffer.
+// Returns the bytes copied (0 at or past the end) or -1 on error.
+ssize_t exfs2_read(exfs2_fs_t* fs, const char* path, void* buffer, size_t length, off_t offset) {
+    inode_t inode;
+    if (!fs || offset < 0 || open_path(path, NULL, &inode) != 0 || inode.type != INODE_FILE) return -1;
+    if ((size_t)offset >= inode.size) return 0;
+    if (length > inode.size - offset) length = inode.size - offset;
+
+    if (length == 0) return 0;
+
+    if (inode.flags & INODE_FLAG_INLINE) {
+        memcpy(buffer, inode.inline_data + offset, length);
+        return length;
+    }
+    if (inode.flags & INODE_FLAG_COMPRESSED) {
+        return read_compressed(&inode, buffer, length, offset) == 0 ? (ssize_t)length : -1;
+    }
+
+    size_t skip = offset % BLOCK_SIZE;
+    long long num_blocks = (skip + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    block_map_t map;
+    if (build_range_map(&inode, offset / BLOCK_SIZE, num_blocks, &map) != 0) return -1;
+
+    char* bounce = malloc((size_t)READAHEAD_RUN_BLOCKS * BLOCK_SIZE);
+    size_t done = 0;
+
+    // Physically adjacent blocks of the same segment are read as one run
+    for (int i = 0; bounce && i < map.count && done < length; ) {
+        int run = block_run_length(&map, i, READAHEAD_RUN_BLOCKS);
+        if (read_blocks(map.blocks[i], run, bounce) != 0) break;
+
+        size_t chunk = (size_t)run * BLOCK_SIZE - skip;
+        if (chunk > length - done) chunk = length - done;
+        memcpy((char*)buffer + done, bounce + skip, chunk);
+        done += chunk;
+        skip = 0;
+        i += run;
+    }
+
+    free(bounce);
+    free_block_map(&map);
+    return done == length ? (ssize_t)length : -1;
+}
+
+// Store 'length' bytes as a new file at 'path', creating missing directories
+int exfs2_write(exfs2_fs_t* fs, const char* path, const void* data, size_t length) {
+    if (!fs) return -1;
+
+    // add_file() writes whole blocks straight from the buffer
+    size_t padded = (length + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    char* copy = calloc(1, padded ? padded : 1);
+    if (!copy) return -1;
+    memcpy(copy, data, length);
+
+    add_source_t source = { NULL, copy, (off_t)length };
+    int result = add_file(path, &source);
+    free(copy);
+    return result;
+}
+
+// Remove the file or directory tree at 'path'
+int exfs2_unlink(exfs2_fs_t* fs, const char* path) {
+    if (!fs) return -1;
+    return remove_path(path);
+}
+
+// Call visit(name, inode_num, ctx) for each entry of the directory at 'path'
+int exfs2_readdir(exfs2_fs_t* fs, const char* path, dir_visit_fn visit, void* ctx) {
+    inode_t inode;
+    if (!fs || open_path(path, NULL, &inode) != 0 || inode.type != INODE_DIR) return -1;
+    return iterate_dir(&inode, visit, ctx);
+}
+
+// Commit every change so far through the journal
+int exfs2_sync(exfs2_fs_t* fs) {
+    if (!fs) return -1;
+    return journal_commit();
+}
+
+// Flush and close the file system and drop every cache, so it can be reopened
+void exfs2_close(exfs2_fs_t* fs) {
+    if (!fs || !fs_is_open) return;
+
+    shutdown_fs();
+    drop_allocator(&inode_allocator);
+    drop_allocator(&block_allocator);
+    metadata_cache_clear();
+    block_cache_clear();
+    snprintf(segment_directory, sizeof(segment_directory), ".");
+    fs_is_open = 0;
+}
+
+// Metadata journal, see exfs2.h. Commits are serialized by journal_lock. The
+// data blocks logged since the last checkpoint are kept sorted, so a commit can
+// tell which of the blocks it frees need a revoke record: without one, a
+// replay could put an old logged copy over data written to the reused block.
+static int journal_fd = -1;
+static off_t journal_tail = 0;             /* where the next transaction goes */
+static uint64_t journal_first = 0;         /* sequence of the first transaction in the log */
+static uint64_t journal_sequence = 0;      /* sequence of the next transaction */
+static char journal_boot_id[40];
+static block_id_t* journaled_blocks = NULL;
+static int num_journaled_blocks = 0;
+static int journaled_block_capacity = 0;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define JOURNAL_PAD(length) (((size_t)(length) + 7) & ~(size_t)7)
+
+static void journal_filename(char* filename, size_t len) {
+    snprintf(filename, len, "%s/%s", segment_directory, JOURNAL_FILE);
+}
+
+// Kernel boot id, left empty if it cannot be read
+static void read_boot_id(char* boot_id, size_t len) {
+    memset(boot_id, 0, len);
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+    if (fd < 0) return;
+    ssize_t n = read(fd, boot_id, len - 1);
+    close(fd);
+    if (n <= 0) {
+        boot_id[0] = '\0';
+        return;
+    }
+    boot_id[strcspn(boot_id, "\n")] = '\0';
+}
+
+// FNV-1a over 64-bit words, with a fold so every bit reaches the low ones
+static uint64_t journal_checksum(uint64_t sequence, const uint8_t* data, size_t length) {
+    uint64_t hash = 14695981039346656037ULL ^ sequence;
+    for (size_t i = 0; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+// Rewrite the first block of the log; every transaction so far is applied
+static int journal_write_header(void) {
+    journal_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.sequence = journal_first;
+    header.applied = journal_sequence - 1;
+    header.applied_tail = journal_tail;
+    memcpy(header.boot_id, journal_boot_id, sizeof(header.boot_id));
+    if (num_journaled_blocks <= JOURNAL_HEADER_BLOCKS) {
+        header.num_logged = num_journaled_blocks;
+        memcpy(header.logged, journaled_blocks, num_journaled_blocks * sizeof(block_id_t));
+    } else {
+        header.num_logged = -1;
+    }
+    return pwrite(journal_fd, &header, sizeof(header), 0) == sizeof(header) ? 0 : -1;
+}
+
+// Create an empty log, replacing one left from an earlier file system
+static int journal_create(void) {
+    char filename[MAX_PATH + 16];
+    journal_filename(filename, sizeof(filename));
+    read_boot_id(journal_boot_id, sizeof(journal_boot_id));
+
+    journal_fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (journal_fd < 0) {
+        perror("Failed to create journal");
         return -1;
     }
-    if (create_new_segment(0, DATA_SEGMENT) != 0) {
-        fprintf(stderr, "Failed to create data segment 0\n");
+    journal_first = journal_sequence = 1;
+    journal_tail = BLOCK_SIZE;
+    num_journaled_blocks = 0;
+    if (ftruncate(journal_fd, JOURNAL_SIZE) != 0 || journal_write_header() != 0) {
+        perror("Failed to initialize journal");
         return -1;
     }
 
-    printf("Initialized new file system (root directory created).\n");
+    // The log's directory entry has to be durable before anything relies on it
+    int dir_fd = open(segment_directory, O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 0;
+}
+
+// Make everything written so far durable and empty the log
+static int journal_checkpoint(void) {
+    if (syncfs(journal_fd) != 0) return -1;
+    journal_first = journal_sequence;
+    journal_tail = BLOCK_SIZE;
+    num_journaled_blocks = 0;
+    return journal_write_header();
+}
+
+static int is_journaled(block_id_t block_id) {
+    return num_journaled_blocks > 0 &&
+           bsearch(&block_id, journaled_blocks, num_journaled_blocks, sizeof(block_id_t), compare_units) != NULL;
+}
+
+// Note a logged data block; sort_journaled_blocks() puts the set back in order
+static int add_journaled_block(block_id_t block_id) {
+    if (num_journaled_blocks == journaled_block_capacity) {
+        int new_capacity = journaled_block_capacity ? journaled_block_capacity * 2 : 256;
+        block_id_t* grown = realloc(journaled_blocks, new_capacity * sizeof(block_id_t));
+        if (!grown) return -1;
+        journaled_blocks = grown;
+        journaled_block_capacity = new_capacity;
+    }
+    journaled_blocks[num_journaled_blocks++] = block_id;
     return 0;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        printf("Usage:\n");
-        printf("  -l                  List the file system contents\n");
-        printf("  -a <exfs2_path> -f <local_file>  Add file\n");
-        printf("  -r <exfs2_path>     Remove file/directory\n");
-        printf("  -e <exfs2_path>     Extract file to stdout\n");
-        printf("  -D <exfs2_path>     Debug path\n");
-        return 1;
+static void sort_journaled_blocks(void) {
+    qsort(journaled_blocks, num_journaled_blocks, sizeof(block_id_t), compare_units);
+    int unique = 0;
+    for (int i = 0; i < num_journaled_blocks; i++) {
+        if (unique == 0 || journaled_blocks[unique - 1] != journaled_blocks[i]) {
+            journaled_blocks[unique++] = journaled_blocks[i];
+        }
     }
+    num_journaled_blocks = unique;
+}
 
-    /*** VERY IMPORTANT: INIT FILE SYSTEM ***/
-    if (init_fs() != 0) {
-        fprintf(stderr, "Failed to initialize file system\n");
-        return 1;
+// Add the data blocks logged by one transaction to the set
+static int note_journaled_blocks(const io_batch_t* batch) {
+    for (int i = 0; i < batch->count; i++) {
+        const io_request_t* request = &batch->requests[i];
+        if (request->segment_type == DATA_SEGMENT && request->offset >= BLOCK_SIZE &&
+            add_journaled_block((block_id_t)request->segment_number * blocks_per_segment +
+                                (request->offset - BLOCK_SIZE) / BLOCK_SIZE) != 0) {
+            return -1;
+        }
+    }
+    sort_journaled_blocks();
+    return 0;
+}
+
+// Append one transaction holding every write of 'batch' and the revokes, and
+// sync the log
+static int journal_append(io_batch_t* batch, const block_id_t* revokes, int num_revokes, size_t size) {
+    uint8_t* txn = calloc(1, size);
+    if (!txn) return -1;
+
+    journal_txn_t* header = (journal_txn_t*)txn;
+    size_t used = sizeof(journal_txn_t);
+    for (int i = 0; i < batch->count; i++) {
+        io_request_t* request = &batch->requests[i];
+        journal_record_t* record = (journal_record_t*)(txn + used);
+        record->segment_type = request->segment_type;
+        record->segment_number = request->segment_number;
+        record->offset = request->offset;
+        record->length = request->length;
+        memcpy(txn + used + sizeof(journal_record_t), request->buffer, request->length);
+        used += sizeof(journal_record_t) + JOURNAL_PAD(request->length);
+    }
+    for (int i = 0; i < num_revokes; i++) {
+        journal_record_t* record = (journal_record_t*)(txn + used);
+        record->segment_type = JOURNAL_REVOKE;
+        record->offset = revokes[i];
+        used += sizeof(journal_record_t);
+    }
+
+    header->magic = JOURNAL_TXN_MAGIC;
+    header->num_records = batch->count + num_revokes;
+    header->sequence = journal_sequence;
+    header->length = size - sizeof(journal_txn_t);
+    header->checksum = journal_checksum(journal_sequence, txn + sizeof(journal_txn_t), header->length);
+
+    int result = (pwrite(journal_fd, txn, size, journal_tail) == (ssize_t)size &&
+                  fdatasync(journal_fd) == 0) ? 0 : -1;
+    stats_count(STAT_JOURNAL_BYTES, size);
+    free(txn);
+    return result;
+}
+
+// Log and write back the metadata changed since the last commit: freed data
+// blocks, dirty cached blocks, pending inodes and bitmaps. Everything goes
+// into one transaction and costs one fdatasync of the log; the segments are
+// written afterwards without syncing. Returns 0 when all of it was logged.
+int journal_commit(void) {
+    io_batch_t batch = {0};
+    block_id_t* revokes = NULL;
+    int num_revokes = 0;
+    int result = 0;
+    uint64_t started = stats_clock();
+
+    pthread_mutex_lock(&journal_lock);
+    stats_count(STAT_JOURNAL_COMMITS, 1);
+
+    // Blocks freed since the last commit become free in the same transaction
+    // as the metadata that stopped using them
+    pthread_mutex_lock(&block_allocator.lock);
+    int num_deferred = block_allocator.num_deferred;
+    if (num_deferred > 0) {
+        if (clear_units(&block_allocator, block_allocator.deferred, num_deferred) != 0) result = -1;
+        block_allocator.num_deferred = 0;
+
+        if (num_journaled_blocks > 0) {
+            revokes = malloc(num_journaled_blocks * sizeof(block_id_t));
+            for (int i = 0; revokes && i < num_deferred; i++) {
+                if ((i == 0 || block_allocator.deferred[i] != block_allocator.deferred[i - 1]) &&
+                    is_journaled(block_allocator.deferred[i])) {
+                    revokes[num_revokes++] = block_allocator.deferred[i];
+                }
+            }
+            // With no room for the revokes, retire the whole log instead
+            if (!revokes && journal_checkpoint() != 0) result = -1;
+        }
+    }
+    pthread_mutex_unlock(&block_allocator.lock);
+
+    if (block_cache_queue(&batch) != 0 || queue_pending_inodes(&batch) != 0 || queue_superblock(&batch) != 0 ||
+        queue_allocator(&inode_allocator, &batch) != 0 || queue_allocator(&block_allocator, &batch) != 0) {
+        result = -1;
+    }
+
+    size_t size = sizeof(journal_txn_t) + (size_t)num_revokes * sizeof(journal_record_t);
+    for (int i = 0; i < batch.count; i++) {
+        size += sizeof(journal_record_t) + JOURNAL_PAD(batch.requests[i].length);
+    }
+
+    if (batch.count > 0 || num_revokes > 0) {
+        int logged = 0;
+        if (journal_fd < 0 && journal_create() != 0) {
+            result = -1;
+        } else if (size > JOURNAL_SIZE - BLOCK_SIZE) {
+            // Too big for the log even when empty: retire the log, write the
+            // segments in place and sync them. A crash in between can leave
+            // them inconsistent.
+            if (journal_checkpoint() != 0) result = -1;
+        } else {
+            if (journal_tail + (off_t)size > JOURNAL_SIZE) {
+                if (journal_checkpoint() != 0) result = -1;
+                num_revokes = 0;    // The checkpoint retired every logged block
+                size = sizeof(journal_txn_t);
+                for (int i = 0; i < batch.count; i++) {
+                    size += sizeof(journal_record_t) + JOURNAL_PAD(batch.requests[i].length);
+                }
+            }
+            if (journal_append(&batch, revokes, num_revokes, size) == 0) {
+                logged = 1;
+            } else {
+                perror("Failed to write journal");
+                result = -1;
+            }
+        }
+
+        // A checkpoint drops every logged block, losing track of one drops them all
+        if (logged && note_journaled_blocks(&batch) != 0 && journal_checkpoint() != 0) result = -1;
+
+        // Whatever happened to the log, the segments still get the changes
+        if (io_batch_run(&batch) != 0) result = -1;
+        if (logged) {
+            journal_tail += size;
+            journal_sequence++;
+            if (journal_write_header() != 0) result = -1;
+        } else if (journal_fd >= 0 && journal_checkpoint() != 0) {
+            result = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&journal_lock);
+    io_batch_free(&batch);
+    free(revokes);
+    stats_time(STAT_TIME_JOURNAL_COMMIT, started);
+    return result;
+}
+
+typedef struct {
+    block_id_t block_id;
+    uint64_t sequence;
+} journal_revoke_t;
+
+static int compare_revokes(const void* a, const void* b) {
+    const journal_revoke_t* x = a;
+    const journal_revoke_t* y = b;
+    if (x->block_id != y->block_id) return (x->block_id > y->block_id) - (x->block_id < y->block_id);
+    return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+}
+
+// Latest transaction that revoked 'block_id', 0 if none did
+static uint64_t revoked_at(const journal_revoke_t* revokes, int count, block_id_t block_id) {
+    int low = 0, high = count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (revokes[middle].block_id <= block_id) low = middle + 1;
+        else high = middle;
     }
+    return (low > 0 && revokes[low - 1].block_id == block_id) ? revokes[low - 1].sequence : 0;
+}
 
-    if (strcmp(argv[1], "-l") == 0) {
-        exfs2_list();
-    } 
-    else if (strcmp(argv[1], "-a") == 0) {
-        if (argc != 5 || strcmp(argv[3], "-f") != 0) {
-            fprintf(stderr, "Usage: %s -a <exfs2_path> -f <local_file>\n", argv[0]);
-            return 1;
+// Check the records of a transaction body fit it exactly; returns 0 if they do
+static int check_records(const uint8_t* body, uint64_t length, uint32_t num_records) {
+    uint64_t used = 0;
+    for (uint32_t i = 0; i < num_records; i++) {
+        if (length - used < sizeof(journal_record_t)) return -1;
+        const journal_record_t* record = (const journal_record_t*)(body + used);
+        used += sizeof(journal_record_t);
+        if (record->segment_type == JOURNAL_REVOKE) continue;
+        if ((record->segment_type != INODE_SEGMENT && record->segment_type != DATA_SEGMENT) ||
+            record->segment_number < 0 || record->offset < 0 ||
+            record->offset + record->length > segment_size || length - used < JOURNAL_PAD(record->length)) {
+            return -1;
         }
-        exfs2_add(argv[2], argv[4]);
+        used += JOURNAL_PAD(record->length);
+    }
+    return used == length ? 0 : -1;
+}
+
+// Write the transactions the log holds to the segments. Called at startup,
+// before anything else reads them; the first torn or missing transaction ends
+// the log.
+int journal_replay(void) {
+    char filename[MAX_PATH + 16];
+    journal_filename(filename, sizeof(filename));
+    read_boot_id(journal_boot_id, sizeof(journal_boot_id));
+
+    journal_fd = open(filename, O_RDWR);
+    if (journal_fd < 0) {
+        if (errno == ENOENT) return 0;  // Created by the first commit
+        perror("Failed to open journal");
+        return -1;
     }
-    else if (strcmp(argv[1], "-r") == 0) {
-        if (argc != 3) {
-            fprintf(stderr, "Usage: %s -r <exfs2_path>\n", argv[0]);
-            return 1;
+
+    journal_header_t header;
+    if (pread(journal_fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != JOURNAL_MAGIC) {
+        // Its creation was cut short, so it never held a transaction
+        journal_first = journal_sequence = 1;
+        journal_tail = BLOCK_SIZE;
+        return journal_write_header();
+    }
+
+    // In the same boot, the transactions up to 'applied' are in the page cache
+    // already; with the logged blocks in the header they need not be read
+    int same_boot = journal_boot_id[0] != '\0' && strncmp(header.boot_id, journal_boot_id, sizeof(header.boot_id)) == 0;
+    int resume = same_boot && header.num_logged >= 0 && header.num_logged <= JOURNAL_HEADER_BLOCKS &&
+                 header.applied_tail >= BLOCK_SIZE && header.applied_tail <= JOURNAL_SIZE &&
+                 header.applied + 1 >= header.sequence;
+    off_t tail = resume ? (off_t)header.applied_tail : BLOCK_SIZE;
+    uint64_t sequence = resume ? header.applied + 1 : header.sequence;
+    int result = 0;
+
+    num_journaled_blocks = 0;
+    for (int i = 0; resume && i < header.num_logged; i++) {
+        if (add_journaled_block(header.logged[i]) != 0) result = -1;
+    }
+
+    // Pass 1: load every intact transaction from there and collect the revokes
+    uint8_t* log = NULL;
+    size_t log_length = 0, log_capacity = 0;
+    journal_revoke_t* revokes = NULL;
+    int num_revokes = 0, revoke_capacity = 0;
+
+    while (result == 0) {
+        journal_txn_t txn;
+        if (tail + (off_t)sizeof(txn) > JOURNAL_SIZE ||
+            pread(journal_fd, &txn, sizeof(txn), tail) != sizeof(txn) ||
+            txn.magic != JOURNAL_TXN_MAGIC || txn.sequence != sequence ||
+            txn.length % 8 != 0 || txn.length > (uint64_t)(JOURNAL_SIZE - tail - sizeof(txn))) {
+            break;
+        }
+
+        size_t txn_size = sizeof(txn) + txn.length;
+        if (log_length + txn_size > log_capacity) {
+            size_t new_capacity = log_capacity ? log_capacity * 2 : 65536;
+            while (new_capacity < log_length + txn_size) new_capacity *= 2;
+            uint8_t* grown = realloc(log, new_capacity);
+            if (!grown) {
+                result = -1;
+                break;
+            }
+            log = grown;
+            log_capacity = new_capacity;
+        }
+        uint8_t* body = log + log_length + sizeof(txn);
+        if (pread(journal_fd, body, txn.length, tail + sizeof(txn)) != (ssize_t)txn.length ||
+            journal_checksum(txn.sequence, body, txn.length) != txn.checksum ||
+            check_records(body, txn.length, txn.num_records) != 0) {
+            break;
+        }
+        memcpy(log + log_length, &txn, sizeof(txn));
+
+        for (size_t used = 0; used < txn.length; ) {
+            const journal_record_t* record = (const journal_record_t*)(body + used);
+            used += sizeof(journal_record_t);
+            if (record->segment_type != JOURNAL_REVOKE) {
+                used += JOURNAL_PAD(record->length);
+                continue;
+            }
+            if (num_revokes == revoke_capacity) {
+                int new_capacity = revoke_capacity ? revoke_capacity * 2 : 256;
+                journal_revoke_t* grown = realloc(revokes, new_capacity * sizeof(journal_revoke_t));
+                if (!grown) {
+                    result = -1;
+                    break;
+                }
+                revokes = grown;
+                revoke_capacity = new_capacity;
+            }
+            revokes[num_revokes].block_id = record->offset;
+            revokes[num_revokes++].sequence = txn.sequence;
         }
-        exfs2_remove(argv[2]);
+        if (result != 0) break;
+
+        log_length += txn_size;
+        tail += txn_size;
+        sequence++;
     }
-    else if (strcmp(argv[1], "-e") == 0) {
-        if (argc != 3) {
-            fprintf(stderr, "Usage: %s -e <exfs2_path>\n", argv[0]);
-            return 1;
+    qsort(revokes, num_revokes, sizeof(journal_revoke_t), compare_revokes);
+
+    // Pass 2: apply them in order, skipping any that reached the segments
+    // during this boot
+    int replayed = 0;
+    journal_first = header.sequence;
+    journal_sequence = sequence;
+
+    for (size_t at = 0; result == 0 && at < log_length; ) {
+        const journal_txn_t* txn = (const journal_txn_t*)(log + at);
+        const uint8_t* body = log + at + sizeof(journal_txn_t);
+        int apply = !same_boot || txn->sequence > header.applied;
+
+        for (size_t used = 0; used < txn->length; ) {
+            const journal_record_t* record = (const journal_record_t*)(body + used);
+            const uint8_t* data = body + used + sizeof(journal_record_t);
+            used += sizeof(journal_record_t);
+            if (record->segment_type == JOURNAL_REVOKE) continue;
+            used += JOURNAL_PAD(record->length);
+
+            if (record->segment_type == DATA_SEGMENT && record->offset >= BLOCK_SIZE) {
+                block_id_t block_id = (block_id_t)record->segment_number * blocks_per_segment +
+                                      (record->offset - BLOCK_SIZE) / BLOCK_SIZE;
+                if (revoked_at(revokes, num_revokes, block_id) >= txn->sequence) continue;
+                if (add_journaled_block(block_id) != 0) result = -1;
+            }
+            if (apply && segment_write(record->segment_number, record->segment_type, (void*)data,
+                                       record->length, record->offset) != 0) {
+                fprintf(stderr, "Failed to replay journal transaction %" PRIu64 "\n", txn->sequence);
+                result = -1;
+                break;
+            }
         }
-        exfs2_extract(argv[2]);
+
+        if (apply) replayed = 1;
+        at += sizeof(journal_txn_t) + txn->length;
+    }
+
+    sort_journaled_blocks();
+    journal_tail = tail;
+    free(log);
+    free(revokes);
+
+    if (result != 0) {
+        journal_close();
+        return -1;
+    }
+    return replayed ? journal_write_header() : 0;
+}
+
+// Bytes the next commit would log, to decide when a long command commits
+size_t journal_pending_bytes(void) {
+    pthread_mutex_lock(&block_cache_lock);
+    size_t bytes = (size_t)block_cache_dirty * BLOCK_SIZE;
+    pthread_mutex_unlock(&block_cache_lock);
+    pthread_mutex_lock(&metadata_cache_lock);
+    bytes += (size_t)num_pending_inodes * sizeof(inode_t);
+    pthread_mutex_unlock(&metadata_cache_lock);
+    return bytes;
+}
+
+// Close the log and forget which blocks it holds. Nothing is committed here:
+// changes not yet passed to journal_commit() stay out of the log.
+void journal_close(void) {
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd >= 0) close(journal_fd);
+    journal_fd = -1;
+    free(journaled_blocks);
+    journaled_blocks = NULL;
+    num_journaled_blocks = 0;
+    journaled_block_capacity = 0;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// Segment sizes a file system can be created with
+static int valid_segment_size(long long size) {
+    return size >= MIN_SEGMENT_SIZE && size <= MAX_SEGMENT_SIZE && (size & (size - 1)) == 0;
+}
+
+static void set_segment_size(off_t size) {
+    segment_size = size;
+    blocks_per_segment = (size - BLOCK_SIZE) / BLOCK_SIZE;
+}
+
+// Take the geometry of an existing file system from its superblock. It is read
+// straight from inode_seg_0, since the segment cache maps whole segments and
+// needs the size first.
+static int load_superblock(const char* filename) {
+    superblock_t superblock;
+    int fd = open(filename, O_RDONLY);
+    ssize_t got = fd >= 0 ? pread(fd, &superblock, sizeof(superblock), SUPERBLOCK_OFFSET) : -1;
+    if (fd >= 0) close(fd);
+
+    if (got != sizeof(superblock) || superblock.magic != SUPERBLOCK_MAGIC) {
+        fprintf(stderr, "Segment files use another on-disk format (no superblock, this build reads revision %#x)\n",
+                EXFS2_FORMAT_REVISION);
+        return -1;
+    }
+    if (superblock.revision < EXFS2_OLDEST_REVISION || superblock.revision > EXFS2_FORMAT_REVISION) {
+        fprintf(stderr, "Segment files use another on-disk format (revision %#x, this build reads %#x to %#x)\n",
+                superblock.revision, EXFS2_OLDEST_REVISION, EXFS2_FORMAT_REVISION);
+        return -1;
+    }
+    if (superblock.block_size != BLOCK_SIZE || !valid_segment_size((long long)superblock.segment_size)) {
+        fprintf(stderr, "Unsupported geometry: %" PRIu64 "-byte segments of %u-byte blocks\n",
+                superblock.segment_size, superblock.block_size);
+        return -1;
+    }
+
+    if (new_segment_size != 0 && new_segment_size != (off_t)superblock.segment_size) {
+        fprintf(stderr, "File system uses %" PRIu64 "-byte segments; the requested size only applies to new ones\n",
+                superblock.segment_size);
+    }
+    set_segment_size(superblock.segment_size);
+    pthread_mutex_lock(&superblock_lock);
+    fs_superblock = superblock;
+    superblock_dirty = 0;
+    pthread_mutex_unlock(&superblock_lock);
+    return 0;
+}
+
+// With dedup_files set, take over the saved fingerprint index. The file is
+// removed until shutdown saves the index again, so a crash cannot leave one
+// behind that misses the frees since. A new file system drops any old index.
+static void dedup_start(int new_fs) {
+    char filename[SEGMENT_NAME_MAX];
+    dedup_index_filename(filename, sizeof(filename));
+    if (new_fs) unlink(filename);
+    if (dedup_files) {
+        dedup_index_load(filename);
+        unlink(filename);
     }
-    else if (strcmp(argv[1], "-D") == 0) {
-        if (argc != 3) {
-            fprintf(stderr, "Usage: %s -D <exfs2_path>\n", argv[0]);
-            return 1;
+}
+
+// Create the first inode/data segments and root dir if they don’t exist yet.
+int init_fs() {
+    char filename[SEGMENT_NAME_MAX];
+    if (segment_filename(filename, sizeof(filename), 0, INODE_SEGMENT) != 0) return -1;
+
+    if (access(filename, F_OK) == 0) {
+        // inode_seg_0 already exists: its superblock gives the layout, then
+        // the last commits are finished
+        if (load_superblock(filename) != 0) return -1;
+        if (journal_replay() != 0) {
+            fprintf(stderr, "Failed to replay journal\n");
+            close_all_segments();
+            return -1;
+        }
+        inode_t root_inode;
+        if (read_inode(ROOT_DIR_INODE, &root_inode) != 0) {
+            fprintf(stderr, "Failed to read root inode\n");
+            close_all_segments();
+            metadata_cache_clear();
+            journal_close();
+            return -1;
         }
-        exfs2_debug(argv[2]);
+        dedup_start(0);
+        return 0;
+    }
+
+    // inode_seg_0 does not exist, create initial inode and data segments. A
+    // journal left from an earlier file system is replaced by the first commit.
+    off_t size = new_segment_size ? new_segment_size : DEFAULT_SEGMENT_SIZE;
+    if (!valid_segment_size(size)) {
+        fprintf(stderr, "Segment size must be a power of two from %d to %d bytes\n",
+                MIN_SEGMENT_SIZE, MAX_SEGMENT_SIZE);
+        return -1;
+    }
+    set_segment_size(size);
+    if (create_new_segment(0, INODE_SEGMENT) != 0) {
+        fprintf(stderr, "Failed to create inode segment 0\n");
+        return -1;
+    }
+    if (create_new_segment(0, DATA_SEGMENT) != 0) {
+        fprintf(stderr, "Failed to create data segment 0\n");
+        return -1;
     }
-    else {
-        printf("Unknown option: %s\n", argv[1]);
-        return 1;
+    if (journal_commit() != 0) {
+        fprintf(stderr, "Failed to commit the new file system\n");
+        return -1;
     }
+    dedup_start(1);
 
+    printf("Initialized new file system (root directory created).\n");
     return 0;
-}
\ No newline at end of file
+}
+
+// Commit what is left, save the fingerprint index, stop the precreator and
+// close the segments and the journal
+void shutdown_fs(void) {
+    int committed = journal_commit();
+    if (dedup_index_loaded()) {
+        char filename[SEGMENT_NAME_MAX];
+        dedup_index_filename(filename, sizeof(filename));
+        if (committed != 0 || dedup_index_save(filename) != 0) unlink(filename);
+        dedup_index_clear();
+    }
+    precreate_stop();
+    uring_shutdown();
+    close_all_segments();
+    journal_close();
+}
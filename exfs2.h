@@ -5,15 +5,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <errno.h>
+#include <pthread.h>
 
 /* Constants */
-#define SEGMENT_SIZE (1024 * 1024)  /* 1MB segment size */
+#define DEFAULT_SEGMENT_SIZE (1024 * 1024)  /* 1MB segments unless chosen otherwise at init */
+#define MIN_SEGMENT_SIZE (1024 * 1024)
+#define MAX_SEGMENT_SIZE (64 * 1024 * 1024)
 #define BLOCK_SIZE 4096            /* 4KB block size */
 #define MAX_FILENAME 256
 #define MAX_PATH 1024
@@ -27,68 +33,587 @@
 #define INODE_FILE 1
 #define INODE_DIR 2
 
+/* Inode flags */
+#define INODE_FLAG_HASHED_DIR 0x1  /* directory blocks are hash buckets */
+#define INODE_FLAG_INLINE 0x2      /* file data is held in the inode, no blocks */
+#define INODE_FLAG_COMPRESSED 0x4  /* file data is stored in compressed clusters */
+
 #define ROOT_DIR_INODE 0
-#define MAX_DIRECT_BLOCKS 1017
+#define MAX_DIRECT_BLOCKS 506        /* fills the inode to exactly BLOCK_SIZE */
+#define INODE_INLINE_MAX (MAX_DIRECT_BLOCKS * (int)sizeof(block_id_t)) /* largest inline file */
+
+/* On-disk layout revision, recorded in the superblock and stamped into every
+ * inode written. Revision 2 moved block addresses to 64 bits, revision 3 made
+ * an inode exactly one block, revision 4 added the superblock, revision 5
+ * stores small files inside their inode, revision 6 compressed files,
+ * revision 7 shared data blocks. Revisions 5 to 7 only add features an image
+ * need not use, so a new image starts at revision 4 and is raised to a
+ * feature's revision when the feature is first stored. Images older than
+ * revision 4 are refused. */
+#define EXFS2_REVISION(n) (0x45580000u | (n))  /* "EX" n */
+#define EXFS2_OLDEST_REVISION EXFS2_REVISION(4)
+#define EXFS2_INLINE_REVISION EXFS2_REVISION(5)
+#define EXFS2_COMPRESSED_REVISION EXFS2_REVISION(6)
+#define EXFS2_SHARED_REVISION EXFS2_REVISION(7)
+#define EXFS2_FORMAT_REVISION EXFS2_SHARED_REVISION  /* newest this build writes */
+
+/* Superblock: the last 512 bytes of inode_seg_0's bitmap block, written once
+ * when the file system is created. Segment size is chosen then; this build
+ * only reads images with its own BLOCK_SIZE. */
+#define SUPERBLOCK_MAGIC 0x53584533u       /* "3EXS" */
+#define SUPERBLOCK_OFFSET (BLOCK_SIZE - 512)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t revision;          /* EXFS2_OLDEST_REVISION to EXFS2_FORMAT_REVISION */
+    uint64_t segment_size;      /* bytes per segment file, a power of two */
+    uint32_t block_size;
+    uint32_t reserved;
+} superblock_t;
+
+_Static_assert((MAX_SEGMENT_SIZE / BLOCK_SIZE + 7) / 8 <= SUPERBLOCK_OFFSET,
+               "the largest bitmap must end before the superblock");
+
+/* Shared data blocks: a data segment's bitmap block continues, at
+ * BLOCK_REFS_OFFSET, with a table of the blocks more than one file points to.
+ * An entry counts the references beyond the first; a block without one has
+ * a single owner. Entries are sorted by block index. */
+#define BLOCK_REFS_OFFSET ((MAX_SEGMENT_SIZE / BLOCK_SIZE + 7) / 8)
+
+typedef struct {
+    uint16_t index;             /* block index in the segment */
+    uint16_t extra;             /* references beyond the first */
+} block_ref_t;
+
+#define MAX_BLOCK_REFS ((BLOCK_SIZE - BLOCK_REFS_OFFSET - sizeof(uint32_t)) / sizeof(block_ref_t))
+
+typedef struct {
+    uint32_t count;
+    block_ref_t refs[MAX_BLOCK_REFS];
+} block_refs_t;
+
+_Static_assert(BLOCK_REFS_OFFSET + sizeof(block_refs_t) <= BLOCK_SIZE,
+               "the shared block table must fit in the bitmap block");
+_Static_assert(MAX_SEGMENT_SIZE / BLOCK_SIZE <= UINT16_MAX, "block indices must fit a block_ref_t");
 
 #define INODE_SEG_PREFIX "inode_seg_"
 #define DATA_SEG_PREFIX "data_seg_"
+#define SEGMENT_NAME_MAX (MAX_PATH + 32) /* directory, '/', prefix and number */
+#define JOURNAL_FILE "journal"
+#define DEDUP_INDEX_FILE "dedup_index"
+
+/* Metadata journal: a log file next to the segments. Each commit appends one
+ * transaction with the bitmaps, inodes and cached blocks changed since the
+ * last one, syncs the log once, and only then writes them to the segments.
+ * File data goes to its blocks directly and is not synced. The log is
+ * replayed at startup and checkpointed (syncfs, then emptied) when full;
+ * transactions already written to the segments during the current boot are
+ * not replayed again. */
+#define JOURNAL_MAGIC 0x4A584533u          /* "3EXJ" */
+#define JOURNAL_TXN_MAGIC 0x54584533u      /* "3EXT" */
+#define JOURNAL_SIZE (1024 * 1024)
+#define JOURNAL_GROUP_BYTES (JOURNAL_SIZE / 4) /* pending changes that make -A commit between files */
+#define JOURNAL_REVOKE -1                  /* record type: older logged copies of a block are stale */
+
+#define JOURNAL_HEADER_BLOCKS 503       /* logged data blocks the header can list */
+
+/* The first block of the log. Its list of logged data blocks lets a start in
+ * the same boot skip the transactions already applied; -1 if it did not fit. */
+typedef struct {
+    uint32_t magic;
+    int32_t num_logged;
+    uint64_t sequence;          /* sequence number of the first transaction in the log */
+    uint64_t applied;           /* last transaction written to the segments ... */
+    uint64_t applied_tail;      /* ... where the one after it goes ... */
+    char boot_id[40];           /* ... during this boot (kernel boot_id) */
+    int64_t logged[JOURNAL_HEADER_BLOCKS];
+} journal_header_t;
+
+_Static_assert(sizeof(journal_header_t) == BLOCK_SIZE, "the journal header must fill exactly one block");
+
+typedef struct {
+    uint32_t magic;
+    uint32_t num_records;
+    uint64_t sequence;
+    uint64_t length;            /* bytes of records after this header */
+    uint64_t checksum;          /* FNV-1a over the records' 64-bit words, seeded with the sequence */
+} journal_txn_t;
+
+/* One logged write, followed by 'length' bytes padded to 8. A revoke names the
+ * block in 'offset'. */
+typedef struct {
+    int32_t segment_type;       /* INODE_SEGMENT, DATA_SEGMENT or JOURNAL_REVOKE */
+    int32_t segment_number;
+    int64_t offset;             /* byte offset inside the segment */
+    uint32_t length;
+    uint32_t reserved;
+} journal_record_t;
+
+#define SEGMENT_CACHE_SIZE 64      /* max segment descriptors kept open */
+#define DEFAULT_PRECREATE_SEGMENTS 0 /* empty segments kept ahead of the allocators */
+
+/* Segment I/O backends */
+#define SEGMENT_IO_PREAD 0         /* pread/pwrite on the segment descriptor */
+#define SEGMENT_IO_MMAP 1          /* memcpy into a shared mapping of the segment */
+#ifndef EXFS2_DEFAULT_IO
+#define EXFS2_DEFAULT_IO SEGMENT_IO_PREAD
+#endif
+#define POINTERS_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(block_id_t)))
+#define EXTENT_SCAN_SEGMENTS 16    /* segments searched for a contiguous run */
 
 /* Structures */
+
+/* Data block address: segment number * blocks_per_segment + index in the segment.
+ * Pointer blocks hold POINTERS_PER_BLOCK of them, 0 ending the used slots; data
+ * block 0 is reserved and never allocated, so no slot can name it. Images that
+ * predate the reservation may still have a file holding it, but only in a
+ * direct slot. */
+typedef int64_t block_id_t;
+
+#define RESERVED_DATA_BLOCK 0      /* stays marked used in data segment 0 */
+
 typedef struct {
     int type;                    /* 0: free, 1: file, 2: directory */
-    size_t size;                 /* size in bytes */
+    int flags;                   /* INODE_FLAG_* bits */
+    uint64_t size;               /* size in bytes */
     int num_direct;              /* number of direct blocks in use */
-    int direct_blocks[MAX_DIRECT_BLOCKS]; /* direct block pointers */
-    int indirect_block;          /* single indirect block pointer */
-    int double_indirect_block;   /* double indirect block pointer */
-    int triple_indirect_block;   /* triple indirect block pointer */
+    uint32_t revision;           /* the file system's revision when it was written */
+    union {
+        block_id_t direct_blocks[MAX_DIRECT_BLOCKS]; /* direct block pointers */
+        char inline_data[INODE_INLINE_MAX];          /* contents, with INODE_FLAG_INLINE */
+    };
+    block_id_t indirect_block;          /* single indirect block pointer */
+    block_id_t double_indirect_block;   /* double indirect block pointer */
+    block_id_t triple_indirect_block;   /* triple indirect block pointer */
 } inode_t;
 
+_Static_assert(sizeof(inode_t) == BLOCK_SIZE, "an inode must fill exactly one block");
+
+/* Legacy linear directories (no INODE_FLAG_HASHED_DIR): direct blocks of
+ * fixed-size entries. They are still read, but no longer written. */
 typedef struct {
     char name[MAX_FILENAME];     /* filename */
     int inode_num;               /* inode number (-1 if free entry) */
 } dir_entry_t;
 
+/* Hashed directories: logical block i of the directory is bucket i (linear
+ * hashing) and size counts bucket blocks only; a bucket that fills up chains
+ * overflow blocks through next_block */
+#define DIR_BLOCK_MAGIC 0x50524944u   /* "DIRP" */
+
+typedef struct {
+    uint32_t magic;              /* DIR_BLOCK_MAGIC */
+    uint32_t count;              /* used entries in this block */
+    block_id_t next_block;       /* overflow block of this bucket, -1 if none */
+} dir_block_header_t;
+
+/* Packed entry record (ext4 style): rec_len spans up to the next record, so the
+ * records of a block always cover it to the end and free space is the slack
+ * after a record's name */
+typedef struct {
+    uint32_t hash;               /* dir_name_hash(name) */
+    int32_t inode_num;           /* inode number (-1 if free record) */
+    uint16_t rec_len;            /* bytes from this record to the next */
+    uint8_t name_len;            /* name bytes, not NUL terminated */
+    uint8_t file_type;           /* INODE_FILE or INODE_DIR of the child, 0 if not recorded */
+    char name[];
+} dir_record_t;
+
+#define DIR_RECORDS_OFFSET ((int)sizeof(dir_block_header_t))
+#define DIR_RECORD_ALIGN 4
+#define DIR_RECORD_LEN(name_len) \
+    ((sizeof(dir_record_t) + (name_len) + DIR_RECORD_ALIGN - 1) & ~(size_t)(DIR_RECORD_ALIGN - 1))
+
+typedef struct {
+    dir_block_header_t header;
+    uint8_t records[BLOCK_SIZE - sizeof(dir_block_header_t)];
+} hashed_dir_block_t;
+
+#define DIR_MAX_RECORDS_PER_BLOCK ((int)((BLOCK_SIZE - DIR_RECORDS_OFFSET) / DIR_RECORD_LEN(1)))
+
+/* Unpacked entry, used while a bucket is being rehashed */
+typedef struct {
+    uint32_t hash;
+    int32_t inode_num;
+    int file_type;
+    char name[MAX_FILENAME];
+} hashed_entry_t;
+
+/* Directory walk callback; type is the child's INODE_FILE/INODE_DIR as recorded
+ * in its entry, or INODE_FREE when the entry does not say (read the inode) */
+typedef int (*dir_visit_fn)(const char* name, int inode_num, int type, void* ctx);
+
+/* Parallel tree walks (listing, recursive remove). Every directory is a task;
+ * a worker pushes the subdirectories it finds onto its own deque and pops the
+ * newest, idle workers steal the oldest task of another worker. */
+typedef struct tree_walk tree_walk_t;
+typedef void (*walk_dir_fn)(tree_walk_t* walk, int worker, int inode_num, void* item);
+
+/* Metadata caches behind read_inode() and lookup_entry(), both direct mapped */
+#define INODE_CACHE_SIZE 64        /* inodes kept in memory */
+#define DENTRY_CACHE_SIZE 1024     /* (directory, name) lookups remembered */
+#define INODE_BATCH_SIZE 64        /* inodes fetched per read_inodes() call when listing */
+
+/* Write-back cache under read_block()/write_block(), so directory and pointer
+ * blocks touched repeatedly by one command stay in memory until the journal
+ * commits them. Reads around the cache see its dirty copies laid over what
+ * they read, and writes around it drop the copies they overwrite. */
+#define BLOCK_CACHE_SIZE 512       /* cached 4 KB blocks (2 MB) */
+#define BLOCK_CACHE_BUCKETS 1024   /* hash index, a power of two */
+#define BLOCK_CACHE_HASH(id) ((int)(((uint64_t)(id) * 11400714819323198485ull) >> 54))
+
+typedef struct {
+    block_id_t block_id;        /* -1 if the slot is empty */
+    int next;                   /* next slot in the same hash bucket, -1 ends the chain */
+    int referenced;             /* CLOCK bit, set on every use */
+    int dirty;                  /* newer than the copy in the segment */
+    uint8_t data[BLOCK_SIZE];
+} cached_block_t;
+
+typedef struct {
+    int in_use;                 /* slot holds a valid inode */
+    int inode_num;
+    inode_t inode;
+} cached_inode_t;
+
+/* Inodes written since the last commit, held until journal_commit() logs them */
+#define PENDING_INODE_BUCKETS 256
+
+typedef struct {
+    int inode_num;
+    int next;                   /* next pending inode in the same bucket, -1 ends the chain */
+    inode_t inode;
+} pending_inode_t;
+
+typedef struct {
+    int in_use;                 /* slot holds a valid lookup */
+    int parent;                 /* directory inode number */
+    int child;                  /* inode number the name resolves to, -1 if absent */
+    uint32_t hash;              /* dir_name_hash(name) */
+    char name[MAX_FILENAME];
+} dentry_t;
+
+typedef struct {
+    int segment_number;
+    int segment_type;           /* INODE_SEGMENT or DATA_SEGMENT */
+    int fd;                     /* open read/write descriptor */
+    uint8_t* map;               /* shared mapping in SEGMENT_IO_MMAP mode, else NULL */
+    int dirty;                  /* mapping written since it was opened */
+    int refs;                   /* users currently pinning the handle */
+    int in_use;                 /* slot holds an open segment */
+    unsigned long last_used;    /* LRU clock value of the last access */
+} segment_handle_t;
+
+typedef struct {
+    uint8_t* bitmap;            /* in-memory copy of the segment bitmap, NULL until loaded */
+    int free_count;             /* free units left in this segment */
+    int dirty;                  /* bitmap changed since the last flush */
+    block_refs_t* refs;         /* data segments: shared block table, NULL while empty */
+    int refs_dirty;             /* refs changed since the last flush */
+    uint8_t* deferred;          /* units freed but held until the next commit, NULL until one is */
+} segment_alloc_t;
+
+typedef struct {
+    int segment_type;           /* INODE_SEGMENT or DATA_SEGMENT */
+    int units;                  /* inodes or blocks per segment */
+    segment_alloc_t* segments;  /* indexed by segment number */
+    int num_segments;           /* capacity of the segments array */
+    int cursor;                 /* every segment below the cursor is full */
+    pthread_mutex_t lock;       /* parallel tree walks free from several threads */
+    int defer_frees;            /* freed units stay taken until the next journal commit */
+    int64_t* deferred;          /* units freed since then */
+    int num_deferred;
+    int deferred_capacity;
+} allocator_t;
+
+typedef struct {
+    block_id_t* blocks;         /* physical data block ids in logical order */
+    int count;
+    int capacity;
+} block_map_t;
+
+/* Read-ahead extraction */
+#define READAHEAD_RUN_BLOCKS 64    /* max blocks per read request (256 KB) */
+#define DEFAULT_EXTRACT_THREADS 4
+#define DEFAULT_EXTRACT_WINDOW 16
+#define INGEST_PRELOAD_MAX ((off_t)DEFAULT_SEGMENT_SIZE - BLOCK_SIZE) /* larger -A files are streamed */
+
+/* Ways send_blocks() can move file data to an output descriptor */
+#define SEND_COPY_FILE_RANGE 0     /* in-kernel copy, regular file output */
+#define SEND_SENDFILE 1            /* in-kernel copy, sockets and pipes */
+#define SEND_BUFFERED 2            /* read into a buffer and write() it */
+
+/* I/O engines behind io_batch_submit() */
+#define IO_ENGINE_SYNC 0           /* requests run one by one */
+#define IO_ENGINE_URING 1          /* requests submitted together through io_uring */
+#ifndef EXFS2_DEFAULT_ENGINE
+#define EXFS2_DEFAULT_ENGINE IO_ENGINE_SYNC
+#endif
+#define URING_ENTRIES 64           /* submission queue depth */
+#define MAP_BATCH_BLOCKS 256       /* pointer blocks read per batch by build_block_map */
+
+typedef struct {
+    int segment_number;
+    int segment_type;
+    void* buffer;
+    size_t length;
+    off_t offset;               /* byte offset inside the segment */
+    int is_write;
+    int owned;                  /* buffer is a private copy freed with the batch */
+    int result;                 /* 0 once the transfer completed in full */
+} io_request_t;
+
+typedef struct {
+    io_request_t* requests;
+    int count;
+    int capacity;
+} io_batch_t;
+
+typedef struct {
+    inode_t* inode;             /* inode whose pointer tree is being built */
+    io_batch_t* batch;          /* where completed pointer blocks are queued, or NULL */
+    long long total_blocks;     /* data blocks mapped so far */
+    int depth;                  /* depth of the open tree: 1 indirect, 2 double, 3 triple */
+    block_id_t node_ids[3];     /* block ids of the open pointer block at each level */
+    block_id_t nodes[3][POINTERS_PER_BLOCK]; /* pointer blocks being filled, root first */
+    block_map_t* taken;         /* if set, every block added or allocated is noted here */
+} pointer_builder_t;
+
 /* Basic segment operations */
-FILE* open_segment(int segment_number, int segment_type, const char* mode);
+int open_segment(int segment_number, int segment_type);
 int create_new_segment(int segment_number, int segment_type);
+segment_handle_t* acquire_segment(int segment_number, int segment_type);
+void release_segment(segment_handle_t* handle);
+int segment_read(int segment_number, int segment_type, void* buffer, size_t length, off_t offset);
+int segment_write(int segment_number, int segment_type, const void* buffer, size_t length, off_t offset);
+void close_all_segments(void);
+extern int segment_io_mode;
+
+/* Geometry of the open file system, from its superblock. new_segment_size is
+ * used when init_fs() creates one (0: DEFAULT_SEGMENT_SIZE). */
+extern off_t segment_size;
+extern int blocks_per_segment;  /* data blocks after the bitmap block */
+extern off_t new_segment_size;
+extern int precreate_segments;
+
+/* Batched I/O */
+int io_batch_read_blocks(io_batch_t* batch, block_id_t first_block, int count, void* buffer);
+int io_batch_write_blocks(io_batch_t* batch, block_id_t first_block, int count, void* buffer);
+int io_batch_write_copy(io_batch_t* batch, int segment_number, int segment_type,
+                        const void* data, size_t length, off_t offset);
+int io_batch_submit(io_batch_t* batch);
+void io_batch_free(io_batch_t* batch);
+extern int io_engine_mode;
 
 /* Bitmap operations */
-int read_bitmap(FILE* fp, uint8_t* bitmap, int size);
-int write_bitmap(FILE* fp, uint8_t* bitmap, int size);
+int read_bitmap(int segment_number, int segment_type, uint8_t* bitmap, int size);
+int write_bitmap(int segment_number, int segment_type, uint8_t* bitmap, int size);
 int find_free_bit(uint8_t* bitmap, int num_bits);
+int find_free_run(uint8_t* bitmap, int num_bits, int want, int* run_length);
+int count_free_bits(uint8_t* bitmap, int num_bits);
 void set_bit(uint8_t* bitmap, int bit);
 void clear_bit(uint8_t* bitmap, int bit);
 
+/* Journal */
+int journal_replay(void);
+int journal_commit(void);
+size_t journal_pending_bytes(void);
+void journal_close(void);
+
 /* Inode operations */
 int allocate_inode();
 int read_inode(int inode_num, inode_t* out_inode);
+int read_inodes(const int* inode_nums, int count, inode_t* out_inodes);
 int write_inode(int inode_num, inode_t* in_inode);
 int free_inode(int inode_num);
 
 /* Block operations */
-int allocate_block();
-int read_block(int block_id, void* buffer);
-int write_block(int block_id, void* buffer);
-int free_block(int block_id);
+block_id_t allocate_block();
+block_id_t allocate_extent(int want, int* count);
+int read_block(block_id_t block_id, void* buffer);
+int write_block(block_id_t block_id, void* buffer);
+int read_blocks(block_id_t first_block, int count, void* buffer);
+int write_blocks(block_id_t first_block, int count, void* buffer);
+int free_block(block_id_t block_id);
+int free_blocks(block_id_t* block_ids, int count);
+int repair_block_bit(block_id_t block_id, int used);
+int repair_block_refs(block_id_t block_id, int extra);
+
+/* Pointer tree construction */
+void pointer_builder_init(pointer_builder_t* builder, inode_t* inode, io_batch_t* batch);
+int pointer_builder_add(pointer_builder_t* builder, block_id_t block_id);
+int pointer_builder_finish(pointer_builder_t* builder);
+
+/* Block maps */
+block_id_t inode_block_at(inode_t* inode, long long logical);
+int inode_set_block(inode_t* inode, long long logical, block_id_t block_id);
+int build_block_map(inode_t* inode, block_map_t* map);
+int build_range_map(inode_t* inode, long long first, long long count, block_map_t* map);
+int collect_owned_blocks(inode_t* inode, block_map_t* data, block_map_t* nodes);
+void free_block_map(block_map_t* map);
+int send_blocks(block_id_t first_block, size_t skip, size_t length, int out_fd, int* method);
+int extract_readahead(block_map_t* map, size_t skip, size_t size, int out_fd, int threads, int window);
+extern int extract_threads;
+extern int extract_window;
 
 /* Directory operations */
 #define DIR_ENTRIES_PER_BLOCK ((unsigned int)(BLOCK_SIZE / sizeof(dir_entry_t)))
-int load_directory_entries(int block_id, dir_entry_t* entries);
-int save_directory_entries(int block_id, dir_entry_t* entries);
+int load_directory_entries(block_id_t block_id, dir_entry_t* entries);
 int find_entry_in_dir(inode_t* dir_inode, const char* name);
-int add_entry_to_dir(inode_t* dir_inode, int dir_inode_num, const char* name, int child_inode_num);
+int add_entry_to_dir(inode_t* dir_inode, int dir_inode_num, const char* name, int child_inode_num, int child_type);
+int remove_entry_from_dir(inode_t* dir_inode, int dir_inode_num, const char* name);
+int iterate_dir(inode_t* dir_inode, dir_visit_fn visit, void* ctx);
+tree_walk_t* tree_walk_start(int root_inode, void* root_item, walk_dir_fn visit, void* ctx, int threads);
+void tree_walk_spawn(tree_walk_t* walk, int worker, int inode_num, void* item);
+void* tree_walk_context(tree_walk_t* walk);
+void tree_walk_finish(tree_walk_t* walk);
+int free_dir_blocks(inode_t* dir_inode);
+uint32_t dir_name_hash(const char* name);
+
+/* Path lookup */
+int lookup_entry(int dir_inode_num, const char* name);
+int resolve_path(char parts[][MAX_FILENAME], int count, int* failed_at);
 
 /* Main command functions */
 void exfs2_init();
 void exfs2_add(const char* exfs2_path, const char* local_file);
-void exfs2_list();
+void exfs2_add_batch(const char* target, const char* local_dir);
+void exfs2_list(int show_sizes);
+void exfs2_list_recursive(int inode_num, int depth, int show_sizes);
 void exfs2_remove(const char* exfs2_path);
+int exfs2_remove_recursive(int inode_num);
 void exfs2_extract(const char* exfs2_path);
+void exfs2_extract_range(const char* exfs2_path, off_t offset, off_t length);
 void exfs2_debug(const char* exfs2_path);
 
+/* Library API: a handle on the segment files of one directory. Caches and
+ * allocators are process-wide, so one file system is open at a time. */
+typedef struct {
+    char directory[MAX_PATH];   /* where the segment files live */
+} exfs2_fs_t;
+
+typedef struct {
+    int inode_num;
+    int type;                   /* INODE_FILE or INODE_DIR */
+    size_t size;                /* bytes of a file, BLOCK_SIZE per bucket of a directory */
+} exfs2_stat_t;
+
+exfs2_fs_t* exfs2_open(const char* directory);
+int exfs2_lookup(exfs2_fs_t* fs, const char* path, exfs2_stat_t* st);
+ssize_t exfs2_read(exfs2_fs_t* fs, const char* path, void* buffer, size_t length, off_t offset);
+int exfs2_write(exfs2_fs_t* fs, const char* path, const void* data, size_t length);
+int exfs2_unlink(exfs2_fs_t* fs, const char* path);
+int exfs2_readdir(exfs2_fs_t* fs, const char* path, dir_visit_fn visit, void* ctx);
+int exfs2_sync(exfs2_fs_t* fs);
+void exfs2_close(exfs2_fs_t* fs);
+
+/* Statistics (stats.c): event counters kept per thread and summed when they
+ * are read, so counting takes no lock. With stats_timing set, the timed
+ * operations also record their latencies in power-of-two histograms. */
+typedef enum {
+    STAT_SEGMENT_OPENS,         /* segment files opened */
+    STAT_SEGMENT_CACHE_HITS,    /* segment lookups answered by an open handle */
+    STAT_SEGMENT_CREATES,
+    STAT_SEGMENT_READS,
+    STAT_SEGMENT_READ_BYTES,
+    STAT_SEGMENT_WRITES,
+    STAT_SEGMENT_WRITE_BYTES,
+    STAT_BITMAP_READS,
+    STAT_BITMAP_WRITES,         /* written in place or queued by a commit */
+    STAT_ALLOC_SEGMENT_LOADS,   /* segment bitmaps an allocator read in */
+    STAT_ALLOC_SEGMENT_SCANS,   /* segments an allocation looked at */
+    STAT_INODE_ALLOCS,
+    STAT_INODE_FREES,
+    STAT_INODE_READS,
+    STAT_INODE_CACHE_HITS,      /* reads answered by the cache or an uncommitted inode */
+    STAT_INODE_WRITES,
+    STAT_BLOCK_ALLOCS,
+    STAT_BLOCK_FREES,
+    STAT_BLOCK_SHARES,          /* references deduplication took on stored blocks */
+    STAT_BLOCK_READS,           /* data blocks, read alone, in runs or in batches */
+    STAT_BLOCK_CACHE_HITS,
+    STAT_BLOCK_WRITES,
+    STAT_BATCH_SUBMITS,
+    STAT_BATCH_REQUESTS,
+    STAT_DIR_LOOKUPS,
+    STAT_DENTRY_CACHE_HITS,
+    STAT_DIR_ADDS,
+    STAT_DIR_REMOVES,
+    STAT_DIR_SPLITS,            /* hashed directory buckets split */
+    STAT_JOURNAL_COMMITS,
+    STAT_JOURNAL_BYTES,         /* transaction bytes appended to the log */
+    STAT_COUNTERS
+} stat_counter_t;
+
+typedef enum {
+    STAT_TIME_SEGMENT_OPEN,
+    STAT_TIME_SEGMENT_CREATE,
+    STAT_TIME_SEGMENT_READ,
+    STAT_TIME_SEGMENT_WRITE,
+    STAT_TIME_BATCH_SUBMIT,
+    STAT_TIME_DIR_LOOKUP,
+    STAT_TIME_DIR_ADD,
+    STAT_TIME_DIR_REMOVE,
+    STAT_TIME_JOURNAL_COMMIT,
+    STAT_TIMERS
+} stat_timer_t;
+
+#define STATS_TIMER_BUCKETS 40     /* bucket b counts latencies below 2^b ns */
+
+void stats_count(stat_counter_t counter, uint64_t n);
+uint64_t stats_clock(void);
+void stats_time(stat_timer_t timer, uint64_t started);
+void stats_read_counters(uint64_t* counters);
+const char* stats_counter_name(stat_counter_t counter);
+int stats_dump(FILE* out);
+extern int stats_timing;
+
+/* Compression (compress.c): an LZ77 codec in the LZ4 block format. Files added
+ * while compress_files is set are stored in clusters of COMPRESS_CLUSTER_BLOCKS
+ * logical blocks. A cluster that packs into fewer blocks starts with a
+ * cluster_header_t, keeps its blocks in its first pointer slots and marks the
+ * slots it saved COMPRESSED_SLOT; any other cluster is stored as it is. */
+#define COMPRESS_CLUSTER_BLOCKS 16
+#define COMPRESS_CLUSTER_SIZE (COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE)
+#define COMPRESS_EXTRACT_CLUSTERS 16   /* clusters -e decodes per write */
+#define COMPRESSED_SLOT ((block_id_t)-2)
+
+typedef struct {
+    uint32_t length;            /* compressed bytes after this header */
+    uint32_t raw_length;        /* bytes they decode to, the cluster's blocks */
+} cluster_header_t;
+
+size_t lz_compress(const void* src, size_t length, void* dst, size_t capacity);
+ssize_t lz_decompress(const void* src, size_t length, void* dst, size_t capacity);
+extern int compress_files;
+
+/* Deduplication (dedup.c): with dedup_files set, a new data block that equals
+ * a stored one, by fingerprint and then by contents, takes another reference
+ * on it instead. The fingerprint index is kept in DEDUP_INDEX_FILE while the
+ * file system is closed; it is a hint, so losing it only loses matches. */
+uint64_t dedup_fingerprint(const void* block);
+int dedup_index_load(const char* filename);
+int dedup_index_save(const char* filename);
+int dedup_index_loaded(void);
+block_id_t dedup_index_find(uint64_t fingerprint);
+void dedup_index_add(uint64_t fingerprint, block_id_t block_id);
+void dedup_index_forget(const block_id_t* block_ids, int count);
+void dedup_index_clear(void);
+extern int dedup_files;
+
+/* Consistency check (check.c): compares what every inode holds with the
+ * segment bitmaps and shared block tables, and optionally repairs them */
+int exfs2_check(int repair);
+
+/* Server mode (server.c): one request at a time over a Unix socket */
+#define SERVER_BACKLOG 16
+#define SERVER_IO_CHUNK (1024 * 1024)  /* READ replies are streamed in chunks this big */
+int exfs2_serve(exfs2_fs_t* fs, const char* socket_path);
+
 /* Utility functions */
 int split_path(const char* path, char parts[][MAX_FILENAME], int* count);
 int create_directories_for_path(const char* path);
+int init_fs();
+void shutdown_fs(void);
 
 #endif /* EXFS2_H */
\ No newline at end of file
@@ -0,0 +1,203 @@
+/* main.c - Command line front end of the ExFS2 File System */
+#include "exfs2.h"
+
+// Parse a non-negative byte count; returns -1 if 'text' is not one
+static long long parse_bytes(const char* text) {
+    char* end;
+    errno = 0;
+    long long value = strtoll(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || value < 0) return -1;
+    return value;
+}
+
+// Parse a size in bytes with an optional K or M suffix; returns -1 if 'text' is not one
+static long long parse_size(const char* text) {
+    char* end;
+    errno = 0;
+    long long value = strtoll(text, &end, 10);
+    if (errno != 0 || end == text || value < 0) return -1;
+    if (*end == 'K' || *end == 'k') {
+        value *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        value *= 1024 * 1024;
+        end++;
+    }
+    return *end == '\0' ? value : -1;
+}
+
+// Dumped once the file system is shut down, so the last commit is counted
+static void print_stats(void) {
+    stats_dump(stderr);
+}
+
+int main(int argc, char* argv[]) {
+    int show_stats = 0;
+
+    // Global options come before the command
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--mmap") == 0) {
+            segment_io_mode = SEGMENT_IO_MMAP;
+        } else if (strcmp(argv[1], "--pread") == 0) {
+            segment_io_mode = SEGMENT_IO_PREAD;
+        } else if (strcmp(argv[1], "--uring") == 0) {
+            io_engine_mode = IO_ENGINE_URING;
+        } else if (strcmp(argv[1], "--sync-io") == 0) {
+            io_engine_mode = IO_ENGINE_SYNC;
+        } else if (strcmp(argv[1], "--threads") == 0 && argc > 2) {
+            extract_threads = atoi(argv[2]);
+            argv[2] = argv[0];
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--readahead") == 0 && argc > 2) {
+            extract_window = atoi(argv[2]);
+            argv[2] = argv[0];
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--segment-size") == 0 && argc > 2) {
+            long long size = parse_size(argv[2]);
+            if (size <= 0) {
+                fprintf(stderr, "Invalid segment size: %s\n", argv[2]);
+                return 1;
+            }
+            new_segment_size = size;
+            argv[2] = argv[0];
+            argv++;
+            argc--;
+        } else if (strcmp(argv[1], "--compress") == 0) {
+            compress_files = 1;
+        } else if (strcmp(argv[1], "--dedup") == 0) {
+            dedup_files = 1;
+        } else if (strcmp(argv[1], "--stats") == 0) {
+            show_stats = 1;
+            stats_timing = 1;
+        } else if (strcmp(argv[1], "--precreate") == 0 && argc > 2) {
+            precreate_segments = atoi(argv[2]);
+            argv[2] = argv[0];
+            argv++;
+            argc--;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[1]);
+            return 1;
+        }
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
+    if (argc < 2) {
+        printf("Usage:\n");
+        printf("  -l                  List the file system contents\n");
+        printf("  -l --long           List with the size of every file in bytes\n");
+        printf("  -a <exfs2_path> -f <local_file>  Add file\n");
+        printf("  -A <manifest>       Add the files listed as \"<exfs2_path>\\t<local_file>\" lines (- for stdin)\n");
+        printf("  -A <exfs2_dir> -f <local_dir>  Add every file below local_dir\n");
+        printf("  -r <exfs2_path>     Remove file/directory\n");
+        printf("  -e <exfs2_path>     Extract file to stdout\n");
+        printf("  -e <exfs2_path> [--offset <n>] [--length <n>]  Extract a byte range to stdout\n");
+        printf("  -D <exfs2_path>     Debug path\n");
+        printf("  -F [--repair]       Check the file system, repairing it with --repair\n");
+        printf("  -S <socket_path>    Serve requests on a Unix socket until SIGINT/SIGTERM\n");
+        printf("Global options (before the command):\n");
+        printf("  --mmap              Access segments through memory mappings\n");
+        printf("  --pread             Access segments with pread/pwrite\n");
+        printf("  --uring             Submit batched block I/O through io_uring\n");
+        printf("  --sync-io           Run batched block I/O one request at a time\n");
+        printf("  --threads <n>       Worker threads used by -e, -A, -l, -r and -F (0: none)\n");
+        printf("  --readahead <n>     Block ranges -e, or files -A, reads ahead\n");
+        printf("  --precreate <n>     Keep n empty segments created ahead of the allocator\n");
+        printf("  --compress          Store the files added by -a, -A and -S compressed\n");
+        printf("  --dedup             Share stored blocks with equal new ones instead of writing them\n");
+        printf("  --segment-size <n>  Segment size of a new file system, 1M to 64M (default 1M)\n");
+        printf("  --stats             Print I/O and allocation counters and timings to stderr on exit\n");
+        return 1;
+    }
+
+    // atexit handlers run last first: the stats come after shutdown_fs()
+    if (show_stats) atexit(print_stats);
+
+    /*** VERY IMPORTANT: INIT FILE SYSTEM ***/
+    exfs2_fs_t* fs = exfs2_open(".");
+    if (!fs) {
+        fprintf(stderr, "Failed to initialize file system\n");
+        return 1;
+    }
+    atexit(shutdown_fs);
+
+    if (strcmp(argv[1], "-l") == 0) {
+        if (argc > 3 || (argc == 3 && strcmp(argv[2], "--long") != 0)) {
+            fprintf(stderr, "Usage: %s -l [--long]\n", argv[0]);
+            return 1;
+        }
+        exfs2_list(argc == 3);
+    } 
+    else if (strcmp(argv[1], "-a") == 0) {
+        if (argc != 5 || strcmp(argv[3], "-f") != 0) {
+            fprintf(stderr, "Usage: %s -a <exfs2_path> -f <local_file>\n", argv[0]);
+            return 1;
+        }
+        exfs2_add(argv[2], argv[4]);
+    }
+    else if (strcmp(argv[1], "-A") == 0) {
+        if (argc == 3) {
+            exfs2_add_batch(argv[2], NULL);
+        } else if (argc == 5 && strcmp(argv[3], "-f") == 0) {
+            exfs2_add_batch(argv[2], argv[4]);
+        } else {
+            fprintf(stderr, "Usage: %s -A <manifest> | -A <exfs2_dir> -f <local_dir>\n", argv[0]);
+            return 1;
+        }
+    }
+    else if (strcmp(argv[1], "-r") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s -r <exfs2_path>\n", argv[0]);
+            return 1;
+        }
+        exfs2_remove(argv[2]);
+    }
+    else if (strcmp(argv[1], "-e") == 0) {
+        long long offset = 0, length = -1;
+        int bad = (argc < 3 || argc % 2 == 0);
+        for (int i = 3; !bad && i + 1 < argc; i += 2) {
+            if (strcmp(argv[i], "--offset") == 0) {
+                bad = (offset = parse_bytes(argv[i + 1])) < 0;
+            } else if (strcmp(argv[i], "--length") == 0) {
+                bad = (length = parse_bytes(argv[i + 1])) < 0;
+            } else {
+                bad = 1;
+            }
+        }
+        if (bad) {
+            fprintf(stderr, "Usage: %s -e <exfs2_path> [--offset <n>] [--length <n>]\n", argv[0]);
+            return 1;
+        }
+        exfs2_extract_range(argv[2], offset, length);
+    }
+    else if (strcmp(argv[1], "-S") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s -S <socket_path>\n", argv[0]);
+            return 1;
+        }
+        return exfs2_serve(fs, argv[2]) == 0 ? 0 : 1;
+    }
+    else if (strcmp(argv[1], "-D") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: %s -D <exfs2_path>\n", argv[0]);
+            return 1;
+        }
+        exfs2_debug(argv[2]);
+    }
+    else if (strcmp(argv[1], "-F") == 0) {
+        if (argc > 3 || (argc == 3 && strcmp(argv[2], "--repair") != 0)) {
+            fprintf(stderr, "Usage: %s -F [--repair]\n", argv[0]);
+            return 1;
+        }
+        return exfs2_check(argc == 3) == 0 ? 0 : 1;
+    }
+    else {
+        printf("Unknown option: %s\n", argv[1]);
+        return 1;
+    }
+
+    return 0;
+}
\ No newline at end of file
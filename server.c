@@ -0,0 +1,254 @@
+/* server.c - Unix socket server mode of the ExFS2 File System
+ *
+ * Requests are single lines; the path is always the rest of the line, so it may
+ * contain spaces:
+ *
+ *   STAT <path>                      OK <file|dir> <size>
+ *   LIST <path>                      OK <bytes>, then one "name" or "name/" line per entry
+ *   READ <offset> <length> <path>    OK <bytes>, then the bytes
+ *   WRITE <length> <path>            (followed by <length> bytes)  OK <length>
+ *   REMOVE <path>                    OK 0
+ *   STATS                            OK <bytes>, then the stats_dump() lines
+ *
+ * Failures answer "ERR <message>". A connection may send any number of requests.
+ *
+ * The file system has a single writer, so connections are served one at a time
+ * in the order they arrive. While one is open the others wait in the listen
+ * backlog, even if it sits idle; clients should hang up when they are done.
+ */
+#include "exfs2.h"
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static volatile sig_atomic_t server_stopping = 0;
+
+static void stop_server(int signo) {
+    (void)signo;
+    server_stopping = 1;
+}
+
+// Growable text buffer for LIST replies
+typedef struct {
+    char* text;
+    size_t length;
+    size_t capacity;
+} listing_t;
+
+static int append_listing(const char* name, int inode_num, int type, void* ctx) {
+    listing_t* listing = ctx;
+    inode_t inode;
+    if (type == INODE_FREE && read_inode(inode_num, &inode) == 0) type = inode.type;
+    int is_dir = (type == INODE_DIR);
+
+    size_t needed = listing->length + strlen(name) + 3;
+    if (needed > listing->capacity) {
+        size_t new_capacity = listing->capacity ? listing->capacity * 2 : 4096;
+        while (new_capacity < needed) new_capacity *= 2;
+        char* grown = realloc(listing->text, new_capacity);
+        if (!grown) return -1;
+        listing->text = grown;
+        listing->capacity = new_capacity;
+    }
+    listing->length += sprintf(listing->text + listing->length, "%s%s\n", name, is_dir ? "/" : "");
+    return 0;
+}
+
+// Read and throw away 'length' payload bytes the request could not use
+static void skip_payload(FILE* in, size_t length) {
+    char scratch[BLOCK_SIZE];
+    while (length > 0) {
+        size_t chunk = length < sizeof(scratch) ? length : sizeof(scratch);
+        if (fread(scratch, 1, chunk, in) != chunk) return;
+        length -= chunk;
+    }
+}
+
+// Returns -1 when the reply broke off after its header
+static int handle_read(exfs2_fs_t* fs, FILE* out, long long offset, long long length, const char* path) {
+    exfs2_stat_t st;
+    if (offset < 0 || length < 0 || exfs2_lookup(fs, path, &st) != 0 || st.type != INODE_FILE) {
+        fprintf(out, "ERR no such file\n");
+        return 0;
+    }
+
+    size_t available = (size_t)offset < st.size ? st.size - offset : 0;
+    size_t total = (size_t)length < available ? (size_t)length : available;
+    char* buffer = malloc(total < SERVER_IO_CHUNK ? (total ? total : 1) : SERVER_IO_CHUNK);
+    if (!buffer) {
+        fprintf(out, "ERR out of memory\n");
+        return 0;
+    }
+
+    // Errors after the header can only be reported by closing the connection
+    int result = 0;
+    fprintf(out, "OK %zu\n", total);
+    for (size_t sent = 0; sent < total; ) {
+        size_t chunk = total - sent < SERVER_IO_CHUNK ? total - sent : SERVER_IO_CHUNK;
+        if (exfs2_read(fs, path, buffer, chunk, offset + sent) != (ssize_t)chunk ||
+            fwrite(buffer, 1, chunk, out) != chunk) {
+            result = -1;
+            break;
+        }
+        sent += chunk;
+    }
+    free(buffer);
+    return result;
+}
+
+static void handle_write(exfs2_fs_t* fs, FILE* in, FILE* out, long long length, const char* path) {
+    char* data = length >= 0 ? malloc(length ? length : 1) : NULL;
+    if (!data) {
+        if (length > 0) skip_payload(in, length);
+        fprintf(out, "ERR bad length\n");
+        return;
+    }
+    if (fread(data, 1, length, in) != (size_t)length) {
+        free(data);
+        fprintf(out, "ERR short payload\n");
+        return;
+    }
+
+    if (exfs2_write(fs, path, data, length) == 0 && exfs2_sync(fs) == 0) {
+        fprintf(out, "OK %lld\n", length);
+    } else {
+        fprintf(out, "ERR write failed\n");
+    }
+    free(data);
+}
+
+// Answer one request line; returns -1 once the connection should be dropped
+static int handle_request(exfs2_fs_t* fs, char* line, FILE* in, FILE* out) {
+    long long offset, length;
+    int consumed = 0;
+
+    if (strncmp(line, "STAT ", 5) == 0) {
+        exfs2_stat_t st;
+        if (exfs2_lookup(fs, line + 5, &st) == 0) {
+            fprintf(out, "OK %s %zu\n", st.type == INODE_DIR ? "dir" : "file", st.size);
+        } else {
+            fprintf(out, "ERR no such path\n");
+        }
+    } else if (strncmp(line, "LIST ", 5) == 0) {
+        listing_t listing = { NULL, 0, 0 };
+        if (exfs2_readdir(fs, line + 5, append_listing, &listing) == 0) {
+            fprintf(out, "OK %zu\n", listing.length);
+            fwrite(listing.text, 1, listing.length, out);
+        } else {
+            fprintf(out, "ERR not a directory\n");
+        }
+        free(listing.text);
+    } else if (sscanf(line, "READ %lld %lld %n", &offset, &length, &consumed) == 2 && consumed > 0) {
+        if (handle_read(fs, out, offset, length, line + consumed) != 0) return -1;
+    } else if (sscanf(line, "WRITE %lld %n", &length, &consumed) == 1 && consumed > 0) {
+        handle_write(fs, in, out, length, line + consumed);
+    } else if (strcmp(line, "STATS") == 0) {
+        char* text = NULL;
+        size_t text_length = 0;
+        FILE* stream = open_memstream(&text, &text_length);
+        if (stream && stats_dump(stream) == 0 && fclose(stream) == 0) {
+            fprintf(out, "OK %zu\n", text_length);
+            fwrite(text, 1, text_length, out);
+        } else {
+            if (stream) fclose(stream);
+            fprintf(out, "ERR out of memory\n");
+        }
+        free(text);
+    } else if (strncmp(line, "REMOVE ", 7) == 0) {
+        if (exfs2_unlink(fs, line + 7) == 0 && exfs2_sync(fs) == 0) {
+            fprintf(out, "OK 0\n");
+        } else {
+            fprintf(out, "ERR remove failed\n");
+        }
+    } else {
+        fprintf(out, "ERR unknown request\n");
+    }
+    return fflush(out) == 0 ? 0 : -1;
+}
+
+// Serve one connection until the client hangs up
+static void serve_connection(exfs2_fs_t* fs, int client) {
+    int out_fd = dup(client);
+    FILE* in = fdopen(client, "r");
+    FILE* out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    if (!in || !out) {
+        if (in) fclose(in); else close(client);
+        if (out) fclose(out); else if (out_fd >= 0) close(out_fd);
+        return;
+    }
+
+    char* line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    while (!server_stopping && (length = getline(&line, &line_size, in)) != -1) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+            line[--length] = '\0';
+        }
+        if (length == 0) continue;
+        if (handle_request(fs, line, in, out) != 0) break;
+    }
+
+    free(line);
+    fclose(in);
+    fclose(out);
+}
+
+// Accept connections on socket_path and answer their requests one at a time,
+// keeping segments, allocators and caches warm, until SIGINT or SIGTERM
+int exfs2_serve(exfs2_fs_t* fs, const char* socket_path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("socket");
+        return -1;
+    }
+    // Only a socket left by an earlier server is replaced; anything else stays
+    struct stat existing;
+    if (lstat(socket_path, &existing) == 0) {
+        if (!S_ISSOCK(existing.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket\n", socket_path);
+            close(listener);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, SERVER_BACKLOG) != 0) {
+        perror("Failed to listen on socket");
+        close(listener);
+        return -1;
+    }
+
+    // No SA_RESTART: a signal has to interrupt accept() so the loop can stop
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_server;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving %s on %s\n", fs->directory, socket_path);
+    fflush(stdout);
+
+    while (!server_stopping) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+        serve_connection(fs, client);
+    }
+
+    close(listener);
+    unlink(socket_path);
+    return exfs2_sync(fs);
+}
@@ -0,0 +1,186 @@
+/* stats.c - Instrumentation counters of the ExFS2 File System
+ *
+ * Every thread counts into a block of its own, found through a thread-local
+ * pointer, so an event costs one store and no lock. Readers sum the live
+ * blocks and the totals of threads that have exited; a thread's block is
+ * folded into those totals by its key destructor.
+ *
+ * Timers are only read while stats_timing is set: stats_clock() returns 0
+ * otherwise, and stats_time() ignores a start of 0.
+ */
+#include "exfs2.h"
+#include <time.h>
+
+int stats_timing = 0;
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_TIMER_BUCKETS];
+} timer_histogram_t;
+
+typedef struct stats_block {
+    uint64_t counters[STAT_COUNTERS];
+    timer_histogram_t timers[STAT_TIMERS];
+    struct stats_block* next;
+} stats_block_t;
+
+static const char* counter_names[] = {
+    "segment_opens", "segment_cache_hits", "segment_creates", "segment_reads", "segment_read_bytes",
+    "segment_writes", "segment_write_bytes", "bitmap_reads", "bitmap_writes", "alloc_segment_loads",
+    "alloc_segment_scans", "inode_allocs", "inode_frees", "inode_reads", "inode_cache_hits",
+    "inode_writes", "block_allocs", "block_frees", "block_shares", "block_reads", "block_cache_hits",
+    "block_writes", "batch_submits", "batch_requests", "dir_lookups", "dentry_cache_hits", "dir_adds",
+    "dir_removes", "dir_splits", "journal_commits", "journal_bytes",
+};
+
+static const char* timer_names[] = {
+    "segment_open", "segment_create", "segment_read", "segment_write", "batch_submit",
+    "dir_lookup", "dir_add", "dir_remove", "journal_commit",
+};
+
+_Static_assert(sizeof(counter_names) / sizeof(counter_names[0]) == STAT_COUNTERS, "a counter has no name");
+_Static_assert(sizeof(timer_names) / sizeof(timer_names[0]) == STAT_TIMERS, "a timer has no name");
+
+static __thread stats_block_t* thread_stats;
+static stats_block_t* live_blocks;
+static stats_block_t retired;       /* threads that have exited */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+// Add one block into 'total'; the owner of a live block may be counting meanwhile
+static void add_block(stats_block_t* total, const stats_block_t* block) {
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+        total->counters[i] += __atomic_load_n(&block->counters[i], __ATOMIC_RELAXED);
+    }
+    for (int t = 0; t < STAT_TIMERS; t++) {
+        const timer_histogram_t* from = &block->timers[t];
+        timer_histogram_t* to = &total->timers[t];
+        to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+        to->total_ns += __atomic_load_n(&from->total_ns, __ATOMIC_RELAXED);
+        uint64_t max_ns = __atomic_load_n(&from->max_ns, __ATOMIC_RELAXED);
+        if (max_ns > to->max_ns) to->max_ns = max_ns;
+        for (int b = 0; b < STATS_TIMER_BUCKETS; b++) {
+            to->buckets[b] += __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Key destructor: fold an exiting thread's counts into the totals
+static void retire_block(void* arg) {
+    stats_block_t* block = arg;
+    pthread_mutex_lock(&stats_lock);
+    add_block(&retired, block);
+    stats_block_t** link = &live_blocks;
+    while (*link != block) link = &(*link)->next;
+    *link = block->next;
+    pthread_mutex_unlock(&stats_lock);
+    free(block);
+}
+
+static void create_key(void) {
+    pthread_key_create(&stats_key, retire_block);
+}
+
+// The calling thread's block, created on its first event; NULL without memory
+static stats_block_t* attach_block(void) {
+    pthread_once(&stats_once, create_key);
+    stats_block_t* block = calloc(1, sizeof(stats_block_t));
+    if (!block) return NULL;
+
+    pthread_mutex_lock(&stats_lock);
+    block->next = live_blocks;
+    live_blocks = block;
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(stats_key, block);
+    thread_stats = block;
+    return block;
+}
+
+// Only the owning thread writes a block, so a plain add published with a
+// relaxed store keeps concurrent readers consistent
+static void bump(uint64_t* value, uint64_t n) {
+    __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+void stats_count(stat_counter_t counter, uint64_t n) {
+    stats_block_t* block = thread_stats ? thread_stats : attach_block();
+    if (block) bump(&block->counters[counter], n);
+}
+
+// Start of a timed operation in nanoseconds, or 0 while timing is off
+uint64_t stats_clock(void) {
+    if (!stats_timing) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec + 1;
+}
+
+// Record the operation started at 'started' (from stats_clock)
+void stats_time(stat_timer_t timer, uint64_t started) {
+    if (started == 0) return;
+    uint64_t elapsed = stats_clock();
+    elapsed = elapsed > started ? elapsed - started : 0;
+
+    stats_block_t* block = thread_stats ? thread_stats : attach_block();
+    if (!block) return;
+    timer_histogram_t* t = &block->timers[timer];
+    int bucket = elapsed ? 64 - __builtin_clzll(elapsed) : 0;
+    if (bucket >= STATS_TIMER_BUCKETS) bucket = STATS_TIMER_BUCKETS - 1;
+    bump(&t->count, 1);
+    bump(&t->total_ns, elapsed);
+    bump(&t->buckets[bucket], 1);
+    if (elapsed > t->max_ns) __atomic_store_n(&t->max_ns, elapsed, __ATOMIC_RELAXED);
+}
+
+static void sum_blocks(stats_block_t* total) {
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&stats_lock);
+    add_block(total, &retired);
+    for (stats_block_t* block = live_blocks; block; block = block->next) add_block(total, block);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Totals of every counter so far, into counters[STAT_COUNTERS]
+void stats_read_counters(uint64_t* counters) {
+    stats_block_t total;
+    sum_blocks(&total);
+    memcpy(counters, total.counters, sizeof(total.counters));
+}
+
+const char* stats_counter_name(stat_counter_t counter) {
+    return counter_names[counter];
+}
+
+// Upper bound of the bucket holding the p-th percentile of a timer, in ns
+static uint64_t timer_percentile(const timer_histogram_t* t, double p) {
+    uint64_t rank = (uint64_t)(p / 100 * t->count + 0.999999), seen = 0;
+    for (int b = 0; b < STATS_TIMER_BUCKETS; b++) {
+        seen += t->buckets[b];
+        if (seen >= rank && seen > 0) return b ? 1ULL << b : 1;
+    }
+    return t->max_ns;
+}
+
+// Print "name value" per counter, then one line per timer that ran:
+// "time.name count N mean_ns M p50_ns A p90_ns B p99_ns C max_ns D", where the
+// percentiles are histogram bucket bounds
+int stats_dump(FILE* out) {
+    stats_block_t total;
+    sum_blocks(&total);
+
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+        fprintf(out, "%s %" PRIu64 "\n", counter_names[i], total.counters[i]);
+    }
+    for (int i = 0; i < STAT_TIMERS; i++) {
+        const timer_histogram_t* t = &total.timers[i];
+        if (t->count == 0) continue;
+        fprintf(out, "time.%s count %" PRIu64 " mean_ns %" PRIu64 " p50_ns %" PRIu64 " p90_ns %" PRIu64
+                     " p99_ns %" PRIu64 " max_ns %" PRIu64 "\n",
+                timer_names[i], t->count, t->total_ns / t->count, timer_percentile(t, 50),
+                timer_percentile(t, 90), timer_percentile(t, 99), t->max_ns);
+    }
+    return ferror(out) ? -1 : 0;
+}